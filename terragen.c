@@ -13,9 +13,18 @@
 
 #include "raylib.h"
 #include "raymath.h"
+#include "rlgl.h"
 #include <math.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
+#ifdef _OPENMP
+#if _OPENMP < 201107
+#error "OpenMP 3.1 or later is needed (tasks, min/max reductions); build without OpenMP instead"
+#endif
+#include <omp.h>
+#endif
 
 /* Constants */
 #define ROUGHNESS 1.20f
@@ -31,12 +40,531 @@
 #define SCREEN_WIDTH 800
 #define SCREEN_HEIGHT 700
 #define UI_HEIGHT 90                // Space for UI at the top
+#define LOD_CELL_PIXELS 1.0f        // Shortest on-screen cell edge of the grid mode
+
+/* Diamond-Square generation orders */
+#define ORDER_BREADTH_FIRST 0       // One full sweep of the grid per level
+#define ORDER_DEPTH_FIRST 1         // Quadrant recursion, subtree stays in cache
+#define ORDER_PARALLEL 2            // Quadrant tasks spread over all cores
+#define DEPTH_FIRST_TILE 128        // Leaf tile of the depth-first order (power of 2)
+#define TASK_TILE 128               // Cutoff of the quadrant tasks (power of 2)
+#ifdef __AVX512F__
+#define ENSEMBLE_LANES 16           // Terrains generated together (one AVX-512 register)
+#else
+#define ENSEMBLE_LANES 8            // Terrains generated together (one AVX register)
+#endif
+
+/* Terrain generators (indices of GENERATORS) */
+#define GENERATOR_DIAMOND_SQUARE 0
+#define GENERATOR_SPECTRAL 1        // 1/f^beta noise through an inverse FFT
+#define GENERATOR_FBM 2             // Octaves of gradient noise, any domain
+#define GENERATOR_COUNT 3
+#define SPECTRAL_BETA 2.4f          // Default spectral exponent (higher = smoother)
+#define SPECTRAL_BETA_MAX 16.0f     // Beyond this only the lowest frequency is left
+#define SPECTRAL_STRIP 256          // Columns transformed together by fft_columns, at most
+#define SPECTRAL_STRIP_MIN 32       // Narrowest strip, for enough strips per thread
+#define FBM_OCTAVES 8
+#define FBM_OCTAVES_MAX 32
+#define FBM_LACUNARITY 2.0f         // Frequency ratio of consecutive octaves
+#define FBM_GAIN 0.5f               // Amplitude ratio of consecutive octaves
+#define FBM_FEATURES 3.0f           // First octave periods across the map
+#define FBM_CHUNK 16                // Rows per task of fbm_generate
+#ifdef __AVX512F__
+#define FBM_LANES 16                // Points per SIMD instruction
+#else
+#define FBM_LANES 8
+#endif
+
+/* Interpolation of terrain_sample_batch */
+#define SAMPLE_BILINEAR 0
+#define SAMPLE_BICUBIC 1            // Catmull-Rom over 4x4 samples
+#define SAMPLE_BLOCK 256            // Queries processed together
+#define SAMPLE_SORT_MIN 4096        // Batches from this size may be Morton-ordered
+#define SAMPLE_SORT_CACHE (32 << 20) // Map bytes from which bicubic batches are sorted (measured)
+#define SAMPLE_SORT_TILE 7          // log2 of the tile side the batches are ordered by
+#define SAMPLE_SORT_DIGIT 11        // Key bits per radix pass
+
+/* Hydraulic erosion (droplets) */
+#define EROSION_TILE 64             // Side of the tiles the droplets start in
+#define EROSION_HALO 32             // Droplet reach around its tile, at most EROSION_TILE / 2
+#define EROSION_LIFETIME 30         // Steps of a droplet (one sample each), below EROSION_HALO
+#define EROSION_TILE_DROPLETS 256   // Droplets per tile and round
+#define EROSION_INERTIA 0.05f       // Share of the old direction kept at each step
+#define EROSION_CAPACITY 4.0f       // Sediment carried per unit of slope, speed and water
+#define EROSION_MIN_CAPACITY 0.01f
+#define EROSION_DEPOSITION 0.3f     // Share of the excess sediment dropped per step
+#define EROSION_RATE 0.3f           // Share of the free capacity eroded per step
+#define EROSION_EVAPORATION 0.02f
+#define EROSION_GRAVITY 4.0f
+
+/* Grid erosion (pipe model and thermal weathering) */
+#define GRID_RAIN 0.01f             // Water added to every sample per iteration
+#define GRID_EVAPORATION 0.05f      // Share of the water lost per iteration
+#define GRID_PIPE_GAIN 0.2f         // Flow gained per unit of water level difference
+#define GRID_CAPACITY 10.0f         // Sediment carried per unit of slope and flow
+#define GRID_MIN_SLOPE 0.05f        // Lets water on flat ground still carry some sediment
+#define GRID_DISSOLVE 0.1f          // Share of the free capacity dissolved per iteration
+#define GRID_DEPOSIT 0.1f           // Share of the excess sediment dropped per iteration
+#define GRID_TALUS 0.6f             // Steepest stable slope of the thermal pass
+#define GRID_THERMAL_RATE 0.1f      // Share of the excess slope moved per iteration (at most 1/8)
+
+/* Post-processing filters */
+#define FILTER_MAX 16               // Stages of a filter chain
+#define FILTER_MAX_RADIUS 4         // Largest stencil radius of a filter
+#define FILTER_BAND 32              // Rows per task of filter_chain_run
+#define FILTER_KIND_COUNT 4
+
+/* Blur stage */
+#define BLUR_NONE 0
+#define BLUR_GAUSSIAN 1
+#define BLUR_BOX 2                  // Repeated box blur, O(1) per sample whatever the radius
+#define BLUR_MAX_RADIUS 32
+#define BLUR_MIN_SIGMA 0.1f         // Smallest sigma, the kernel is a single tap by then
+#define BLUR_STRIP 64               // Columns (or rows) blurred together, one vector each
+#define BLUR_TILE 16                // Side of the transposition tiles
+
+/* Heightmap export */
+#define EXPORT_RAW 0                // Little-endian float32
+#define EXPORT_R16 1                // Little-endian int16
+#define EXPORT_PGM 2                // 16-bit binary PGM
+#define EXPORT_PNG 3                // 16-bit grayscale PNG
+#define EXPORT_OBJ 4                // Wavefront OBJ triangle mesh
+#define EXPORT_PLY 5                // Binary PLY triangle mesh
+#define EXPORT_GLB 6                // Binary glTF triangle mesh
+#define EXPORT_FORMAT_COUNT 7
+#define EXPORT_PNG_BLOCK 64         // Rows per independently compressed PNG block
+#define EXPORT_MESH_CHUNK 4096      // Vertices or triangles per encoding task of the mesh writers
+#define EXPORT_MESH_RUNS 64         // Tasks encoded together, then written
+#define RASTER_TILE 64              // Pixels per side of the tiles of the software renderer
+
+/* Rendering */
+#define RENDER_GRID 0               // Every cell of the grid
+#define RENDER_RTIN 1               // Triangles of the RTIN simplification
+#define RENDER_HORIZON 2            // Grid without its hidden lines (floating horizon)
+#define RENDER_SHADED 3             // Filled cells with Lambert shading
+#define RENDER_FLY 4                // Perspective fly-through of chunk meshes
+#define RENDER_MODE_COUNT 5
+#define SHADE_AMBIENT 0.35f         // Light of the cells facing away from the sun
+#define HORIZON_EPSILON 0.01f       // Pixels: lines this close to the horizon stay visible
+#define CHUNK_CELLS 64              // Cells per side of the fly mode chunks (power of 2)
+#define CHUNK_LODS 4                // Meshes per chunk, level k with cells of 2^k samples
+#define FLY_WORLD_SIZE 512.0f       // World units across the map in the fly mode
+#define FLY_FOVY 60.0f              // Vertical field of view (degrees)
+#define FLY_NEAR 0.01f              // Clipping planes of raylib's perspective
+#define FLY_FAR 1000.0f
+#define FLY_LOD_PIXELS 4.0f         // Largest on-screen cell before a finer level is used
+#define FLY_SPEED 60.0f             // World units per second (4 times with shift)
+#define FLY_TURN_SPEED 1.5f         // Radians per second with the arrow keys
+#define RTIN_DRAW_ERROR 1.0f        // Height error of the RTIN mode without --simplify
+#define RTIN_TASK_DEPTH 8           // Triangle tree levels split into tasks by rtin_init
+#define DEFLATE_WINDOW 32768        // LZ77 window of deflate
+#define DEFLATE_HASH_BITS 15
+#define DEFLATE_HASH_SIZE (1 << DEFLATE_HASH_BITS)
+#define DEFLATE_CHAIN 4             // Match candidates tried per position
+
+/* Stages of regenerate_terrain, timed separately */
+#define STAGE_GENERATE 0
+#define STAGE_BLUR 1
+#define STAGE_EROSION 2
+#define STAGE_FILTERS 3
+#define STAGE_PYRAMID 4
+#define STAGE_STATS 5
+#define STAGE_COUNT 6
+
+/* Heightmap sample access, laid out like terrain[x][y] */
+#define MAP_AT(map, size, x, y) ((map)[(size_t)(x) * (size_t)(size) + (size_t)(y)])
+#define DS_AT(ds, x, y) MAP_AT((ds)->map, (ds)->stride, (x) - (ds)->origin_x, (y) - (ds)->origin_y)
+
+/* State shared by the Diamond-Square traversals */
+typedef struct DiamondSquare
+{
+    float *map;                     // Samples of the window below
+    int origin_x, origin_y;         // Grid position of map[0] (0 for the whole grid)
+    int stride;                     // Samples per map row (size for the whole grid)
+    int size;                       // Grid side, 2^n+1
+    unsigned int seed;              // Noise seed
+    float amplitude[32];            // Noise amplitude indexed by log2(half)
+} DiamondSquare;
+
+/* Per-thread terrain, used where the global terrain can't be shared */
+typedef struct TerrainContext
+{
+    float *map;                     // size * size samples, laid out like terrain[x][y]
+    int size;                       // Grid side, 2^n+1
+    unsigned int seed;              // Seed of the last generation
+    float min_height, max_height;   // Filled by terrain_context_min_max
+} TerrainContext;
+
+/* Min/max pyramid: level k splits the map in cells of 2^k x 2^k samples
+   (edges shared with the neighbours), the top level is the whole map */
+typedef struct HeightPyramid
+{
+    const float *map;               // Heightmap it was built from
+    int size;                       // Grid side of the map, 2^n+1
+    int levels;                     // n + 1 (0 = not built)
+    float *min[32], *max[32];       // Per-level cell bounds, [cx * cells + cy]
+} HeightPyramid;
+
+/* Mip pyramid: level k samples the map every 2^k samples, each sample the
+   1-2-1 average of the level below (level 0 is the map itself) */
+typedef struct HeightMips
+{
+    const float *map;               // Heightmap it was built from (level 0)
+    int size;                       // Grid side of the map, 2^n+1
+    int levels;                     // n + 1 (0 = not built)
+    float *level[32];               // (size - 1) / 2^k + 1 samples per side, [1, levels)
+} HeightMips;
+
+/* Tables of the radix-2 FFT of spectral_generate */
+typedef struct FFTPlan
+{
+    int n;                          // Transform length, power of 2
+    int *bit_reverse;               // Index permutation of the input
+    float *twiddle_re, *twiddle_im; // Stage with 'half' butterflies at [half, 2 * half)
+} FFTPlan;
+
+/* Parameters of the fBm generator */
+typedef struct FbmSettings
+{
+    int octaves;
+    float lacunarity;               // Frequency ratio of consecutive octaves
+    float gain;                     // Amplitude ratio of consecutive octaves
+    float frequency;                // Periods per sample of the first octave
+} FbmSettings;
+
+/* Terrain generator: init creates the state of one terrain (NULL if out of
+   memory), generate_region fills any rectangle of its size x size map
+   (out[i * stride + j] = sample (x0 + i, y0 + j), 0 if out of memory) */
+typedef struct Generator
+{
+    const char *name;               // Name of the --generator option
+    void *(*init)(int size, unsigned int seed);
+    int (*generate_region)(void *state, float *out, int stride, int x0, int y0, int width, int height);
+    void (*destroy)(void *state);
+} Generator;
+
+/* State of the whole-map generators */
+typedef struct MapGeneratorState
+{
+    int size;
+    unsigned int seed;
+    float *map;                     // Whole map, made on the first partial region
+} MapGeneratorState;
+
+/* State of the fBm generator */
+typedef struct FbmGeneratorState
+{
+    unsigned int seed;
+    FbmSettings settings;
+} FbmGeneratorState;
+
+/* Post-processing filter: apply computes the output row x from the input
+   rows x - radius .. x + radius (rows[0 .. 2 * radius], clamped to the map) */
+typedef struct Filter
+{
+    const char *name;               // Name of the --filter option
+    int radius;                     // Rows read above and below (0 = point-wise)
+    void (*apply)(const float *const *rows, float *out, int size, const float *params);
+    float params[2];
+} Filter;
+
+/* Filters applied one after the other */
+typedef struct FilterChain
+{
+    Filter stages[FILTER_MAX];
+    int count;
+} FilterChain;
+
+/* Weights of a separable blur */
+typedef struct BlurKernel
+{
+    int radius;
+    int box;                        // Running sum instead of the weights
+    float weights[2 * BLUR_MAX_RADIUS + 1];
+} BlurKernel;
+
+/* Parameters of the blur stage */
+typedef struct BlurSettings
+{
+    int type;                       // BLUR_NONE, BLUR_GAUSSIAN or BLUR_BOX
+    float sigma;                    // Gaussian standard deviation (samples)
+    int radius;                     // Box radius (samples)
+    int passes;                     // Box passes
+} BlurSettings;
+
+/* Vertex errors of the RTIN simplification of a map */
+typedef struct Rtin
+{
+    int size;                       // Grid side, 2^n+1
+    float *errors;                  // Per vertex: error of the mesh without it, laid out like the map
+    unsigned int *indices;          // Vertex number + 1 during an extraction, else 0
+} Rtin;
+
+/* Mesh extracted by rtin_extract */
+typedef struct RtinMesh
+{
+    int vertex_count, triangle_count;
+    int *vertices;                  // Map x, y of every vertex
+    unsigned int *triangles;        // 3 vertices per triangle, counter-clockwise from above
+    int vertex_capacity, triangle_capacity;
+} RtinMesh;
+
+/* Lines of the grid along x and y, cut in strips of one colour, in screen coordinates */
+typedef struct GridStrips
+{
+    unsigned int version;           // terrain_version they were built for (0 = never)
+    int point_count, point_capacity;
+    Vector2 *points;
+    int strip_count, strip_capacity;
+    int *first;                     // First point of every strip, first[strip_count] = point_count
+    Color *colors;                  // 1 per strip
+} GridStrips;
+
+/* Filled cells of the shaded mode: one raylib mesh of screen-space
+   triangles, back to front */
+typedef struct ShadedMesh
+{
+    unsigned int version;           // terrain_version it was built for (0 = never)
+    Mesh mesh;
+    Material material;
+    int uploaded;                   // Mesh in GPU memory
+    int material_loaded;
+} ShadedMesh;
+
+/* Square of CHUNK_CELLS cells of the fly mode, at every level of detail */
+typedef struct FlyChunk
+{
+    BoundingBox box;                // World bounds, skirts included
+    Mesh lods[CHUNK_LODS];          // Level k: cells of 2^k samples (vertexCount 0 = not built)
+} FlyChunk;
+
+/* Chunked terrain of the fly mode, rebuilt with the terrain */
+typedef struct FlyTerrain
+{
+    unsigned int version;           // terrain_version it was built for (0 = never)
+    int chunks_per_side, lods;
+    FlyChunk *chunks;
+    Material material;
+    int material_loaded;
+    int drawn;                      // Chunks drawn by the last frame
+} FlyTerrain;
+
+/* Free camera of the fly mode */
+typedef struct FlyCamera
+{
+    Camera3D camera;
+    float yaw, pitch;               // Radians, yaw 0 looks towards +Z
+    int ready;                      // Placed once, then kept across terrains
+} FlyCamera;
+
+/* View frustum: a point p is inside when dot(normal, p) + offset >= 0 for all 6 planes */
+typedef struct Frustum
+{
+    Vector3 normal[6];
+    float offset[6];
+} Frustum;
+
+/* Visible segments of the grid found by horizon_build, in screen coordinates */
+typedef struct HorizonLines
+{
+    unsigned int version;           // terrain_version they were built for (0 = never)
+    int count, capacity;            // Segments
+    Vector2 *points;                // 2 per segment
+    Color *colors;                  // 1 per segment
+} HorizonLines;
+
+/* Heightmap exported as a triangle mesh */
+typedef struct MeshExport
+{
+    const float *map;
+    int size;
+    float low, high;                // Height range of the colours
+    const RtinMesh *rtin;           // Simplified mesh (NULL = full grid)
+} MeshExport;
+
+/* Image written by png_write: a map as 16-bit grayscale (map rows are
+   image rows, high..low mapped to 0..65535) or 8-bit RGB pixels */
+typedef struct PngImage
+{
+    int width, height;
+    const float *map;               // Grayscale samples (NULL for RGB)
+    float low, high;
+    const unsigned char *pixels;    // RGB, 3 bytes per pixel, rows top to bottom (NULL for grayscale)
+} PngImage;
+
+/* Output of the deflate compressor, LSB-first bit stream */
+typedef struct DeflateStream
+{
+    unsigned char *out;
+    size_t length;                  // Whole bytes written
+    unsigned long long bit_buffer;  // Bits not yet written
+    int bit_count;
+} DeflateStream;
+
+/* Fixed-Huffman deflate codes (bit-reversed) and the CRC-32 table */
+typedef struct DeflateTables
+{
+    int ready;
+    unsigned short literal_code[288];
+    unsigned char literal_bits[288];
+    unsigned short length_symbol[259];  // By match length 3..258
+    unsigned char length_extra[259];
+    unsigned short length_offset[259];  // Value of the extra bits
+    unsigned char distance_code[30];
+    unsigned char distance_extra[30];
+    unsigned short distance_base[30];
+    unsigned char distance_symbol[512]; // By distance - 1 up to 256, then by (distance - 1) >> 7
+    unsigned int crc[256];
+} DeflateTables;
+
+/* Query of terrain_sample_batch while it is sorted */
+typedef struct SampleQuery
+{
+    unsigned int key;               // Morton code of the tile
+    unsigned int index;             // Position in the caller arrays
+    float x, y;
+} SampleQuery;
+
+/* Command line options */
+typedef struct Options
+{
+    int bench;                      // Run the benchmarks and exit
+    int batch_count;                // Terrains of the batch run (0 = interactive)
+    int size;                       // Grid side of the headless modes
+    int has_seed;                   // Seed given on the command line
+    unsigned int seed;
+    const char *output_dir;         // Batch exports (NULL = no export stage)
+    const char *export_path;        // Single terrain export (format from the extension)
+    const char *render_path;        // Single terrain image (.png or .ppm)
+    int render_width, render_height;
+    int erosion_droplets;           // Droplets of the erosion stage (0 = no droplet erosion)
+    int erosion_iterations;         // Iterations of the grid erosion (0 = no grid erosion)
+    int idle;                       // Draw frames only on input and window events
+} Options;
 
 /* Function declarations */
+int parse_options(int argc, char *argv[], Options *options);
+void regenerate_terrain(void);
 void generate_terrain(void);
-float calculate_noise(float amplitude);
+void diamond_square_breadth_first(float *map, int size, unsigned int seed);
+void diamond_square_depth_first(float *map, int size, unsigned int seed);
+void diamond_square_parallel(float *map, int size, unsigned int seed);
+int diamond_square_ensemble(float *maps[ENSEMBLE_LANES], int size, const unsigned int seeds[ENSEMBLE_LANES]);
+int spectral_generate(float *map, int size, unsigned int seed, float beta);
+void fbm_generate_region(float *out, int stride, int x0, int y0, int width, int height,
+                         unsigned int seed, const FbmSettings *settings);
+void fbm_generate(float *map, int size, unsigned int seed, const FbmSettings *settings);
+int generator_generate(const Generator *gen, float *map, int size, unsigned int seed);
+const Generator *find_generator(const char *name);
+static void *map_generator_init(int size, unsigned int seed);
+static void map_generator_destroy(void *state);
+static int diamond_square_generator_region(void *state, float *out, int stride, int x0, int y0, int width, int height);
+static int spectral_generator_region(void *state, float *out, int stride, int x0, int y0, int width, int height);
+static void *fbm_generator_init(int size, unsigned int seed);
+static int fbm_generator_region(void *state, float *out, int stride, int x0, int y0, int width, int height);
+static void fbm_generator_destroy(void *state);
+int erode_hydraulic(float *map, int size, int droplets, unsigned int seed);
+int erode_grid(float *map, int size, int iterations);
+void erode_terrain(float *map, int size, unsigned int seed);
+static void filter_smooth(const float *const *rows, float *out, int size, const float *params);
+static void filter_terrace(const float *const *rows, float *out, int size, const float *params);
+static void filter_redistribute(const float *const *rows, float *out, int size, const float *params);
+static void filter_sea_level(const float *const *rows, float *out, int size, const float *params);
+int filter_chain_add(FilterChain *chain, const char *name, int param_count, const float *params);
+int is_valid_filter(const Filter *filter);
+int filter_chain_run(const FilterChain *chain, float *map, int size);
+void filter_terrain(float *map, int size);
+int blur_gaussian(float *map, int size, float sigma);
+int blur_box(float *map, int size, int radius, int passes);
+void blur_terrain(float *map, int size);
+int is_valid_blur(const BlurSettings *blur);
+float calculate_noise(float amplitude, unsigned int seed, int x, int y);
+unsigned int hash_position(unsigned int seed, int x, int y);
+int run_benchmark(void);
+int run_ensemble_benchmark(void);
+double get_time_seconds(void);
+int get_thread_count(void);
+int get_thread_index(void);
+int is_valid_size(int size);
+int is_valid_fbm(const FbmSettings *settings);
+int terrain_context_init(TerrainContext *ctx, int size);
+void terrain_context_free(TerrainContext *ctx);
+void terrain_context_generate(TerrainContext *ctx, unsigned int seed);
+void terrain_context_min_max(TerrainContext *ctx);
+int find_export_format(const char *name);
+int export_format_of_path(const char *path);
+int export_heightmap(const float *map, int size, float low, float high, int format, const char *path);
+int terrain_context_export(const TerrainContext *ctx, const char *path, int format);
+int run_export(int size, unsigned int seed, const char *path);
+int png_write(const PngImage *image, FILE *file);
+int render_terrain(const float *map, int size, float low, float high, int width, int height, unsigned char *pixels);
+int write_image(const char *path, const unsigned char *pixels, int width, int height);
+int image_format_of_path(const char *path);
+int run_render(int size, unsigned int seed, const char *path, int width, int height);
+int run_batch(int count, int size, unsigned int first_seed, const char *output_dir);
+void find_min_max(const float *map, size_t count, float *min_value, float *max_value);
+int height_pyramid_build(HeightPyramid *pyramid, const float *map, int size);
+void height_pyramid_free(HeightPyramid *pyramid);
+void height_pyramid_bounds(const HeightPyramid *pyramid, int x0, int y0, int x1, int y1, float *min_value, float *max_value);
+int height_mips_build(HeightMips *mips, const float *map, int size);
+void height_mips_free(HeightMips *mips);
+const float *height_mips_level(const HeightMips *mips, int level);
+void height_pyramid_query(const HeightPyramid *pyramid, int x0, int y0, int x1, int y1, float *min_value, float *max_value);
+int run_pyramid_benchmark(void);
+int terrain_ray_intersect(const HeightPyramid *pyramid, Vector3 origin, Vector3 direction, float max_t, float *hit_t);
+int terrain_line_of_sight(const HeightPyramid *pyramid, Vector3 from, Vector3 to);
+void terrain_ray_intersect_batch(const HeightPyramid *pyramid, const Vector3 *origins, const Vector3 *directions,
+                                 int count, float max_t, float *hit_t);
+void terrain_line_of_sight_batch(const HeightPyramid *pyramid, const Vector3 *from, const Vector3 *to,
+                                 int count, unsigned char *visible);
+void terrain_viewshed(const HeightPyramid *pyramid, int observer_x, int observer_y, float eye_height,
+                      unsigned char *visible);
+int run_query_benchmark(void);
+int terrain_sample_batch(const float *map, int size, const float *xs, const float *ys, int count, int filter,
+                         float *heights, float *gradient_x, float *gradient_y);
+int run_sampling_benchmark(void);
+int run_erosion_benchmark(void);
+int run_spectral_benchmark(void);
+int run_fbm_benchmark(void);
+int run_generator_benchmark(void);
+int run_filter_benchmark(void);
+int run_blur_benchmark(void);
+int run_export_benchmark(void);
+int run_render_benchmark(void);
+int rtin_init(Rtin *rtin, const float *map, int size);
+void rtin_free(Rtin *rtin);
+int rtin_extract(Rtin *rtin, float max_error, RtinMesh *mesh);
+void rtin_mesh_free(RtinMesh *mesh);
+int run_rtin_benchmark(void);
 void calculate_view_parameters(void);
+void fit_view(const float *map, int size, int width, int height, int top, float *scale, float *view_x, float *view_y);
+int lod_level(float scale, int levels);
+int terrain_lod_level(void);
 void draw_terrain_3d(void);
+void draw_terrain_rtin(void);
+Color grid_edge_color(const float *heights, int side, int x, int y);
+int grid_strips_build(GridStrips *strips, const float *heights, int side, int step);
+int grid_strips_start(GridStrips *strips, Color color);
+int grid_strips_point(GridStrips *strips, const float *heights, int side, int step, int x, int y);
+void grid_strips_free(GridStrips *strips);
+int horizon_build(HorizonLines *lines, const float *heights, int side, int step);
+int horizon_edge(HorizonLines *lines, float *upper, float *lower, Vector2 a, Vector2 b, Color color);
+int horizon_add(HorizonLines *lines, Vector2 a, Vector2 b, Color color);
+void horizon_free(HorizonLines *lines);
+void draw_terrain_horizon(void);
+void terrain_shade(const float *map, int side, float spacing, float *shade);
+int shaded_mesh_build(Mesh *mesh, const float *heights, int side, int step);
+void shaded_mesh_free(ShadedMesh *shaded);
+void draw_terrain_shaded(void);
+int fly_terrain_build(FlyTerrain *fly);
+int fly_chunk_mesh(Mesh *mesh, const float *heights, const float *shade, int side, int x0, int y0, int cells, int step,
+                   float drop);
+void fly_chunks_free(FlyTerrain *fly);
+void fly_terrain_free(FlyTerrain *fly);
+void fly_camera_update(FlyCamera *fly, float dt);
+void frustum_from_camera(const Camera3D *camera, float aspect, Frustum *frustum);
+int frustum_contains_box(const Frustum *frustum, BoundingBox box);
+void draw_terrain_fly(void);
 void draw_reference_axes(void);
 Vector2 isometric_projection(float x, float y, float z);
 Color calculate_height_color(float height, float max_height, float min_height);
@@ -46,11 +574,54 @@ void reset_canvas_corners(void);
 /* Global variables */
 float terrain[ITERATIONS][ITERATIONS];
 float min_height, max_height;
+unsigned int terrain_seed;
+int generation_order = ORDER_BREADTH_FIRST;
+int generator = GENERATOR_DIAMOND_SQUARE;
+const Generator GENERATORS[GENERATOR_COUNT] = {
+    {"diamond-square", map_generator_init, diamond_square_generator_region, map_generator_destroy},
+    {"spectral", map_generator_init, spectral_generator_region, map_generator_destroy},
+    {"fbm", fbm_generator_init, fbm_generator_region, fbm_generator_destroy}
+};
+float spectral_beta = SPECTRAL_BETA;
+FbmSettings fbm_settings = {FBM_OCTAVES, FBM_LACUNARITY, FBM_GAIN, 0.0f};    // Frequency set per map size
+HeightPyramid terrain_pyramid;
+HeightMips terrain_mips;            // Decimated grids of the grid mode
+int erosion_droplets = 0;
+int erosion_iterations = 0;
+const Filter FILTER_KINDS[FILTER_KIND_COUNT] = {
+    {"smooth", 1, filter_smooth, {0.5f, 0.0f}},             // strength
+    {"terrace", 0, filter_terrace, {5.0f, 4.0f}},           // step, sharpness
+    {"redistribute", 0, filter_redistribute, {2.0f, 0.0f}}, // exponent
+    {"sea-level", 0, filter_sea_level, {0.0f, 0.0f}}        // level
+};
+FilterChain filter_chain;           // --filter stages, run after the erosion
+BlurSettings blur_settings = {BLUR_NONE, 1.0f, 2, 3};
+const char *const EXPORT_FORMATS[EXPORT_FORMAT_COUNT] = {"raw", "r16", "pgm", "png", "obj", "ply", "glb"};
+int export_format = EXPORT_RAW;     // Format of the batch exports
+DeflateTables deflate_tables;
+float simplify_error = -1.0f;       // --simplify: RTIN error of the meshes (< 0 = full grid)
+int render_mode = RENDER_GRID;
+const char *const RENDER_MODES[RENDER_MODE_COUNT] = {"grid", "rtin", "horizon", "shaded", "fly"};
+Rtin terrain_rtin;
+RtinMesh terrain_rtin_mesh;         // Drawn by the RTIN mode
+GridStrips terrain_strips;          // Drawn by the grid mode, rebuilt with the terrain
+HorizonLines terrain_horizon;       // Drawn by the horizon mode, rebuilt with the terrain
+ShadedMesh terrain_shaded;          // Drawn by the shaded mode, rebuilt with the terrain
+FlyTerrain terrain_fly;             // Drawn by the fly mode, rebuilt with the terrain
+FlyCamera fly_camera;
+unsigned int terrain_version;       // Incremented by every regeneration, keys the draw caches
+double stage_time[STAGE_COUNT];     // Seconds spent per stage by the last regeneration
 
 /* Dynamically calculated view parameters */
 float render_scale;
 float offset_x, offset_y;
 
+/* 1 / neighbour count of the diamond step. With -ffast-math a division may
+   become an approximate reciprocal in vector code only; a multiplication
+   rounds the same everywhere, and all the generation paths must agree to
+   the last bit (the Makefile also disables -fassociative-math for this). */
+const float INVERSE_COUNT[5] = {0.0f, 1.0f, 1.0f / 2.0f, 1.0f / 3.0f, 1.0f / 4.0f};
+
 /* Terrain colors */
 const Color COLOR_WATER = {30, 90, 180, 255};
 const Color COLOR_SAND = {210, 180, 140, 255};
@@ -58,52 +629,431 @@ const Color COLOR_GRASS = {50, 150, 50, 255};
 const Color COLOR_ROCK = {120, 100, 80, 255};
 const Color COLOR_SNOW = {240, 240, 255, 255}; 
 
+/* Direction of the sun of the shaded mode: map x, map y, height up (the
+   screen's up is -z). From the top left of the screen. */
+const Vector3 SHADE_LIGHT = {-0.3f, 0.8f, 0.6f};
+
 /* ----------------------------------------------------------------------------
  * Main function
  * ---------------------------------------------------------------------------- */
-int main(void)
+int main(int argc, char *argv[])
 {
+    Options options;
+    
     srand((unsigned int)time(NULL));
     
+    /* Command line options: headless modes exit without opening a window */
+    if (!parse_options(argc, argv, &options)) return 1;
+    if (options.has_seed) srand(options.seed);
+    if (options.bench) return run_benchmark();
+    erosion_droplets = options.erosion_droplets;
+    erosion_iterations = options.erosion_iterations;
+    if (options.render_path != NULL && options.batch_count == 0)
+    {
+        unsigned int seed = options.has_seed ? options.seed : (unsigned int)rand();
+        return run_render(options.size, seed, options.render_path, options.render_width, options.render_height);
+    }
+    if (options.export_path != NULL && options.batch_count == 0)
+    {
+        unsigned int seed = options.has_seed ? options.seed : (unsigned int)rand();
+        return run_export(options.size, seed, options.export_path);
+    }
+    if (options.batch_count > 0)
+    {
+        unsigned int first_seed = options.has_seed ? options.seed : (unsigned int)rand();
+        return run_batch(options.batch_count, options.size, first_seed, options.output_dir);
+    }
+    
     InitWindow(SCREEN_WIDTH, SCREEN_HEIGHT, "3D World - Virtual Mountains");
     SetTargetFPS(60);
     
+    /* Idle mode: EndDrawing sleeps until the next input or window event.
+       Regenerations run on SPACE, so their frame is one of those. */
+    if (options.idle) EnableEventWaiting();
+    
     /* Generate initial terrain and calculate view parameters */
-    reset_canvas_corners();
-    generate_terrain();
-    calculate_min_max_height();
-    calculate_view_parameters();
+    regenerate_terrain();
+    
+    /* The terrain is drawn into this texture only when it or the mode
+       changes; the frames copy it and draw the axes and the HUD on top */
+    RenderTexture2D terrain_texture = LoadRenderTexture(SCREEN_WIDTH, SCREEN_HEIGHT);
+    unsigned int texture_version = 0;
+    int texture_mode = -1;
     
     while (!WindowShouldClose())
     {
-        /* SPACE redraws the terrain */
+        /* SPACE redraws the terrain, M switches the render mode */
         if (IsKeyPressed(KEY_SPACE))
         {
-            reset_canvas_corners();
-            generate_terrain();
-            calculate_min_max_height();
-            calculate_view_parameters();
+            regenerate_terrain();
+        }
+        if (IsKeyPressed(KEY_M))
+        {
+            render_mode = (render_mode + 1) % RENDER_MODE_COUNT;
+            
+            /* The fly mode moves while keys are held, without new events */
+            if (options.idle && render_mode == RENDER_FLY) DisableEventWaiting();
+            else if (options.idle) EnableEventWaiting();
+        }
+        if (render_mode == RENDER_FLY)
+        {
+            fly_camera_update(&fly_camera, GetFrameTime());
+        }
+        
+        /* Terrain rendering, into the texture if it is out of date (the
+           fly mode changes every frame and is drawn directly) */
+        int cached = terrain_texture.id != 0 && render_mode != RENDER_FLY;
+        if (cached && (texture_version != terrain_version || texture_mode != render_mode))
+        {
+            BeginTextureMode(terrain_texture);
+            ClearBackground(BLACK);
+            draw_terrain_3d();
+            EndTextureMode();
+            
+            texture_version = terrain_version;
+            texture_mode = render_mode;
         }
         
-        /* Terrain rendering */
         BeginDrawing();
         ClearBackground(BLACK);
         
-        draw_terrain_3d();
-        draw_reference_axes();
+        if (cached)
+        {
+            /* Render textures are stored bottom-up */
+            DrawTextureRec(terrain_texture.texture,
+                           (Rectangle){0, 0, (float)terrain_texture.texture.width, -(float)terrain_texture.texture.height},
+                           (Vector2){0, 0}, WHITE);
+        }
+        else
+        {
+            draw_terrain_3d();
+        }
+        if (render_mode != RENDER_FLY)
+        {
+            draw_reference_axes();
+        }
+        else
+        {
+            DrawText(TextFormat("WASD: Move | Q/E: Down/Up | Arrows, right mouse: Look | Chunks drawn: %d/%d",
+                                terrain_fly.drawn, terrain_fly.chunks_per_side * terrain_fly.chunks_per_side),
+                     10, SCREEN_HEIGHT - 24, 16, LIGHTGRAY);
+        }
         
         /* Display all information related to code generation */
-        DrawText("SPACE: Regenerate terrain | ESC: Exit", 10, 10, 20, RAYWHITE);
+        DrawText(TextFormat("SPACE: Regenerate terrain | M: Mode (%s) | ESC: Exit", RENDER_MODES[render_mode]),
+                 10, 10, 20, RAYWHITE);
         DrawText(TextFormat("Height min: %.1f  max: %.1f", min_height, max_height), 10, 40, 16, LIGHTGRAY);
-        DrawText(TextFormat("Resolution: %dx%d - Scale: %.2f", ITERATIONS, ITERATIONS, render_scale), 10, 60, 16, LIGHTGRAY);
+        DrawText(TextFormat("Resolution: %dx%d - Scale: %.2f - Stride: %d", ITERATIONS, ITERATIONS, render_scale,
+                            1 << terrain_lod_level()), 10, 60, 16, LIGHTGRAY);
+        DrawText(TextFormat("Generate: %.1f ms  Blur: %.1f ms  Erosion: %.1f ms", stage_time[STAGE_GENERATE] * 1000.0,
+                            stage_time[STAGE_BLUR] * 1000.0, stage_time[STAGE_EROSION] * 1000.0), 420, 40, 16, LIGHTGRAY);
+        DrawText(TextFormat("Filters: %.1f ms  Pyramid: %.1f ms  Stats: %.1f ms", stage_time[STAGE_FILTERS] * 1000.0,
+                            stage_time[STAGE_PYRAMID] * 1000.0, stage_time[STAGE_STATS] * 1000.0), 420, 60, 16, LIGHTGRAY);
         
         EndDrawing();
     }
     
+    height_pyramid_free(&terrain_pyramid);
+    height_mips_free(&terrain_mips);
+    rtin_free(&terrain_rtin);
+    rtin_mesh_free(&terrain_rtin_mesh);
+    grid_strips_free(&terrain_strips);
+    horizon_free(&terrain_horizon);
+    shaded_mesh_free(&terrain_shaded);
+    fly_terrain_free(&terrain_fly);
+    UnloadRenderTexture(terrain_texture);
     CloseWindow();
     return 0;
 }
 
+/* ----------------------------------------------------------------------------
+ * Parse the command line. Returns 0 on invalid options.
+ * ---------------------------------------------------------------------------- */
+int parse_options(int argc, char *argv[], Options *options)
+{
+    memset(options, 0, sizeof(*options));
+    options->size = ITERATIONS;
+    options->render_width = SCREEN_WIDTH;
+    options->render_height = SCREEN_HEIGHT;
+    
+    for (int i = 1; i < argc; i++)
+    {
+        const char *arg = argv[i];
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+        
+        if (strcmp(arg, "--bench") == 0) options->bench = 1;
+        else if (strcmp(arg, "--idle") == 0) options->idle = 1;
+        else if (strcmp(arg, "--depth-first") == 0) generation_order = ORDER_DEPTH_FIRST;
+        else if (strcmp(arg, "--parallel") == 0) generation_order = ORDER_PARALLEL;
+        else if (strcmp(arg, "--threads") == 0 && value != NULL)
+        {
+            if (atoi(value) < 1)
+            {
+                fprintf(stderr, "Invalid thread count: %s (1 or more)\n", value);
+                return 0;
+            }
+#ifdef _OPENMP
+            omp_set_num_threads(atoi(value));
+#endif
+            i++;
+        }
+        else if (strcmp(arg, "--batch") == 0 && value != NULL)
+        {
+            options->batch_count = atoi(value);
+            if (options->batch_count < 1)
+            {
+                fprintf(stderr, "Invalid batch count: %s (1 or more)\n", value);
+                return 0;
+            }
+            i++;
+        }
+        else if (strcmp(arg, "--size") == 0 && value != NULL)
+        {
+            options->size = atoi(value);
+            i++;
+        }
+        else if (strcmp(arg, "--seed") == 0 && value != NULL)
+        {
+            options->seed = (unsigned int)strtoul(value, NULL, 10);
+            options->has_seed = 1;
+            i++;
+        }
+        else if (strcmp(arg, "--output") == 0 && value != NULL)
+        {
+            options->output_dir = value;
+            i++;
+        }
+        else if (strcmp(arg, "--format") == 0 && value != NULL)
+        {
+            export_format = find_export_format(value);
+            if (export_format < 0)
+            {
+                fprintf(stderr, "Unknown export format: %s (raw, r16, pgm, png, obj, ply, glb)\n", value);
+                return 0;
+            }
+            i++;
+        }
+        else if (strcmp(arg, "--export") == 0 && value != NULL)
+        {
+            if (export_format_of_path(value) < 0)
+            {
+                fprintf(stderr, "Unknown export format of %s (.raw, .r16, .pgm, .png, .obj, .ply, .glb)\n", value);
+                return 0;
+            }
+            options->export_path = value;
+            i++;
+        }
+        else if (strcmp(arg, "--render") == 0 && value != NULL)
+        {
+            if (image_format_of_path(value) < 0)
+            {
+                fprintf(stderr, "Unknown image format of %s (.png, .ppm)\n", value);
+                return 0;
+            }
+            options->render_path = value;
+            i++;
+        }
+        else if (strcmp(arg, "--resolution") == 0 && value != NULL)
+        {
+            if (sscanf(value, "%dx%d", &options->render_width, &options->render_height) != 2
+                || options->render_width < 1 || options->render_height < 1)
+            {
+                fprintf(stderr, "Invalid resolution: %s (WIDTHxHEIGHT)\n", value);
+                return 0;
+            }
+            i++;
+        }
+        else if (strcmp(arg, "--simplify") == 0 && value != NULL)
+        {
+            simplify_error = (float)atof(value);
+            i++;
+        }
+        else if (strcmp(arg, "--erode") == 0 && value != NULL)
+        {
+            options->erosion_droplets = atoi(value);
+            i++;
+        }
+        else if (strcmp(arg, "--generator") == 0 && value != NULL)
+        {
+            const Generator *gen = find_generator(value);
+            if (gen == NULL)
+            {
+                fprintf(stderr, "Unknown generator: %s (", value);
+                for (int g = 0; g < GENERATOR_COUNT; g++)
+                {
+                    fprintf(stderr, "%s%s", g > 0 ? ", " : "", GENERATORS[g].name);
+                }
+                fprintf(stderr, ")\n");
+                return 0;
+            }
+            generator = (int)(gen - GENERATORS);
+            i++;
+        }
+        else if (strcmp(arg, "--beta") == 0 && value != NULL)
+        {
+            spectral_beta = (float)atof(value);
+            if (!(spectral_beta >= 0.0f) || spectral_beta > SPECTRAL_BETA_MAX)
+            {
+                fprintf(stderr, "Invalid spectral exponent: %s (0..%g)\n", value, (double)SPECTRAL_BETA_MAX);
+                return 0;
+            }
+            i++;
+        }
+        else if (strcmp(arg, "--octaves") == 0 && value != NULL)
+        {
+            fbm_settings.octaves = atoi(value);
+            i++;
+        }
+        else if (strcmp(arg, "--lacunarity") == 0 && value != NULL)
+        {
+            fbm_settings.lacunarity = (float)atof(value);
+            i++;
+        }
+        else if (strcmp(arg, "--gain") == 0 && value != NULL)
+        {
+            fbm_settings.gain = (float)atof(value);
+            i++;
+        }
+        else if (strcmp(arg, "--erode-grid") == 0 && value != NULL)
+        {
+            options->erosion_iterations = atoi(value);
+            i++;
+        }
+        else if (strcmp(arg, "--blur") == 0 && value != NULL)
+        {
+            /* gaussian[:sigma] or box[:radius[:passes]] */
+            const char *colon = strchr(value, ':');
+            size_t length = colon != NULL ? (size_t)(colon - value) : strlen(value);
+            
+            if (length == 8 && strncmp(value, "gaussian", 8) == 0)
+            {
+                blur_settings.type = BLUR_GAUSSIAN;
+                if (colon != NULL) blur_settings.sigma = (float)atof(colon + 1);
+            }
+            else if (length == 3 && strncmp(value, "box", 3) == 0)
+            {
+                blur_settings.type = BLUR_BOX;
+                if (colon != NULL) blur_settings.radius = atoi(colon + 1);
+                if (colon != NULL && strchr(colon + 1, ':') != NULL) blur_settings.passes = atoi(strchr(colon + 1, ':') + 1);
+            }
+            else
+            {
+                fprintf(stderr, "Unknown blur: %s (gaussian[:sigma], box[:radius[:passes]])\n", value);
+                return 0;
+            }
+            if (!is_valid_blur(&blur_settings))
+            {
+                fprintf(stderr, "Invalid blur: %s (sigma %g..%.4g, radius 1..%d, passes 1 or more)\n", value,
+                        (double)BLUR_MIN_SIGMA, BLUR_MAX_RADIUS / 3.0, BLUR_MAX_RADIUS);
+                return 0;
+            }
+            i++;
+        }
+        else if (strcmp(arg, "--filter") == 0 && value != NULL)
+        {
+            /* name[:p0[:p1]] */
+            char name[32];
+            float params[2];
+            int length = (int)strcspn(value, ":");
+            int param_count = 0;
+            const char *next = value + length;
+            
+            snprintf(name, sizeof(name), "%.*s", length, value);
+            while (*next == ':' && param_count < 2)
+            {
+                params[param_count++] = (float)atof(next + 1);
+                next += 1 + strcspn(next + 1, ":");
+            }
+            if (!filter_chain_add(&filter_chain, name, param_count, params))
+            {
+                fprintf(stderr, "Unknown filter or too many filters: %s (", value);
+                for (int k = 0; k < FILTER_KIND_COUNT; k++)
+                {
+                    fprintf(stderr, "%s%s", k > 0 ? ", " : "", FILTER_KINDS[k].name);
+                }
+                fprintf(stderr, ")\n");
+                return 0;
+            }
+            if (!is_valid_filter(&filter_chain.stages[filter_chain.count - 1]))
+            {
+                fprintf(stderr, "Invalid filter parameters: %s (terrace step and sharpness, "
+                        "redistribute exponent must be > 0)\n", value);
+                return 0;
+            }
+            i++;
+        }
+        else
+        {
+            fprintf(stderr, "Unknown or incomplete option: %s\n", arg);
+            return 0;
+        }
+    }
+    
+    if (!is_valid_size(options->size))
+    {
+        fprintf(stderr, "Size must be 2^n+1 (65, 129, 257, ...): %d\n", options->size);
+        return 0;
+    }
+    
+    if (!is_valid_fbm(&fbm_settings))
+    {
+        fprintf(stderr, "Invalid fBm settings: %d octaves (1..%d), lacunarity %g, gain %g (above 0, "
+                "lacunarity^(octaves - 1) below about 2^15)\n", fbm_settings.octaves, FBM_OCTAVES_MAX,
+                fbm_settings.lacunarity, fbm_settings.gain);
+        return 0;
+    }
+    
+    return 1;
+}
+
+/* ----------------------------------------------------------------------------
+ * New terrain: generation, optional blur, erosion and filters, then everything derived from
+ * the heights. The time of every stage is kept in stage_time for the HUD.
+ * ---------------------------------------------------------------------------- */
+void regenerate_terrain(void)
+{
+    double t0 = get_time_seconds();
+    
+    terrain_seed = (unsigned int)rand();
+    reset_canvas_corners();
+    generate_terrain();
+    double t1 = get_time_seconds();
+    
+    blur_terrain(&terrain[0][0], ITERATIONS);
+    double t2 = get_time_seconds();
+    
+    erode_terrain(&terrain[0][0], ITERATIONS, terrain_seed);
+    double t3 = get_time_seconds();
+    
+    filter_terrain(&terrain[0][0], ITERATIONS);
+    double t4 = get_time_seconds();
+    
+    height_pyramid_build(&terrain_pyramid, &terrain[0][0], ITERATIONS);
+    if (!height_mips_build(&terrain_mips, &terrain[0][0], ITERATIONS))
+    {
+        fprintf(stderr, "Out of memory for the grid levels, drawing every cell\n");
+    }
+    rtin_free(&terrain_rtin);
+    if (!rtin_init(&terrain_rtin, &terrain[0][0], ITERATIONS)
+        || !rtin_extract(&terrain_rtin, simplify_error >= 0.0f ? simplify_error : RTIN_DRAW_ERROR, &terrain_rtin_mesh))
+    {
+        fprintf(stderr, "Out of memory for the RTIN mesh\n");
+    }
+    double t5 = get_time_seconds();
+    
+    calculate_min_max_height();
+    calculate_view_parameters();
+    terrain_version++;
+    double t6 = get_time_seconds();
+    
+    stage_time[STAGE_GENERATE] = t1 - t0;
+    stage_time[STAGE_BLUR] = t2 - t1;
+    stage_time[STAGE_EROSION] = t3 - t2;
+    stage_time[STAGE_FILTERS] = t4 - t3;
+    stage_time[STAGE_PYRAMID] = t5 - t4;
+    stage_time[STAGE_STATS] = t6 - t5;
+}
+
 /* ----------------------------------------------------------------------------
  * Correct isometric projection (without scale)
  * This function transforms 3D coordinates (x, y, z) into 2D screen coordinates
@@ -132,21 +1082,45 @@ Vector2 isometric_projection(float x, float y, float z)
  * Calculate parameters to automatically center and scale the terrain
  * ---------------------------------------------------------------------------- */
 void calculate_view_parameters(void)
+{
+    fit_view(&terrain[0][0], ITERATIONS, SCREEN_WIDTH, SCREEN_HEIGHT, UI_HEIGHT, &render_scale, &offset_x, &offset_y);
+}
+
+/* ----------------------------------------------------------------------------
+ * Scale and offsets that fit the projection of a map in a width x height
+ * area, below 'top' pixels kept for the UI
+ * ---------------------------------------------------------------------------- */
+void fit_view(const float *map, int size, int width, int height, int top, float *scale, float *view_x, float *view_y)
 {
     float min_x = 1e9, max_x = -1e9;
     float min_y = 1e9, max_y = -1e9;
     
-    /* First pass: find the limits of the projected terrain */
-    for (int y = 0; y < ITERATIONS; y++)
+    /* First pass: find the limits of the projected terrain. The projected x
+       does not depend on the heights, so the corners bound it; y is scanned
+       a map row at a time (the terms of isometric_projection) */
+    for (int corner = 0; corner < 4; corner++)
+    {
+        Vector2 p = isometric_projection((corner & 1) * (size - 1), (corner >> 1) * (size - 1), 0.0f);
+        
+        if (p.x < min_x) min_x = p.x;
+        if (p.x > max_x) max_x = p.x;
+    }
+    
+    float depth_x = sinf(ROTATION_ANGLE * DEG2RAD) * sinf(ISO_ANGLE * DEG2RAD);
+    float depth_y = cosf(ROTATION_ANGLE * DEG2RAD) * sinf(ISO_ANGLE * DEG2RAD);
+    
+    #pragma omp parallel for schedule(static) reduction(min:min_y) reduction(max:max_y) if (size > 512)
+    for (int x = 0; x < size; x++)
     {
-        for (int x = 0; x < ITERATIONS; x++)
+        const float *row = &MAP_AT(map, size, x, 0);
+        float base = x * depth_x;
+        
+        #pragma omp simd reduction(min:min_y) reduction(max:max_y)
+        for (int y = 0; y < size; y++)
         {
-            Vector2 p = isometric_projection(x, y, terrain[x][y]);
-            
-            if (p.x < min_x) min_x = p.x;
-            if (p.x > max_x) max_x = p.x;
-            if (p.y < min_y) min_y = p.y;
-            if (p.y > max_y) max_y = p.y;
+            float p_y = base + y * depth_y - row[y];
+            min_y = fminf(min_y, p_y);
+            max_y = fmaxf(max_y, p_y);
         }
     }
     
@@ -155,92 +1129,1002 @@ void calculate_view_parameters(void)
     float terrain_height = max_y - min_y;
     
     /* Calculate available space (with margins) */
-    float available_space_x = SCREEN_WIDTH - (2 * SCREEN_MARGIN);
-    float available_space_y = (SCREEN_HEIGHT - UI_HEIGHT) - (2 * SCREEN_MARGIN);
+    float available_space_x = width - (2 * SCREEN_MARGIN);
+    float available_space_y = (height - top) - (2 * SCREEN_MARGIN);
     
     /* Calculate scale factor to fit everything on screen */
     float scale_x = available_space_x / terrain_width;
     float scale_y = available_space_y / terrain_height;
     
     /* Use the smaller scale to maintain proportions */
-    render_scale = fminf(scale_x, scale_y);
+    *scale = fminf(scale_x, scale_y);
     
     /* Calculate offsets for centering */
-    float scaled_width = terrain_width * render_scale;
-    float scaled_height = terrain_height * render_scale;
+    float scaled_width = terrain_width * *scale;
+    float scaled_height = terrain_height * *scale;
     
-    offset_x = (SCREEN_WIDTH - scaled_width) / 2.0f - (min_x * render_scale);
-    offset_y = (SCREEN_HEIGHT - UI_HEIGHT - scaled_height) / 2.0f + UI_HEIGHT - (min_y * render_scale);
+    *view_x = (width - scaled_width) / 2.0f - (min_x * *scale);
+    *view_y = (height - top - scaled_height) / 2.0f + top - (min_y * *scale);
 }
 
 /* ----------------------------------------------------------------------------
- * Optimized 3D drawing with automatic centering
+ * Level of the mip pyramid drawn by the grid mode: the first one whose
+ * cells are at least LOD_CELL_PIXELS on screen, so the number of lines
+ * follows the screen resolution and not the map size
  * ---------------------------------------------------------------------------- */
-void draw_terrain_3d(void)
-{    
-    /* Draw terrain grid */
-    for (int y = 0; y < ITERATIONS - 1; y++)
+int terrain_lod_level(void)
+{
+    return lod_level(render_scale, terrain_mips.levels);
+}
+
+/* ----------------------------------------------------------------------------
+ * Mip level (below 'levels') whose cells are at least LOD_CELL_PIXELS at
+ * 'scale' pixels per map unit
+ * ---------------------------------------------------------------------------- */
+int lod_level(float scale, int levels)
+{
+    /* Shortest projected cell edge, in pixels */
+    Vector2 origin = isometric_projection(0, 0, 0);
+    Vector2 edge_x = isometric_projection(1, 0, 0);
+    Vector2 edge_y = isometric_projection(0, 1, 0);
+    float edge = fminf(hypotf(edge_x.x - origin.x, edge_x.y - origin.y),
+                       hypotf(edge_y.x - origin.x, edge_y.y - origin.y)) * scale;
+    
+    int level = 0;
+    while (level + 1 < levels && edge * (float)(1 << level) < LOD_CELL_PIXELS)
     {
-        for (int x = 0; x < ITERATIONS - 1; x++)
-        {
-            /* Coordinates of the 4 vertices of the cell (base projection) */
-            Vector2 p1_base = isometric_projection(x, y, terrain[x][y]);
-            Vector2 p2_base = isometric_projection(x + 1, y, terrain[x + 1][y]);
-            Vector2 p3_base = isometric_projection(x, y + 1, terrain[x][y + 1]);
-            Vector2 p4_base = isometric_projection(x + 1, y + 1, terrain[x + 1][y + 1]);
-            
-            /* Apply scale and offset for centering */
-            Vector2 p1 = {p1_base.x * render_scale + offset_x,
-                         p1_base.y * render_scale + offset_y};
-            Vector2 p2 = {p2_base.x * render_scale + offset_x,
-                         p2_base.y * render_scale + offset_y};
-            Vector2 p3 = {p3_base.x * render_scale + offset_x,
-                         p3_base.y * render_scale + offset_y};
-            Vector2 p4 = {p4_base.x * render_scale + offset_x,
-                         p4_base.y * render_scale + offset_y};
-            
-            /* Calculate average height for color */
-            float avg_height = (terrain[x][y] + terrain[x + 1][y] + 
-                               terrain[x][y + 1] + terrain[x + 1][y + 1]) / 4.0f;
-            
-            /* Set color based on height */
-            Color color = calculate_height_color(avg_height, max_height, min_height);
-            
-            /* Draw grid lines (note: Y inverted for Raylib) */
-            DrawLineV((Vector2){p1.x, SCREEN_HEIGHT - p1.y},
-                     (Vector2){p2.x, SCREEN_HEIGHT - p2.y},
-                     color);
-            
-            DrawLineV((Vector2){p1.x, SCREEN_HEIGHT - p1.y},
-                     (Vector2){p3.x, SCREEN_HEIGHT - p3.y},
-                     color);
-            
-            /* Close cells on borders */
-            if (x == ITERATIONS - 2)
-            {
-                DrawLineV((Vector2){p2.x, SCREEN_HEIGHT - p2.y},
-                         (Vector2){p4.x, SCREEN_HEIGHT - p4.y}, color);
-            }
-            if (y == ITERATIONS - 2)
-            {
-                DrawLineV((Vector2){p3.x, SCREEN_HEIGHT - p3.y},
-                         (Vector2){p4.x, SCREEN_HEIGHT - p4.y}, color);
-            }
-        }
+        level++;
     }
+    
+    return level;
 }
 
 /* ----------------------------------------------------------------------------
- * Draw X, Y, Z axes
+ * Optimized 3D drawing with automatic centering
  * ---------------------------------------------------------------------------- */
-void draw_reference_axes(void)
+void draw_terrain_3d(void)
 {
-    /* Draw reference axes */
-    Vector2 origin_base = isometric_projection(0, 0, 0);
-    Vector2 axis_x_base = isometric_projection(ITERATIONS * 0.25f, 0, 0);
-    Vector2 axis_y_base = isometric_projection(0, ITERATIONS * 0.25f, 0);
-    Vector2 axis_z_base = isometric_projection(0, 0, max_height * 0.5f);
-    
+    if (render_mode == RENDER_RTIN)
+    {
+        draw_terrain_rtin();
+        return;
+    }
+    if (render_mode == RENDER_HORIZON)
+    {
+        draw_terrain_horizon();
+        return;
+    }
+    if (render_mode == RENDER_SHADED)
+    {
+        draw_terrain_shaded();
+        return;
+    }
+    if (render_mode == RENDER_FLY)
+    {
+        draw_terrain_fly();
+        return;
+    }
+    
+    /* Rows and columns as line strips, cells of 2^level samples read from
+       the matching mip level */
+    if (terrain_strips.version != terrain_version)
+    {
+        int level = terrain_lod_level();
+        const float *heights = level > 0 ? height_mips_level(&terrain_mips, level) : &terrain[0][0];
+        
+        if (!grid_strips_build(&terrain_strips, heights, ((ITERATIONS - 1) >> level) + 1, 1 << level))
+        {
+            fprintf(stderr, "Out of memory for the grid lines\n");
+        }
+        terrain_strips.version = terrain_version;
+    }
+    
+    for (int i = 0; i < terrain_strips.strip_count; i++)
+    {
+        int first = terrain_strips.first[i];
+        DrawLineStrip(&terrain_strips.points[first], terrain_strips.first[i + 1] - first, terrain_strips.colors[i]);
+    }
+}
+
+/* ----------------------------------------------------------------------------
+ * RTIN mode: the edges of the simplified mesh, coloured by the mean
+ * height of each triangle (shared edges are drawn twice)
+ * ---------------------------------------------------------------------------- */
+void draw_terrain_rtin(void)
+{
+    const RtinMesh *mesh = &terrain_rtin_mesh;
+    
+    for (int t = 0; t < mesh->triangle_count; t++)
+    {
+        Vector2 p[3];
+        float sum = 0.0f;
+        
+        for (int k = 0; k < 3; k++)
+        {
+            unsigned int v = mesh->triangles[3 * t + k];
+            int x = mesh->vertices[2 * v], y = mesh->vertices[2 * v + 1];
+            Vector2 base = isometric_projection(x, y, terrain[x][y]);
+            
+            p[k] = (Vector2){base.x * render_scale + offset_x, SCREEN_HEIGHT - (base.y * render_scale + offset_y)};
+            sum += terrain[x][y];
+        }
+        
+        Color color = calculate_height_color(sum / 3.0f, max_height, min_height);
+        DrawLineV(p[0], p[1], color);
+        DrawLineV(p[1], p[2], color);
+        DrawLineV(p[2], p[0], color);
+    }
+}
+
+/* ----------------------------------------------------------------------------
+ * Colour of the grid lines leaving (x, y) towards +x and +y: the average
+ * height of that cell, or of the last cell for the lines on the far borders
+ * ---------------------------------------------------------------------------- */
+Color grid_edge_color(const float *heights, int side, int x, int y)
+{
+    if (x > side - 2) x = side - 2;
+    if (y > side - 2) y = side - 2;
+    
+    float avg_height = (MAP_AT(heights, side, x, y) + MAP_AT(heights, side, x + 1, y) +
+                        MAP_AT(heights, side, x, y + 1) + MAP_AT(heights, side, x + 1, y + 1)) / 4.0f;
+    
+    return calculate_height_color(avg_height, max_height, min_height);
+}
+
+/* ----------------------------------------------------------------------------
+ * Cut every line of the grid (cells of 'step' samples) into strips of one
+ * colour: the colour only changes at the height band boundaries, so a
+ * strip replaces many segments and shares their end points. Returns 0 if
+ * out of memory (the strips built so far are kept).
+ * ---------------------------------------------------------------------------- */
+int grid_strips_build(GridStrips *strips, const float *heights, int side, int step)
+{
+    strips->point_count = 0;
+    strips->strip_count = 0;
+    
+    /* Lines along x (y fixed) first, then along y */
+    for (int line = 0; line < 2 * side; line++)
+    {
+        int along_y = line >= side;
+        int fixed = along_y ? line - side : line;
+        Color current = {0, 0, 0, 0};
+        
+        for (int i = 0; i < side - 1; i++)
+        {
+            int x = along_y ? fixed : i;
+            int y = along_y ? i : fixed;
+            Color color = grid_edge_color(heights, side, x, y);
+            
+            if (i == 0 || color.r != current.r || color.g != current.g || color.b != current.b || color.a != current.a)
+            {
+                if (!grid_strips_start(strips, color) || !grid_strips_point(strips, heights, side, step, x, y))
+                {
+                    return 0;
+                }
+                current = color;
+            }
+            
+            if (!grid_strips_point(strips, heights, side, step, along_y ? x : x + 1, along_y ? y + 1 : y))
+            {
+                return 0;
+            }
+        }
+    }
+    
+    return 1;
+}
+
+/* ----------------------------------------------------------------------------
+ * Open a new strip at the next point. Returns 0 if out of memory.
+ * ---------------------------------------------------------------------------- */
+int grid_strips_start(GridStrips *strips, Color color)
+{
+    if (strips->strip_count == strips->strip_capacity)
+    {
+        int capacity = strips->strip_capacity > 0 ? 2 * strips->strip_capacity : 1024;
+        int *first = realloc(strips->first, ((size_t)capacity + 1) * sizeof(int));
+        if (first == NULL) return 0;
+        strips->first = first;
+        
+        Color *colors = realloc(strips->colors, (size_t)capacity * sizeof(Color));
+        if (colors == NULL) return 0;
+        strips->colors = colors;
+        strips->strip_capacity = capacity;
+    }
+    
+    strips->first[strips->strip_count] = strips->point_count;
+    strips->colors[strips->strip_count] = color;
+    strips->strip_count++;
+    strips->first[strips->strip_count] = strips->point_count;
+    
+    return 1;
+}
+
+/* ----------------------------------------------------------------------------
+ * Append grid point (x, y) to the last strip, projected to the screen.
+ * Returns 0 if out of memory.
+ * ---------------------------------------------------------------------------- */
+int grid_strips_point(GridStrips *strips, const float *heights, int side, int step, int x, int y)
+{
+    if (strips->point_count == strips->point_capacity)
+    {
+        int capacity = strips->point_capacity > 0 ? 2 * strips->point_capacity : 2 * side * side;
+        Vector2 *points = realloc(strips->points, (size_t)capacity * sizeof(Vector2));
+        if (points == NULL) return 0;
+        strips->points = points;
+        strips->point_capacity = capacity;
+    }
+    
+    Vector2 base = isometric_projection(x * step, y * step, MAP_AT(heights, side, x, y));
+    
+    /* Apply scale and offset for centering (Y inverted for Raylib) */
+    strips->points[strips->point_count] = (Vector2){base.x * render_scale + offset_x,
+                                                    SCREEN_HEIGHT - (base.y * render_scale + offset_y)};
+    strips->point_count++;
+    strips->first[strips->strip_count] = strips->point_count;
+    
+    return 1;
+}
+
+/* ----------------------------------------------------------------------------
+ * Release the grid strips
+ * ---------------------------------------------------------------------------- */
+void grid_strips_free(GridStrips *strips)
+{
+    free(strips->points);
+    free(strips->first);
+    free(strips->colors);
+    memset(strips, 0, sizeof(*strips));
+}
+
+/* ----------------------------------------------------------------------------
+ * Horizon mode: the grid lines left visible by the floating horizon,
+ * computed once per terrain
+ * ---------------------------------------------------------------------------- */
+void draw_terrain_horizon(void)
+{
+    if (terrain_horizon.version != terrain_version)
+    {
+        int level = terrain_lod_level();
+        const float *heights = level > 0 ? height_mips_level(&terrain_mips, level) : &terrain[0][0];
+        
+        if (!horizon_build(&terrain_horizon, heights, ((ITERATIONS - 1) >> level) + 1, 1 << level))
+        {
+            fprintf(stderr, "Out of memory for the visible lines\n");
+        }
+        terrain_horizon.version = terrain_version;
+    }
+    
+    for (int i = 0; i < terrain_horizon.count; i++)
+    {
+        DrawLineV(terrain_horizon.points[2 * i], terrain_horizon.points[2 * i + 1], terrain_horizon.colors[i]);
+    }
+}
+
+/* ----------------------------------------------------------------------------
+ * Floating horizon hidden-line removal of the grid (cells of 'step'
+ * samples). The screen goes up with the depth and down with the height, so
+ * the lines are taken front to back, by diagonals x + y (lines of equal
+ * depth at a 45 degree rotation). A point is hidden when it falls between
+ * the highest and the lowest point drawn so far in its pixel column; these
+ * two horizons are raised or lowered by every line. One pass over the
+ * lines, each rasterised in pixel columns. Returns 0 if out of memory (the
+ * lines found so far are kept).
+ * ---------------------------------------------------------------------------- */
+int horizon_build(HorizonLines *lines, const float *heights, int side, int step)
+{
+    float upper[SCREEN_WIDTH], lower[SCREEN_WIDTH];
+    
+    for (int c = 0; c < SCREEN_WIDTH; c++)
+    {
+        upper[c] = -1e9f;
+        lower[c] = 1e9f;
+    }
+    lines->count = 0;
+    
+    for (int diagonal = 0; diagonal < 2 * (side - 1); diagonal++)
+    {
+        int x_first = diagonal > side - 1 ? diagonal - (side - 1) : 0;
+        int x_last = diagonal < side - 1 ? diagonal : side - 1;
+        
+        for (int x = x_first; x <= x_last; x++)
+        {
+            int y = diagonal - x;
+            Color color = grid_edge_color(heights, side, x, y);
+            
+            /* Screen position with the height axis up (not yet inverted for Raylib) */
+            Vector2 base = isometric_projection(x * step, y * step, MAP_AT(heights, side, x, y));
+            Vector2 a = {base.x * render_scale + offset_x, base.y * render_scale + offset_y};
+            
+            if (x + 1 < side)
+            {
+                base = isometric_projection((x + 1) * step, y * step, MAP_AT(heights, side, x + 1, y));
+                Vector2 b = {base.x * render_scale + offset_x, base.y * render_scale + offset_y};
+                if (!horizon_edge(lines, upper, lower, a, b, color)) return 0;
+            }
+            if (y + 1 < side)
+            {
+                base = isometric_projection(x * step, (y + 1) * step, MAP_AT(heights, side, x, y + 1));
+                Vector2 b = {base.x * render_scale + offset_x, base.y * render_scale + offset_y};
+                if (!horizon_edge(lines, upper, lower, a, b, color)) return 0;
+            }
+        }
+    }
+    
+    return 1;
+}
+
+/* ----------------------------------------------------------------------------
+ * Test one line against the horizons at every pixel column it crosses, keep
+ * its visible runs, then move the horizons. Lines narrower than a column
+ * are tested at their nearest column. Returns 0 if out of memory.
+ * ---------------------------------------------------------------------------- */
+int horizon_edge(HorizonLines *lines, float *upper, float *lower, Vector2 a, Vector2 b, Color color)
+{
+    if (a.x > b.x)
+    {
+        Vector2 t = a;
+        a = b;
+        b = t;
+    }
+    
+    int c0 = (int)ceilf(a.x);
+    int c1 = (int)floorf(b.x);
+    if (c0 < 0) c0 = 0;
+    if (c1 > SCREEN_WIDTH - 1) c1 = SCREEN_WIDTH - 1;
+    
+    if (c1 < c0)
+    {
+        int c = (int)floorf((a.x + b.x) * 0.5f + 0.5f);
+        if (c < 0 || c >= SCREEN_WIDTH) return 1;
+        
+        float high = fmaxf(a.y, b.y), low = fminf(a.y, b.y);
+        if (high >= upper[c] - HORIZON_EPSILON || low <= lower[c] + HORIZON_EPSILON)
+        {
+            if (!horizon_add(lines, a, b, color)) return 0;
+        }
+        upper[c] = fmaxf(upper[c], high);
+        lower[c] = fminf(lower[c], low);
+        return 1;
+    }
+    
+    float slope = (b.y - a.y) / (b.x - a.x);
+    int run = -1;                   // First column of the current visible run
+    
+    for (int c = c0; c <= c1 + 1; c++)
+    {
+        int visible = 0;
+        if (c <= c1)
+        {
+            float u = a.y + (c - a.x) * slope;
+            visible = u >= upper[c] - HORIZON_EPSILON || u <= lower[c] + HORIZON_EPSILON;
+        }
+        
+        if (visible && run < 0) run = c;
+        if (!visible && run >= 0)
+        {
+            /* Runs touching an end of the line extend to it */
+            float x0 = run == c0 ? a.x : (float)run;
+            float x1 = c - 1 == c1 ? b.x : (float)(c - 1);
+            if (x1 > x0)
+            {
+                Vector2 p = {x0, a.y + (x0 - a.x) * slope};
+                Vector2 q = {x1, a.y + (x1 - a.x) * slope};
+                if (!horizon_add(lines, p, q, color)) return 0;
+            }
+            run = -1;
+        }
+    }
+    
+    for (int c = c0; c <= c1; c++)
+    {
+        float u = a.y + (c - a.x) * slope;
+        upper[c] = fmaxf(upper[c], u);
+        lower[c] = fminf(lower[c], u);
+    }
+    
+    return 1;
+}
+
+/* ----------------------------------------------------------------------------
+ * Append a visible segment (inverting Y for Raylib). Returns 0 if out of
+ * memory.
+ * ---------------------------------------------------------------------------- */
+int horizon_add(HorizonLines *lines, Vector2 a, Vector2 b, Color color)
+{
+    if (lines->count == lines->capacity)
+    {
+        int capacity = lines->capacity > 0 ? 2 * lines->capacity : 4096;
+        Vector2 *points = realloc(lines->points, (size_t)capacity * 2 * sizeof(Vector2));
+        if (points == NULL) return 0;
+        lines->points = points;
+        
+        Color *colors = realloc(lines->colors, (size_t)capacity * sizeof(Color));
+        if (colors == NULL) return 0;
+        lines->colors = colors;
+        lines->capacity = capacity;
+    }
+    
+    lines->points[2 * lines->count] = (Vector2){a.x, SCREEN_HEIGHT - a.y};
+    lines->points[2 * lines->count + 1] = (Vector2){b.x, SCREEN_HEIGHT - b.y};
+    lines->colors[lines->count] = color;
+    lines->count++;
+    
+    return 1;
+}
+
+/* ----------------------------------------------------------------------------
+ * Release the visible lines
+ * ---------------------------------------------------------------------------- */
+void horizon_free(HorizonLines *lines)
+{
+    free(lines->points);
+    free(lines->colors);
+    memset(lines, 0, sizeof(*lines));
+}
+
+/* ----------------------------------------------------------------------------
+ * Shaded mode: one mesh of screen-space triangles drawn through an
+ * orthographic camera that maps world units to pixels (X right, Y down).
+ * The mesh is rebuilt once per terrain; the triangles are already in
+ * painter's order, so neither culling nor sorting is needed.
+ * ---------------------------------------------------------------------------- */
+void draw_terrain_shaded(void)
+{
+    ShadedMesh *shaded = &terrain_shaded;
+    
+    if (shaded->version != terrain_version)
+    {
+        int level = terrain_lod_level();
+        const float *heights = level > 0 ? height_mips_level(&terrain_mips, level) : &terrain[0][0];
+        
+        if (shaded->uploaded) UnloadMesh(shaded->mesh);
+        shaded->uploaded = 0;
+        memset(&shaded->mesh, 0, sizeof(shaded->mesh));
+        
+        if (shaded_mesh_build(&shaded->mesh, heights, ((ITERATIONS - 1) >> level) + 1, 1 << level))
+        {
+            UploadMesh(&shaded->mesh, false);
+            shaded->uploaded = 1;
+        }
+        else
+        {
+            fprintf(stderr, "Out of memory for the shaded mesh\n");
+        }
+        shaded->version = terrain_version;
+    }
+    if (!shaded->uploaded) return;
+    if (!shaded->material_loaded)
+    {
+        shaded->material = LoadMaterialDefault();
+        shaded->material_loaded = 1;
+    }
+    
+    Camera3D camera = {0};
+    camera.position = (Vector3){SCREEN_WIDTH / 2.0f, SCREEN_HEIGHT / 2.0f, -1.0f};
+    camera.target = (Vector3){SCREEN_WIDTH / 2.0f, SCREEN_HEIGHT / 2.0f, 0.0f};
+    camera.up = (Vector3){0.0f, -1.0f, 0.0f};
+    camera.fovy = (float)SCREEN_HEIGHT;
+    camera.projection = CAMERA_ORTHOGRAPHIC;
+    
+    BeginMode3D(camera);
+    rlDisableBackfaceCulling();
+    DrawMesh(shaded->mesh, shaded->material, MatrixIdentity());
+    rlEnableBackfaceCulling();
+    EndMode3D();
+}
+
+/* ----------------------------------------------------------------------------
+ * Lambert light of every sample (SHADE_AMBIENT to 1) from the central
+ * difference normals, 'spacing' map units between samples. The rows are
+ * vectorised, their first and last samples use one-sided differences.
+ * ---------------------------------------------------------------------------- */
+void terrain_shade(const float *map, int side, float spacing, float *shade)
+{
+    Vector3 light = Vector3Normalize(SHADE_LIGHT);
+    float inverse_y = 1.0f / (2.0f * spacing);
+    
+    #pragma omp parallel for schedule(static) if (side > 512)
+    for (int x = 0; x < side; x++)
+    {
+        int x0 = x > 0 ? x - 1 : x, x1 = x < side - 1 ? x + 1 : x;
+        const float *prev = &MAP_AT(map, side, x0, 0);
+        const float *row = &MAP_AT(map, side, x, 0);
+        const float *next = &MAP_AT(map, side, x1, 0);
+        float inverse_x = 1.0f / ((float)(x1 - x0) * spacing);
+        float *out = &shade[(size_t)x * side];
+        
+        /* Normal (dz/dx, dz/dy, 1), the height being -z */
+        #pragma omp simd
+        for (int y = 1; y < side - 1; y++)
+        {
+            float dx = (next[y] - prev[y]) * inverse_x;
+            float dy = (row[y + 1] - row[y - 1]) * inverse_y;
+            float lambert = (dx * light.x + dy * light.y + light.z) / sqrtf(dx * dx + dy * dy + 1.0f);
+            out[y] = SHADE_AMBIENT + (1.0f - SHADE_AMBIENT) * fmaxf(lambert, 0.0f);
+        }
+        
+        for (int y = 0; y < side; y += side - 1)
+        {
+            int y0 = y > 0 ? y - 1 : y, y1 = y < side - 1 ? y + 1 : y;
+            float dx = (next[y] - prev[y]) * inverse_x;
+            float dy = (row[y1] - row[y0]) / ((float)(y1 - y0) * spacing);
+            float lambert = (dx * light.x + dy * light.y + light.z) / sqrtf(dx * dx + dy * dy + 1.0f);
+            out[y] = SHADE_AMBIENT + (1.0f - SHADE_AMBIENT) * fmaxf(lambert, 0.0f);
+        }
+    }
+}
+
+/* ----------------------------------------------------------------------------
+ * Triangles of the shaded mode (cells of 'step' samples), in screen
+ * coordinates with the shaded height colour at every vertex. The view
+ * comes from small x and y (ROTATION_ANGLE between 0 and 90 degrees), so
+ * looping on x and y downwards draws every cell after the ones it can
+ * hide: no sort. Each cell is cut along the diagonal facing the viewer,
+ * far triangle first. Not indexed (raylib meshes have 16-bit indices).
+ * Returns 0 if out of memory.
+ * ---------------------------------------------------------------------------- */
+int shaded_mesh_build(Mesh *mesh, const float *heights, int side, int step)
+{
+    size_t samples = (size_t)side * side;
+    size_t vertex_count = 6 * (size_t)(side - 1) * (side - 1);
+    float *shade = malloc(samples * sizeof(float));
+    Vector2 *screen = malloc(samples * sizeof(Vector2));
+    Color *colors = malloc(samples * sizeof(Color));
+    
+    mesh->vertices = malloc(vertex_count * 3 * sizeof(float));
+    mesh->colors = malloc(vertex_count * 4);
+    mesh->texcoords = calloc(vertex_count * 2, sizeof(float));
+    
+    int ok = shade != NULL && screen != NULL && colors != NULL &&
+             mesh->vertices != NULL && mesh->colors != NULL && mesh->texcoords != NULL;
+    
+    if (ok)
+    {
+        terrain_shade(heights, side, (float)step, shade);
+        
+        for (int x = 0; x < side; x++)
+        {
+            for (int y = 0; y < side; y++)
+            {
+                size_t i = (size_t)x * side + y;
+                Vector2 base = isometric_projection(x * step, y * step, heights[i]);
+                Color color = calculate_height_color(heights[i], max_height, min_height);
+                
+                screen[i] = (Vector2){base.x * render_scale + offset_x, SCREEN_HEIGHT - (base.y * render_scale + offset_y)};
+                colors[i] = (Color){(unsigned char)(color.r * shade[i]), (unsigned char)(color.g * shade[i]),
+                                    (unsigned char)(color.b * shade[i]), 255};
+            }
+        }
+        
+        size_t v = 0;
+        for (int x = side - 2; x >= 0; x--)
+        {
+            for (int y = side - 2; y >= 0; y--)
+            {
+                size_t a = (size_t)x * side + y;
+                size_t corners[6] = {a + side, a + side + 1, a + 1,     // Far triangle
+                                     a, a + side, a + 1};               // Near triangle
+                
+                for (int k = 0; k < 6; k++, v++)
+                {
+                    mesh->vertices[3 * v] = screen[corners[k]].x;
+                    mesh->vertices[3 * v + 1] = screen[corners[k]].y;
+                    mesh->vertices[3 * v + 2] = 0.0f;
+                    memcpy(&mesh->colors[4 * v], &colors[corners[k]], 4);
+                }
+            }
+        }
+        
+        mesh->vertexCount = (int)vertex_count;
+        mesh->triangleCount = (int)(vertex_count / 3);
+    }
+    else
+    {
+        free(mesh->vertices);
+        free(mesh->colors);
+        free(mesh->texcoords);
+        memset(mesh, 0, sizeof(*mesh));
+    }
+    
+    free(shade);
+    free(screen);
+    free(colors);
+    return ok;
+}
+
+/* ----------------------------------------------------------------------------
+ * Release the shaded mesh and its material (needs the window)
+ * ---------------------------------------------------------------------------- */
+void shaded_mesh_free(ShadedMesh *shaded)
+{
+    if (shaded->uploaded) UnloadMesh(shaded->mesh);
+    if (shaded->material_loaded) UnloadMaterial(shaded->material);
+    memset(shaded, 0, sizeof(*shaded));
+}
+
+/* ----------------------------------------------------------------------------
+ * Fly mode: a perspective camera over the terrain cut in chunks of
+ * CHUNK_CELLS cells. Each chunk has a mesh per level of detail (from the
+ * mip pyramid) and a bounding box (from the min/max pyramid); chunks
+ * outside the view frustum are skipped, the others use the coarsest level
+ * whose cells stay within FLY_LOD_PIXELS on screen at their distance.
+ * Skirts hanging from the chunk borders hide the cracks between levels.
+ * The map spans FLY_WORLD_SIZE world units centred on the origin, X along
+ * map x, Z along map y, Y up (the height being -z as in the other views).
+ * ---------------------------------------------------------------------------- */
+void draw_terrain_fly(void)
+{
+    FlyTerrain *fly = &terrain_fly;
+    
+    if (fly->version != terrain_version)
+    {
+        if (!fly_terrain_build(fly))
+        {
+            fprintf(stderr, "Out of memory for the fly mode meshes\n");
+        }
+        fly->version = terrain_version;
+    }
+    if (!fly->material_loaded)
+    {
+        fly->material = LoadMaterialDefault();
+        fly->material_loaded = 1;
+    }
+    if (!fly_camera.ready)
+    {
+        fly_camera_update(&fly_camera, 0.0f);
+    }
+    
+    const Camera3D *camera = &fly_camera.camera;
+    float world = FLY_WORLD_SIZE / (ITERATIONS - 1);
+    float cell_pixels = world * (SCREEN_HEIGHT * 0.5f) / tanf(FLY_FOVY * 0.5f * DEG2RAD);
+    Frustum frustum;
+    
+    frustum_from_camera(camera, (float)SCREEN_WIDTH / SCREEN_HEIGHT, &frustum);
+    fly->drawn = 0;
+    
+    BeginMode3D(*camera);
+    rlDisableBackfaceCulling();
+    
+    for (int c = 0; c < fly->chunks_per_side * fly->chunks_per_side; c++)
+    {
+        const FlyChunk *chunk = &fly->chunks[c];
+        if (!frustum_contains_box(&frustum, chunk->box)) continue;
+        
+        /* Distance to the nearest point of the box */
+        Vector3 p = camera->position;
+        Vector3 nearest = {fminf(fmaxf(p.x, chunk->box.min.x), chunk->box.max.x),
+                           fminf(fmaxf(p.y, chunk->box.min.y), chunk->box.max.y),
+                           fminf(fmaxf(p.z, chunk->box.min.z), chunk->box.max.z)};
+        float distance = fmaxf(Vector3Distance(p, nearest), FLY_NEAR);
+        
+        int level = 0;
+        while (level + 1 < fly->lods && chunk->lods[level + 1].vertexCount > 0
+               && cell_pixels * (float)(2 << level) / distance <= FLY_LOD_PIXELS)
+        {
+            level++;
+        }
+        
+        if (chunk->lods[level].vertexCount == 0) continue;
+        DrawMesh(chunk->lods[level], fly->material, MatrixIdentity());
+        fly->drawn++;
+    }
+    
+    rlEnableBackfaceCulling();
+    EndMode3D();
+}
+
+/* ----------------------------------------------------------------------------
+ * Build and upload the chunk meshes of the fly mode (needs the window).
+ * Returns 0 if out of memory (the chunks built so far are kept).
+ * ---------------------------------------------------------------------------- */
+int fly_terrain_build(FlyTerrain *fly)
+{
+    fly_chunks_free(fly);
+    
+    int cells = ITERATIONS - 1 < CHUNK_CELLS ? ITERATIONS - 1 : CHUNK_CELLS;
+    int per_side = (ITERATIONS - 1) / cells;
+    float world = FLY_WORLD_SIZE / (ITERATIONS - 1);
+    float half = FLY_WORLD_SIZE * 0.5f;
+    int lods = 0;
+    float *shade[CHUNK_LODS] = {NULL};
+    int ok = 1;
+    
+    while (lods < CHUNK_LODS && lods < terrain_mips.levels && (cells >> lods) >= 1) lods++;
+    
+    fly->chunks = calloc((size_t)per_side * per_side, sizeof(FlyChunk));
+    ok = fly->chunks != NULL && lods > 0;
+    
+    /* Light of every level */
+    for (int k = 0; ok && k < lods; k++)
+    {
+        int side = ((ITERATIONS - 1) >> k) + 1;
+        shade[k] = malloc((size_t)side * side * sizeof(float));
+        ok = shade[k] != NULL;
+        if (ok) terrain_shade(height_mips_level(&terrain_mips, k), side, (float)(1 << k), shade[k]);
+    }
+    
+    if (ok)
+    {
+        fly->chunks_per_side = per_side;
+        fly->lods = lods;
+    }
+    
+    for (int cx = 0; ok && cx < per_side; cx++)
+    {
+        for (int cy = 0; ok && cy < per_side; cy++)
+        {
+            FlyChunk *chunk = &fly->chunks[cx * per_side + cy];
+            int x0 = cx * cells, y0 = cy * cells;
+            float low, high;
+            
+            /* Coarse levels are filtered across the border: widen the bounds by their reach */
+            int reach = 1 << lods, last = ITERATIONS - 1;
+            int bx0 = (x0 > reach ? x0 - reach : 0), bx1 = (x0 + cells + reach < last ? x0 + cells + reach : last);
+            int by0 = (y0 > reach ? y0 - reach : 0), by1 = (y0 + cells + reach < last ? y0 + cells + reach : last);
+            height_pyramid_bounds(&terrain_pyramid, bx0, by0, bx1, by1, &low, &high);
+            
+            /* Skirts drop by the height range of the chunk, more than any crack */
+            float drop = (high - low) * world + (1 << (lods - 1)) * world;
+            
+            chunk->box.min = (Vector3){x0 * world - half, -high * world - drop, y0 * world - half};
+            chunk->box.max = (Vector3){(x0 + cells) * world - half, -low * world, (y0 + cells) * world - half};
+            
+            for (int k = 0; ok && k < lods; k++)
+            {
+                int side = ((ITERATIONS - 1) >> k) + 1;
+                ok = fly_chunk_mesh(&chunk->lods[k], height_mips_level(&terrain_mips, k), shade[k], side,
+                                    x0 >> k, y0 >> k, cells >> k, 1 << k, drop);
+                if (ok) UploadMesh(&chunk->lods[k], false);
+            }
+        }
+    }
+    
+    for (int k = 0; k < CHUNK_LODS; k++) free(shade[k]);
+    return ok;
+}
+
+/* ----------------------------------------------------------------------------
+ * Mesh of cells [x0, x0 + cells) x [y0, y0 + cells) of a level ('side'
+ * samples per side, cells of 'step' map samples): the grid, counter-
+ * clockwise from above, then a skirt along each border hanging 'drop'
+ * world units. Vertex colours are the shaded height colours. At most
+ * CHUNK_CELLS cells, so 16-bit indices are enough. Returns 0 if out of
+ * memory.
+ * ---------------------------------------------------------------------------- */
+int fly_chunk_mesh(Mesh *mesh, const float *heights, const float *shade, int side, int x0, int y0, int cells, int step,
+                   float drop)
+{
+    int n = cells + 1;
+    int grid_vertices = n * n;
+    int vertex_count = grid_vertices + 4 * n;
+    int triangle_count = 2 * cells * cells + 4 * 2 * cells;
+    float world = FLY_WORLD_SIZE / (ITERATIONS - 1);
+    float half = FLY_WORLD_SIZE * 0.5f;
+    
+    memset(mesh, 0, sizeof(*mesh));
+    mesh->vertices = malloc((size_t)vertex_count * 3 * sizeof(float));
+    mesh->colors = malloc((size_t)vertex_count * 4);
+    mesh->texcoords = calloc((size_t)vertex_count * 2, sizeof(float));
+    mesh->indices = malloc((size_t)triangle_count * 3 * sizeof(unsigned short));
+    
+    if (mesh->vertices == NULL || mesh->colors == NULL || mesh->texcoords == NULL || mesh->indices == NULL)
+    {
+        free(mesh->vertices);
+        free(mesh->colors);
+        free(mesh->texcoords);
+        free(mesh->indices);
+        memset(mesh, 0, sizeof(*mesh));
+        return 0;
+    }
+    
+    /* Grid vertices (i along x, j along y), then the 4 skirts: x = x0, x = x0 + cells, y = y0, y = y0 + cells */
+    for (int v = 0; v < vertex_count; v++)
+    {
+        int i, j;
+        float lower = 0.0f;
+        
+        if (v < grid_vertices)
+        {
+            i = v / n;
+            j = v % n;
+        }
+        else
+        {
+            int skirt = (v - grid_vertices) / n, t = (v - grid_vertices) % n;
+            i = skirt < 2 ? (skirt == 0 ? 0 : cells) : t;
+            j = skirt < 2 ? t : (skirt == 2 ? 0 : cells);
+            lower = drop;
+        }
+        
+        size_t sample = (size_t)(x0 + i) * side + (y0 + j);
+        Color color = calculate_height_color(heights[sample], max_height, min_height);
+        float light = shade[sample];
+        
+        mesh->vertices[3 * v] = (x0 + i) * step * world - half;
+        mesh->vertices[3 * v + 1] = -heights[sample] * world - lower;
+        mesh->vertices[3 * v + 2] = (y0 + j) * step * world - half;
+        mesh->colors[4 * v] = (unsigned char)(color.r * light);
+        mesh->colors[4 * v + 1] = (unsigned char)(color.g * light);
+        mesh->colors[4 * v + 2] = (unsigned char)(color.b * light);
+        mesh->colors[4 * v + 3] = 255;
+    }
+    
+    unsigned short *index = mesh->indices;
+    
+    for (int i = 0; i < cells; i++)
+    {
+        for (int j = 0; j < cells; j++)
+        {
+            unsigned short a = (unsigned short)(i * n + j);
+            unsigned short b = (unsigned short)(a + n);     // x + 1
+            unsigned short c = (unsigned short)(a + 1);     // y + 1
+            unsigned short d = (unsigned short)(b + 1);
+            
+            *index++ = a; *index++ = c; *index++ = b;
+            *index++ = b; *index++ = c; *index++ = d;
+        }
+    }
+    
+    for (int skirt = 0; skirt < 4; skirt++)
+    {
+        for (int t = 0; t < cells; t++)
+        {
+            int i0 = skirt < 2 ? (skirt == 0 ? 0 : cells) : t, j0 = skirt < 2 ? t : (skirt == 2 ? 0 : cells);
+            int i1 = skirt < 2 ? i0 : t + 1, j1 = skirt < 2 ? t + 1 : j0;
+            unsigned short top0 = (unsigned short)(i0 * n + j0), top1 = (unsigned short)(i1 * n + j1);
+            unsigned short bottom0 = (unsigned short)(grid_vertices + skirt * n + t);
+            unsigned short bottom1 = (unsigned short)(bottom0 + 1);
+            
+            *index++ = top0; *index++ = bottom0; *index++ = top1;
+            *index++ = top1; *index++ = bottom0; *index++ = bottom1;
+        }
+    }
+    
+    mesh->vertexCount = vertex_count;
+    mesh->triangleCount = triangle_count;
+    return 1;
+}
+
+/* ----------------------------------------------------------------------------
+ * Release the chunk meshes and the material of the fly mode
+ * ---------------------------------------------------------------------------- */
+void fly_terrain_free(FlyTerrain *fly)
+{
+    fly_chunks_free(fly);
+    if (fly->material_loaded) UnloadMaterial(fly->material);
+    memset(fly, 0, sizeof(*fly));
+}
+
+/* ----------------------------------------------------------------------------
+ * Release the chunk meshes (uploaded as soon as built)
+ * ---------------------------------------------------------------------------- */
+void fly_chunks_free(FlyTerrain *fly)
+{
+    for (int c = 0; fly->chunks != NULL && c < fly->chunks_per_side * fly->chunks_per_side; c++)
+    {
+        for (int k = 0; k < CHUNK_LODS; k++)
+        {
+            if (fly->chunks[c].lods[k].vertexCount > 0) UnloadMesh(fly->chunks[c].lods[k]);
+        }
+    }
+    free(fly->chunks);
+    
+    fly->chunks = NULL;
+    fly->chunks_per_side = 0;
+    fly->lods = 0;
+    fly->drawn = 0;
+}
+
+/* ----------------------------------------------------------------------------
+ * Move the fly camera: WASD along the view, Q/E down and up, shift for 4
+ * times the speed, arrows or the mouse with the right button held to turn.
+ * The first call places it above the near corner of the map, looking over
+ * it like the isometric view.
+ * ---------------------------------------------------------------------------- */
+void fly_camera_update(FlyCamera *fly, float dt)
+{
+    if (!fly->ready)
+    {
+        float half = FLY_WORLD_SIZE * 0.5f;
+        
+        fly->camera.position = (Vector3){-half, FLY_WORLD_SIZE * 0.25f, -half};
+        fly->camera.up = (Vector3){0.0f, 1.0f, 0.0f};
+        fly->camera.fovy = FLY_FOVY;
+        fly->camera.projection = CAMERA_PERSPECTIVE;
+        fly->yaw = 45.0f * DEG2RAD;
+        fly->pitch = -25.0f * DEG2RAD;
+        fly->ready = 1;
+    }
+    
+    float speed = FLY_SPEED * dt * (IsKeyDown(KEY_LEFT_SHIFT) ? 4.0f : 1.0f);
+    float turn = FLY_TURN_SPEED * dt;
+    
+    if (IsKeyDown(KEY_LEFT)) fly->yaw += turn;
+    if (IsKeyDown(KEY_RIGHT)) fly->yaw -= turn;
+    if (IsKeyDown(KEY_UP)) fly->pitch += turn;
+    if (IsKeyDown(KEY_DOWN)) fly->pitch -= turn;
+    if (IsMouseButtonDown(MOUSE_BUTTON_RIGHT))
+    {
+        Vector2 delta = GetMouseDelta();
+        fly->yaw -= delta.x * 0.005f;
+        fly->pitch -= delta.y * 0.005f;
+    }
+    fly->pitch = fminf(fmaxf(fly->pitch, -1.5f), 1.5f);
+    
+    Vector3 forward = {cosf(fly->pitch) * sinf(fly->yaw), sinf(fly->pitch), cosf(fly->pitch) * cosf(fly->yaw)};
+    Vector3 right = Vector3Normalize(Vector3CrossProduct(forward, fly->camera.up));
+    Vector3 move = {0.0f, 0.0f, 0.0f};
+    
+    if (IsKeyDown(KEY_W)) move = Vector3Add(move, forward);
+    if (IsKeyDown(KEY_S)) move = Vector3Subtract(move, forward);
+    if (IsKeyDown(KEY_D)) move = Vector3Add(move, right);
+    if (IsKeyDown(KEY_A)) move = Vector3Subtract(move, right);
+    if (IsKeyDown(KEY_E)) move.y += 1.0f;
+    if (IsKeyDown(KEY_Q)) move.y -= 1.0f;
+    
+    fly->camera.position = Vector3Add(fly->camera.position, Vector3Scale(move, speed));
+    fly->camera.target = Vector3Add(fly->camera.position, forward);
+}
+
+/* ----------------------------------------------------------------------------
+ * Planes of the perspective view of a camera (raylib's near and far
+ * planes), inward normals, not normalised
+ * ---------------------------------------------------------------------------- */
+void frustum_from_camera(const Camera3D *camera, float aspect, Frustum *frustum)
+{
+    Vector3 forward = Vector3Normalize(Vector3Subtract(camera->target, camera->position));
+    Vector3 right = Vector3Normalize(Vector3CrossProduct(forward, camera->up));
+    Vector3 up = Vector3CrossProduct(right, forward);
+    float half_height = tanf(camera->fovy * 0.5f * DEG2RAD);
+    float half_width = half_height * aspect;
+    
+    /* Sides through the eye: |dot(v, right)| <= depth * half_width, same for up */
+    frustum->normal[0] = Vector3Add(Vector3Scale(forward, half_width), right);
+    frustum->normal[1] = Vector3Subtract(Vector3Scale(forward, half_width), right);
+    frustum->normal[2] = Vector3Add(Vector3Scale(forward, half_height), up);
+    frustum->normal[3] = Vector3Subtract(Vector3Scale(forward, half_height), up);
+    frustum->normal[4] = forward;
+    frustum->normal[5] = Vector3Scale(forward, -1.0f);
+    
+    for (int k = 0; k < 4; k++)
+    {
+        frustum->offset[k] = -Vector3DotProduct(frustum->normal[k], camera->position);
+    }
+    frustum->offset[4] = -Vector3DotProduct(forward, camera->position) - FLY_NEAR;
+    frustum->offset[5] = Vector3DotProduct(forward, camera->position) + FLY_FAR;
+}
+
+/* ----------------------------------------------------------------------------
+ * 0 if the box is entirely outside one of the planes (its corner furthest
+ * along the normal is behind it), else 1 (conservative)
+ * ---------------------------------------------------------------------------- */
+int frustum_contains_box(const Frustum *frustum, BoundingBox box)
+{
+    for (int k = 0; k < 6; k++)
+    {
+        Vector3 n = frustum->normal[k];
+        Vector3 corner = {n.x >= 0.0f ? box.max.x : box.min.x,
+                          n.y >= 0.0f ? box.max.y : box.min.y,
+                          n.z >= 0.0f ? box.max.z : box.min.z};
+        
+        if (Vector3DotProduct(n, corner) + frustum->offset[k] < 0.0f) return 0;
+    }
+    
+    return 1;
+}
+
+/* ----------------------------------------------------------------------------
+ * Draw X, Y, Z axes
+ * ---------------------------------------------------------------------------- */
+void draw_reference_axes(void)
+{
+    /* Draw reference axes */
+    Vector2 origin_base = isometric_projection(0, 0, 0);
+    Vector2 axis_x_base = isometric_projection(ITERATIONS * 0.25f, 0, 0);
+    Vector2 axis_y_base = isometric_projection(0, ITERATIONS * 0.25f, 0);
+    Vector2 axis_z_base = isometric_projection(0, 0, max_height * 0.5f);
+    
     /* Apply scale and offset */
     Vector2 origin = {origin_base.x * render_scale + offset_x,
                      origin_base.y * render_scale + offset_y};
@@ -251,148 +2135,5854 @@ void draw_reference_axes(void)
     Vector2 axis_z = {axis_z_base.x * render_scale + offset_x,
                      axis_z_base.y * render_scale + offset_y};
     
-    DrawLineV((Vector2){origin.x, SCREEN_HEIGHT - origin.y},
-             (Vector2){axis_x.x, SCREEN_HEIGHT - axis_x.y}, RED);
-    DrawLineV((Vector2){origin.x, SCREEN_HEIGHT - origin.y},
-             (Vector2){axis_y.x, SCREEN_HEIGHT - axis_y.y}, GREEN);
-    DrawLineV((Vector2){origin.x, SCREEN_HEIGHT - origin.y},
-             (Vector2){axis_z.x, SCREEN_HEIGHT - axis_z.y}, BLUE);
+    DrawLineV((Vector2){origin.x, SCREEN_HEIGHT - origin.y},
+             (Vector2){axis_x.x, SCREEN_HEIGHT - axis_x.y}, RED);
+    DrawLineV((Vector2){origin.x, SCREEN_HEIGHT - origin.y},
+             (Vector2){axis_y.x, SCREEN_HEIGHT - axis_y.y}, GREEN);
+    DrawLineV((Vector2){origin.x, SCREEN_HEIGHT - origin.y},
+             (Vector2){axis_z.x, SCREEN_HEIGHT - axis_z.y}, BLUE);
+    
+    DrawText("X", axis_x.x + 10, SCREEN_HEIGHT - axis_x.y, 14, RED);
+    DrawText("Y", axis_y.x + 10, SCREEN_HEIGHT - axis_y.y, 14, GREEN);
+    DrawText("Z", axis_z.x + 10, SCREEN_HEIGHT - axis_z.y, 14, BLUE);
+}
+
+/* ----------------------------------------------------------------------------
+ * Calculate normalized height
+ * ---------------------------------------------------------------------------- */
+float calculate_normalized_height(float height, float max_alt, float min_alt)
+{
+    float range = max_alt - min_alt;
+    float normalized = (height - min_alt) / range;
+    
+    return normalized;
+}
+
+/* ----------------------------------------------------------------------------
+ * Calculate color based on height
+ * ---------------------------------------------------------------------------- */
+Color calculate_height_color(float height, float max_alt, float min_alt)
+{
+    float normalized = calculate_normalized_height(height, max_alt, min_alt);
+    
+    /* Height levels (inverted: snow at top, water at bottom) */
+    if (normalized < 0.2f)  return COLOR_SNOW;
+    if (normalized < 0.35f) return COLOR_ROCK;
+    if (normalized < 0.65f) return COLOR_GRASS;
+    if (normalized < 0.85f) return COLOR_SAND;
+    
+    return COLOR_WATER;
+}
+
+/* ----------------------------------------------------------------------------
+ * Generate terrain using the selected generator (Diamond-Square by default)
+ * ---------------------------------------------------------------------------- */
+void generate_terrain(void)
+{
+    /* Reset min/max */
+    min_height = 0.0f;
+    max_height = 0.0f;
+    
+    if (!generator_generate(&GENERATORS[generator], &terrain[0][0], ITERATIONS, terrain_seed))
+    {
+        fprintf(stderr, "Out of memory for the %s generator\n", GENERATORS[generator].name);
+    }
+}
+
+/* ----------------------------------------------------------------------------
+ * Prepare the traversal state and the per-level noise amplitudes.
+ * The amplitudes are accumulated level by level exactly like the original
+ * loop did, so every generation order uses bit-identical values.
+ * ---------------------------------------------------------------------------- */
+static void diamond_square_init(DiamondSquare *ds, float *map, int size, unsigned int seed)
+{
+    ds->map = map;
+    ds->origin_x = 0;
+    ds->origin_y = 0;
+    ds->stride = size;
+    ds->size = size;
+    ds->seed = seed;
+    
+    float amplitude = INITIAL_HEIGHT;
+    int level = 0;
+    
+    while ((2 << level) < size - 1) level++;
+    
+    for (int length = size - 1; length > 1; length /= 2)
+    {
+        ds->amplitude[level--] = amplitude;
+        amplitude *= powf(2.0f, -ROUGHNESS);
+    }
+}
+
+/* ----------------------------------------------------------------------------
+ * Log2 of the half-size of the level that produces sample (x, y)
+ * ---------------------------------------------------------------------------- */
+static inline int diamond_square_level(int x, int y)
+{
+    int bits = x | y;
+    int level = 0;
+    
+    while (!(bits & 1))
+    {
+        bits >>= 1;
+        level++;
+    }
+    return level;
+}
+
+/* ----------------------------------------------------------------------------
+ * SQUARE STEP for one sample: centre of the square with half-side 'half'
+ * ---------------------------------------------------------------------------- */
+static inline void square_step_point(const DiamondSquare *ds, int x, int y, int half, float amplitude)
+{
+    float average = (DS_AT(ds, x - half, y - half) +
+                     DS_AT(ds, x + half, y - half) +
+                     DS_AT(ds, x - half, y + half) +
+                     DS_AT(ds, x + half, y + half)) / 4.0f;
+    
+    DS_AT(ds, x, y) = average + calculate_noise(amplitude, ds->seed, x, y);
+}
+
+/* ----------------------------------------------------------------------------
+ * DIAMOND STEP for one sample: average of the (up to) 4 neighbours
+ * ---------------------------------------------------------------------------- */
+static inline void diamond_step_point(const DiamondSquare *ds, int x, int y, int half, float amplitude)
+{
+    int size = ds->size;
+    float sum = 0.0f;
+    int count = 0;
+    
+    /* Check the 4 neighbors */
+    if (x >= half)
+    {
+        sum += DS_AT(ds, x - half, y);
+        count++;
+    }
+    if (x + half < size)
+    {
+        sum += DS_AT(ds, x + half, y);
+        count++;
+    }
+    if (y >= half)
+    {
+        sum += DS_AT(ds, x, y - half);
+        count++;
+    }
+    if (y + half < size)
+    {
+        sum += DS_AT(ds, x, y + half);
+        count++;
+    }
+    
+    DS_AT(ds, x, y) = (sum * INVERSE_COUNT[count]) + calculate_noise(amplitude, ds->seed, x, y);
+}
+
+/* ----------------------------------------------------------------------------
+ * Diamond-Square, breadth-first: every level sweeps the whole grid.
+ * Expects the 4 corners of the map to be already set.
+ * ---------------------------------------------------------------------------- */
+void diamond_square_breadth_first(float *map, int size, unsigned int seed)
+{
+    DiamondSquare ds;
+    diamond_square_init(&ds, map, size, seed);
+    
+    for (int length = size - 1; length > 1; length /= 2)
+    {
+        int half = length / 2;
+        float amplitude = ds.amplitude[diamond_square_level(half, half)];
+        
+        /* SQUARE STEP */
+        #pragma omp parallel for schedule(static) if (size > 512)
+        for (int x = 0; x < size - 1; x += length)
+        {
+            for (int y = 0; y < size - 1; y += length)
+            {
+                square_step_point(&ds, x + half, y + half, half, amplitude);
+            }
+        }
+        
+        /* DIAMOND STEP */
+        #pragma omp parallel for schedule(static) if (size > 512)
+        for (int x = 0; x < size; x += half)
+        {
+            for (int y = (x + half) % length; y < size; y += length)
+            {
+                diamond_step_point(&ds, x, y, half, amplitude);
+            }
+        }
+    }
+}
+
+/* ----------------------------------------------------------------------------
+ * Coarse levels (length > tile): few samples, swept breadth-first.
+ * Afterwards every sample whose x and y are multiples of 'tile' is final.
+ * ---------------------------------------------------------------------------- */
+static void diamond_square_coarse_levels(const DiamondSquare *ds, int tile)
+{
+    int size = ds->size;
+    
+    for (int length = size - 1; length > tile; length /= 2)
+    {
+        int half = length / 2;
+        float amplitude = ds->amplitude[diamond_square_level(half, half)];
+        
+        for (int x = half; x < size; x += length)
+        {
+            for (int y = half; y < size; y += length)
+            {
+                square_step_point(ds, x, y, half, amplitude);
+            }
+        }
+        
+        for (int x = 0; x < size; x += half)
+        {
+            for (int y = (x + half) % length; y < size; y += length)
+            {
+                diamond_step_point(ds, x, y, half, amplitude);
+            }
+        }
+    }
+}
+
+/* ----------------------------------------------------------------------------
+ * Finish all the fine levels (length <= DEPTH_FIRST_TILE) of one tile.
+ * Each level works on the tile window shifted back by a per-level lag, so
+ * every sample it reads was produced by this tile or by a tile that comes
+ * earlier in the quadrant order (smaller x and y), and every sample of the
+ * level is computed exactly once over all the tiles.
+ * ---------------------------------------------------------------------------- */
+static void diamond_square_tile(const DiamondSquare *ds, int tile_x, int tile_y)
+{
+    int size = ds->size;
+    int last = (size - 1) / DEPTH_FIRST_TILE - 1;
+    int lag = 0;
+    
+    for (int half = DEPTH_FIRST_TILE / 2; half >= 1; half /= 2)
+    {
+        int length = half * 2;
+        float amplitude = ds->amplitude[diamond_square_level(half, half)];
+        
+        /* SQUARE STEP: needs the coarser level up to +half ahead */
+        lag += half;
+        int x0 = tile_x * DEPTH_FIRST_TILE - lag, x1 = x0 + DEPTH_FIRST_TILE;
+        int y0 = tile_y * DEPTH_FIRST_TILE - lag, y1 = y0 + DEPTH_FIRST_TILE;
+        if (x0 < 0) x0 = 0;
+        if (y0 < 0) y0 = 0;
+        if (tile_x == last) x1 = size;
+        if (tile_y == last) y1 = size;
+        
+        for (int x = x0 + ((half - x0) % length + length) % length; x < x1; x += length)
+        {
+            for (int y = y0 + ((half - y0) % length + length) % length; y < y1; y += length)
+            {
+                square_step_point(ds, x, y, half, amplitude);
+            }
+        }
+        
+        /* DIAMOND STEP: needs the square centres up to +half ahead */
+        lag += half;
+        x0 = tile_x * DEPTH_FIRST_TILE - lag, x1 = x0 + DEPTH_FIRST_TILE;
+        y0 = tile_y * DEPTH_FIRST_TILE - lag, y1 = y0 + DEPTH_FIRST_TILE;
+        if (x0 < 0) x0 = 0;
+        if (y0 < 0) y0 = 0;
+        if (tile_x == last) x1 = size;
+        if (tile_y == last) y1 = size;
+        
+        for (int x = x0 + (half - x0 % half) % half; x < x1; x += half)
+        {
+            int first = (x + half) % length;
+            
+            for (int y = y0 + ((first - y0) % length + length) % length; y < y1; y += length)
+            {
+                diamond_step_point(ds, x, y, half, amplitude);
+            }
+        }
+    }
+}
+
+/* ----------------------------------------------------------------------------
+ * Quadrant recursion over the tiles (Z order). A tile only depends on tiles
+ * with smaller or equal x and y, which the Z order always visits first.
+ * ---------------------------------------------------------------------------- */
+static void diamond_square_subdivide(const DiamondSquare *ds, int tile_x, int tile_y, int tiles)
+{
+    if (tiles == 1)
+    {
+        diamond_square_tile(ds, tile_x, tile_y);
+        return;
+    }
+    
+    int half = tiles / 2;
+    
+    diamond_square_subdivide(ds, tile_x, tile_y, half);
+    diamond_square_subdivide(ds, tile_x, tile_y + half, half);
+    diamond_square_subdivide(ds, tile_x + half, tile_y, half);
+    diamond_square_subdivide(ds, tile_x + half, tile_y + half, half);
+}
+
+/* ----------------------------------------------------------------------------
+ * Diamond-Square, depth-first: same output as the breadth-first order.
+ * The coarse levels are swept as usual, then the fine levels are finished
+ * tile by tile so each tile neighbourhood stays in cache.
+ * Expects the 4 corners of the map to be already set.
+ * ---------------------------------------------------------------------------- */
+void diamond_square_depth_first(float *map, int size, unsigned int seed)
+{
+    DiamondSquare ds;
+    diamond_square_init(&ds, map, size, seed);
+    
+    if (size - 1 <= DEPTH_FIRST_TILE)
+    {
+        diamond_square_breadth_first(map, size, seed);
+        return;
+    }
+    
+    diamond_square_coarse_levels(&ds, DEPTH_FIRST_TILE);
+    diamond_square_subdivide(&ds, 0, 0, (size - 1) / DEPTH_FIRST_TILE);
+}
+
+/* ----------------------------------------------------------------------------
+ * First sample >= 'from' that is congruent to 'phase' modulo 'step'
+ * ---------------------------------------------------------------------------- */
+static inline int align_up(int from, int phase, int step)
+{
+    return from + ((phase - from) % step + step) % step;
+}
+
+/* ----------------------------------------------------------------------------
+ * Quadrant task leaf: finish one TASK_TILE tile on a private window.
+ * The window holds the tile plus the halo the fine levels depend on
+ * (< 2 tiles on each side), seeded from the coarse lattice. Halo samples
+ * are recomputed with the same position-based noise, so they match what
+ * the neighbouring tile computes. Only the samples owned by the tile
+ * ([x0, x0 + TASK_TILE) x [y0, y0 + TASK_TILE), plus the far grid border
+ * for the last tiles) are written back, so no two tasks write the same
+ * sample and the result does not depend on scheduling.
+ * ---------------------------------------------------------------------------- */
+static void diamond_square_task_tile(const DiamondSquare *grid, float *window, int tile_x, int tile_y)
+{
+    int size = grid->size;
+    int x0 = tile_x * TASK_TILE, x1 = x0 + TASK_TILE;
+    int y0 = tile_y * TASK_TILE, y1 = y0 + TASK_TILE;
+    int extent_square[32], extent_diamond[32];
+    
+    /* Halo each level needs, from the finest level up:
+       diamonds need square centres 'half' further out, squares need the
+       coarser level 'half' further out */
+    int extent = 0;
+    for (int half = 1; half < TASK_TILE; half *= 2)
+    {
+        int level = diamond_square_level(half, half);
+        extent_diamond[level] = extent;
+        extent_square[level] = extent + half;
+        extent += 2 * half;
+    }
+    
+    DiamondSquare ds = *grid;
+    ds.map = window;
+    ds.origin_x = x0 - extent > 0 ? x0 - extent : 0;
+    ds.origin_y = y0 - extent > 0 ? y0 - extent : 0;
+    int end_x = x1 + extent < size - 1 ? x1 + extent : size - 1;
+    int end_y = y1 + extent < size - 1 ? y1 + extent : size - 1;
+    ds.stride = end_y - ds.origin_y + 1;
+    
+    /* Seed the window with the coarse lattice */
+    for (int x = align_up(ds.origin_x, 0, TASK_TILE); x <= end_x; x += TASK_TILE)
+    {
+        for (int y = align_up(ds.origin_y, 0, TASK_TILE); y <= end_y; y += TASK_TILE)
+        {
+            DS_AT(&ds, x, y) = MAP_AT(grid->map, size, x, y);
+        }
+    }
+    
+    for (int half = TASK_TILE / 2; half >= 1; half /= 2)
+    {
+        int length = half * 2;
+        int level = diamond_square_level(half, half);
+        float amplitude = ds.amplitude[level];
+        
+        /* SQUARE STEP */
+        int lo_x = x0 - extent_square[level] > 0 ? x0 - extent_square[level] : 0;
+        int lo_y = y0 - extent_square[level] > 0 ? y0 - extent_square[level] : 0;
+        int hi_x = x1 + extent_square[level] < size - 1 ? x1 + extent_square[level] : size - 1;
+        int hi_y = y1 + extent_square[level] < size - 1 ? y1 + extent_square[level] : size - 1;
+        
+        for (int x = align_up(lo_x, half, length); x <= hi_x; x += length)
+        {
+            for (int y = align_up(lo_y, half, length); y <= hi_y; y += length)
+            {
+                square_step_point(&ds, x, y, half, amplitude);
+            }
+        }
+        
+        /* DIAMOND STEP */
+        lo_x = x0 - extent_diamond[level] > 0 ? x0 - extent_diamond[level] : 0;
+        lo_y = y0 - extent_diamond[level] > 0 ? y0 - extent_diamond[level] : 0;
+        hi_x = x1 + extent_diamond[level] < size - 1 ? x1 + extent_diamond[level] : size - 1;
+        hi_y = y1 + extent_diamond[level] < size - 1 ? y1 + extent_diamond[level] : size - 1;
+        
+        for (int x = align_up(lo_x, 0, half); x <= hi_x; x += half)
+        {
+            for (int y = align_up(lo_y, (x + half) % length, length); y <= hi_y; y += length)
+            {
+                diamond_step_point(&ds, x, y, half, amplitude);
+            }
+        }
+    }
+    
+    /* Write back the owned samples, except the coarse lattice other tasks read */
+    if (x1 == size - 1) x1 = size;
+    if (y1 == size - 1) y1 = size;
+    
+    for (int x = x0; x < x1; x++)
+    {
+        int first = y0, last = y1;
+        
+        if (x % TASK_TILE == 0)
+        {
+            first = y0 + 1;
+            if (last == size) last = size - 1;
+        }
+        
+        memcpy(&MAP_AT(grid->map, size, x, first), &DS_AT(&ds, x, first), (size_t)(last - first) * sizeof(float));
+    }
+}
+
+/* ----------------------------------------------------------------------------
+ * Spawn one task per quadrant down to the TASK_TILE cutoff. Idle threads
+ * take pending quadrants from the OpenMP task pool, so the load balances
+ * itself without a barrier per level.
+ * ---------------------------------------------------------------------------- */
+static void diamond_square_spawn(const DiamondSquare *ds, float **windows, int tile_x, int tile_y, int tiles)
+{
+    if (tiles == 1)
+    {
+        diamond_square_task_tile(ds, windows[get_thread_index()], tile_x, tile_y);
+        return;
+    }
+    
+    int half = tiles / 2;
+    
+    #pragma omp task
+    diamond_square_spawn(ds, windows, tile_x, tile_y, half);
+    #pragma omp task
+    diamond_square_spawn(ds, windows, tile_x, tile_y + half, half);
+    #pragma omp task
+    diamond_square_spawn(ds, windows, tile_x + half, tile_y, half);
+    #pragma omp task
+    diamond_square_spawn(ds, windows, tile_x + half, tile_y + half, half);
+    #pragma omp taskwait
+}
+
+/* ----------------------------------------------------------------------------
+ * Diamond-Square, quadrant tasks: same output as the breadth-first order,
+ * whatever the number of threads. With a single thread the halo recompute
+ * only costs time, so small maps and single-threaded runs go breadth-first.
+ * Expects the 4 corners of the map to be already set.
+ * ---------------------------------------------------------------------------- */
+void diamond_square_parallel(float *map, int size, unsigned int seed)
+{
+    DiamondSquare ds;
+    diamond_square_init(&ds, map, size, seed);
+    
+    if (size - 1 <= TASK_TILE || get_thread_count() == 1)
+    {
+        diamond_square_breadth_first(map, size, seed);
+        return;
+    }
+    
+    /* One window per thread: tile plus a halo of 2 tiles on each side */
+    int threads = get_thread_count();
+    size_t window_side = 5 * TASK_TILE + 1;
+    float **windows = calloc((size_t)threads, sizeof(float *));
+    int ok = windows != NULL;
+    
+    for (int t = 0; ok && t < threads; t++)
+    {
+        windows[t] = malloc(window_side * window_side * sizeof(float));
+        ok = windows[t] != NULL;
+    }
+    
+    if (ok)
+    {
+        diamond_square_coarse_levels(&ds, TASK_TILE);
+        
+        #pragma omp parallel num_threads(threads)
+        #pragma omp single
+        diamond_square_spawn(&ds, windows, 0, 0, (size - 1) / TASK_TILE);
+    }
+    
+    for (int t = 0; windows != NULL && t < threads; t++) free(windows[t]);
+    free(windows);
+    
+    if (!ok) diamond_square_breadth_first(map, size, seed);
+}
+
+/* ----------------------------------------------------------------------------
+ * Diamond-Square ensemble: ENSEMBLE_LANES terrains with different seeds in
+ * one pass. The samples are interleaved across the terrains ([x][y][lane]),
+ * so the innermost loop runs over the lanes and is vectorised; the position
+ * and neighbour bookkeeping is done once for all of them.
+ * Each map gets the 4 corners at 0 (as reset_canvas_corners) and the same
+ * values diamond_square_breadth_first produces with its seed.
+ * Returns 0 if out of memory.
+ * ---------------------------------------------------------------------------- */
+int diamond_square_ensemble(float *maps[ENSEMBLE_LANES], int size, const unsigned int seeds[ENSEMBLE_LANES])
+{
+    DiamondSquare ds;
+    diamond_square_init(&ds, NULL, size, 0);
+    
+    float *lanes = calloc((size_t)size * size * ENSEMBLE_LANES, sizeof(float));
+    if (lanes == NULL) return 0;
+    
+    for (int length = size - 1; length > 1; length /= 2)
+    {
+        int half = length / 2;
+        float amplitude = ds.amplitude[diamond_square_level(half, half)];
+        
+        /* SQUARE STEP */
+        for (int x = half; x < size; x += length)
+        {
+            for (int y = half; y < size; y += length)
+            {
+                float *out = &lanes[((size_t)x * size + y) * ENSEMBLE_LANES];
+                const float *a = &lanes[((size_t)(x - half) * size + (y - half)) * ENSEMBLE_LANES];
+                const float *b = &lanes[((size_t)(x + half) * size + (y - half)) * ENSEMBLE_LANES];
+                const float *c = &lanes[((size_t)(x - half) * size + (y + half)) * ENSEMBLE_LANES];
+                const float *d = &lanes[((size_t)(x + half) * size + (y + half)) * ENSEMBLE_LANES];
+                
+                for (int l = 0; l < ENSEMBLE_LANES; l++)
+                {
+                    float average = (a[l] + b[l] + c[l] + d[l]) / 4.0f;
+                    out[l] = average + calculate_noise(amplitude, seeds[l], x, y);
+                }
+            }
+        }
+        
+        /* DIAMOND STEP */
+        for (int x = 0; x < size; x += half)
+        {
+            for (int y = (x + half) % length; y < size; y += length)
+            {
+                const float *neighbour[4];
+                int count = 0;
+                
+                /* Same neighbour order as diamond_step_point */
+                if (x >= half) neighbour[count++] = &lanes[((size_t)(x - half) * size + y) * ENSEMBLE_LANES];
+                if (x + half < size) neighbour[count++] = &lanes[((size_t)(x + half) * size + y) * ENSEMBLE_LANES];
+                if (y >= half) neighbour[count++] = &lanes[((size_t)x * size + (y - half)) * ENSEMBLE_LANES];
+                if (y + half < size) neighbour[count++] = &lanes[((size_t)x * size + (y + half)) * ENSEMBLE_LANES];
+                
+                float *out = &lanes[((size_t)x * size + y) * ENSEMBLE_LANES];
+                const float *a = neighbour[0], *b = neighbour[1], *c = neighbour[2];
+                
+                if (count == 4)
+                {
+                    const float *d = neighbour[3];
+                    
+                    for (int l = 0; l < ENSEMBLE_LANES; l++)
+                    {
+                        float sum = a[l] + b[l] + c[l] + d[l];
+                        out[l] = (sum * INVERSE_COUNT[4]) + calculate_noise(amplitude, seeds[l], x, y);
+                    }
+                }
+                else
+                {
+                    for (int l = 0; l < ENSEMBLE_LANES; l++)
+                    {
+                        float sum = a[l] + b[l] + c[l];
+                        out[l] = (sum * INVERSE_COUNT[3]) + calculate_noise(amplitude, seeds[l], x, y);
+                    }
+                }
+            }
+        }
+    }
+    
+    /* Split the lanes back into one map per terrain */
+    for (size_t i = 0; i < (size_t)size * size; i++)
+    {
+        for (int l = 0; l < ENSEMBLE_LANES; l++)
+        {
+            maps[l][i] = lanes[i * ENSEMBLE_LANES + l];
+        }
+    }
+    
+    free(lanes);
+    return 1;
+}
+
+/* ----------------------------------------------------------------------------
+ * FFT plan: bit reversal and inverse twiddles exp(+2*pi*i*j / (2*half)),
+ * stored per stage at [half, 2 * half) so every butterfly loop reads them
+ * contiguously. Returns 0 if out of memory.
+ * ---------------------------------------------------------------------------- */
+static int fft_plan_init(FFTPlan *plan, int n)
+{
+    plan->n = n;
+    plan->bit_reverse = malloc((size_t)n * sizeof(int));
+    plan->twiddle_re = malloc((size_t)n * sizeof(float));
+    plan->twiddle_im = malloc((size_t)n * sizeof(float));
+    if (plan->bit_reverse == NULL || plan->twiddle_re == NULL || plan->twiddle_im == NULL) return 0;
+    
+    int bits = 0;
+    while ((1 << bits) < n) bits++;
+    
+    for (int i = 0; i < n; i++)
+    {
+        int r = 0;
+        for (int b = 0; b < bits; b++) r |= ((i >> b) & 1) << (bits - 1 - b);
+        plan->bit_reverse[i] = r;
+    }
+    
+    for (int half = 1; half < n; half *= 2)
+    {
+        for (int j = 0; j < half; j++)
+        {
+            double angle = PI * (double)j / half;
+            plan->twiddle_re[half + j] = (float)cos(angle);
+            plan->twiddle_im[half + j] = (float)sin(angle);
+        }
+    }
+    
+    return 1;
+}
+
+static void fft_plan_free(FFTPlan *plan)
+{
+    free(plan->bit_reverse);
+    free(plan->twiddle_re);
+    free(plan->twiddle_im);
+}
+
+/* ----------------------------------------------------------------------------
+ * In-place inverse FFT (unscaled) of one contiguous row, real and imaginary
+ * parts in separate arrays so the butterflies vectorise. The first two
+ * radix-2 stages, whose loops are too short to vectorise, are done together
+ * as one radix-4 pass.
+ * ---------------------------------------------------------------------------- */
+static void fft_row(float *re, float *im, const FFTPlan *plan)
+{
+    int n = plan->n;
+    int half = 1;
+    
+    for (int i = 0; i < n; i++)
+    {
+        int j = plan->bit_reverse[i];
+        if (i < j)
+        {
+            float t = re[i]; re[i] = re[j]; re[j] = t;
+            t = im[i]; im[i] = im[j]; im[j] = t;
+        }
+    }
+    
+    if (n >= 4)
+    {
+        for (int s = 0; s < n; s += 4)
+        {
+            float ar = re[s] + re[s + 1], ai = im[s] + im[s + 1];
+            float br = re[s] - re[s + 1], bi = im[s] - im[s + 1];
+            float cr = re[s + 2] + re[s + 3], ci = im[s + 2] + im[s + 3];
+            float dr = re[s + 2] - re[s + 3], di = im[s + 2] - im[s + 3];
+            
+            /* Twiddles 1 and i */
+            re[s] = ar + cr;
+            im[s] = ai + ci;
+            re[s + 1] = br - di;
+            im[s + 1] = bi + dr;
+            re[s + 2] = ar - cr;
+            im[s + 2] = ai - ci;
+            re[s + 3] = br + di;
+            im[s + 3] = bi - dr;
+        }
+        half = 4;
+    }
+    
+    for (; half < n; half *= 2)
+    {
+        const float *wr = plan->twiddle_re + half, *wi = plan->twiddle_im + half;
+        
+        for (int start = 0; start < n; start += 2 * half)
+        {
+            float *ar = re + start, *ai = im + start;
+            float *br = ar + half, *bi = ai + half;
+            
+            #pragma omp simd
+            for (int j = 0; j < half; j++)
+            {
+                float tr = br[j] * wr[j] - bi[j] * wi[j];
+                float ti = br[j] * wi[j] + bi[j] * wr[j];
+                br[j] = ar[j] - tr;
+                bi[j] = ai[j] - ti;
+                ar[j] += tr;
+                ai[j] += ti;
+            }
+        }
+    }
+}
+
+/* ----------------------------------------------------------------------------
+ * FFT of every row of an n x n array, spread over the threads
+ * ---------------------------------------------------------------------------- */
+static void fft_rows(float *re, float *im, const FFTPlan *plan)
+{
+    int n = plan->n;
+    
+    #pragma omp parallel for schedule(static)
+    for (int x = 0; x < n; x++)
+    {
+        fft_row(re + (size_t)x * n, im + (size_t)x * n, plan);
+    }
+}
+
+/* ----------------------------------------------------------------------------
+ * FFT of every column of an n x n array, without a transpose: a strip of
+ * SPECTRAL_STRIP columns is transformed at once, each butterfly combining
+ * two row segments, so the inner loop is contiguous and vectorised. One
+ * strip (n x width samples) per thread at a time; strips are narrowed from
+ * SPECTRAL_STRIP to give every thread at least 4 (the result is the same
+ * for any width).
+ * ---------------------------------------------------------------------------- */
+static void fft_columns(float *re, float *im, const FFTPlan *plan)
+{
+    int n = plan->n;
+    int width = n < SPECTRAL_STRIP ? n : SPECTRAL_STRIP;
+    int strips = 4 * get_thread_count();
+    
+    while (width > SPECTRAL_STRIP_MIN && n / width < strips) width /= 2;
+    
+    #pragma omp parallel for schedule(static)
+    for (int column = 0; column < n; column += width)
+    {
+        for (int i = 0; i < n; i++)
+        {
+            int j = plan->bit_reverse[i];
+            if (i < j)
+            {
+                float *ar = re + (size_t)i * n + column, *ai = im + (size_t)i * n + column;
+                float *br = re + (size_t)j * n + column, *bi = im + (size_t)j * n + column;
+                
+                for (int c = 0; c < width; c++)
+                {
+                    float t = ar[c]; ar[c] = br[c]; br[c] = t;
+                    t = ai[c]; ai[c] = bi[c]; bi[c] = t;
+                }
+            }
+        }
+        
+        for (int half = 1; half < n; half *= 2)
+        {
+            for (int start = 0; start < n; start += 2 * half)
+            {
+                for (int j = 0; j < half; j++)
+                {
+                    float wr = plan->twiddle_re[half + j], wi = plan->twiddle_im[half + j];
+                    float *ar = re + (size_t)(start + j) * n + column, *ai = im + (size_t)(start + j) * n + column;
+                    float *br = ar + (size_t)half * n, *bi = ai + (size_t)half * n;
+                    
+                    #pragma omp simd
+                    for (int c = 0; c < width; c++)
+                    {
+                        float tr = br[c] * wr - bi[c] * wi;
+                        float ti = br[c] * wi + bi[c] * wr;
+                        br[c] = ar[c] - tr;
+                        bi[c] = ai[c] - ti;
+                        ar[c] += tr;
+                        ai[c] += ti;
+                    }
+                }
+            }
+        }
+    }
+}
+
+/* ----------------------------------------------------------------------------
+ * Spectral synthesis: white noise shaped by a 1/f^beta power spectrum, then
+ * an inverse 2D FFT (rows, then column strips).
+ * The field is periodic over size - 1 samples and the last row and column
+ * repeat the first ones, so the terrain tiles. The spectrum is a hash of
+ * seed and frequency and every row is transformed by a single thread, so
+ * the result does not depend on the thread count. Heights are scaled to
+ * +-INITIAL_HEIGHT.
+ * Returns 0 if out of memory.
+ * ---------------------------------------------------------------------------- */
+int spectral_generate(float *map, int size, unsigned int seed, float beta)
+{
+    int n = size - 1;
+    size_t count = (size_t)n * n;
+    float *re = malloc(count * sizeof(float));
+    float *im = malloc(count * sizeof(float));
+    FFTPlan plan;
+    int ok = fft_plan_init(&plan, n) && re != NULL && im != NULL;
+    
+    if (ok)
+    {
+        /* Spectrum: amplitude f^(-beta/2), random real and imaginary parts */
+        #pragma omp parallel for schedule(static)
+        for (int u = 0; u < n; u++)
+        {
+            float fu = (float)(u <= n / 2 ? u : u - n);
+            
+            for (int v = 0; v < n; v++)
+            {
+                float fv = (float)(v <= n / 2 ? v : v - n);
+                float f2 = fu * fu + fv * fv;
+                float amplitude = f2 > 0.0f ? powf(f2, -0.25f * beta) : 0.0f;
+                
+                re[(size_t)u * n + v] = calculate_noise(amplitude, seed, u, v);
+                im[(size_t)u * n + v] = calculate_noise(amplitude, seed ^ 0x5bd1e995u, u, v);
+            }
+        }
+        
+        fft_rows(re, im, &plan);
+        fft_columns(re, im, &plan);
+        
+        float peak = 0.0f;
+        #pragma omp parallel for schedule(static) reduction(max:peak)
+        for (size_t i = 0; i < count; i++)
+        {
+            peak = fmaxf(peak, fabsf(re[i]));
+        }
+        float scale = peak > 0.0f ? INITIAL_HEIGHT / peak : 0.0f;
+        
+        /* Real part, wrapped on the last row and column */
+        #pragma omp parallel for schedule(static)
+        for (int x = 0; x < size; x++)
+        {
+            const float *row = re + (size_t)(x % n) * n;
+            float *out = &MAP_AT(map, size, x, 0);
+            
+            for (int y = 0; y < n; y++) out[y] = row[y] * scale;
+            out[n] = row[0] * scale;
+        }
+    }
+    
+    fft_plan_free(&plan);
+    free(re);
+    free(im);
+    return ok;
+}
+
+/* ----------------------------------------------------------------------------
+ * Gradient (Perlin) noise, about -1..1, at lattice position (x, y) given in
+ * 16.16 fixed point. The gradient of each lattice corner comes from a hash
+ * of seed and corner, not from a table, and the fixed point positions need
+ * no floor, so the function is branch- and lookup-free and vectorises
+ * across points. The lattice repeats every 65536 cells.
+ * ---------------------------------------------------------------------------- */
+static inline float gradient_dot(unsigned int h, float dx, float dy)
+{
+    /* 8 directions: (+-1, +-2), (+-2, +-1) */
+    float a = h & 4 ? dy : dx;
+    float b = h & 4 ? dx : dy;
+    
+    return (h & 1 ? -a : a) + (h & 2 ? -2.0f * b : 2.0f * b);
+}
+
+static inline float gradient_noise(unsigned int x, unsigned int y, unsigned int seed)
+{
+    int ix = (int)(x >> 16), iy = (int)(y >> 16);
+    int ix1 = (ix + 1) & 0xffff, iy1 = (iy + 1) & 0xffff;
+    float dx = (float)(x & 0xffff) * (1.0f / 65536.0f);
+    float dy = (float)(y & 0xffff) * (1.0f / 65536.0f);
+    
+    /* Quintic fade, smooth up to the second derivative */
+    float u = dx * dx * dx * (dx * (dx * 6.0f - 15.0f) + 10.0f);
+    float v = dy * dy * dy * (dy * (dy * 6.0f - 15.0f) + 10.0f);
+    
+    float n00 = gradient_dot(hash_position(seed, ix, iy), dx, dy);
+    float n10 = gradient_dot(hash_position(seed, ix1, iy), dx - 1.0f, dy);
+    float n01 = gradient_dot(hash_position(seed, ix, iy1), dx, dy - 1.0f);
+    float n11 = gradient_dot(hash_position(seed, ix1, iy1), dx - 1.0f, dy - 1.0f);
+    
+    float nx0 = n00 + u * (n10 - n00);
+    float nx1 = n01 + u * (n11 - n01);
+    
+    return nx0 + v * (nx1 - nx0);
+}
+
+/* ----------------------------------------------------------------------------
+ * fBm over any rectangle of the plane: out[i * stride + j] is the height at
+ * sample (x0 + i, y0 + j), the same whichever rectangle it is computed in,
+ * so chunks evaluated separately join without seams. Every octave scales
+ * the frequency by 'lacunarity' and the amplitude by 'gain'; the sum is
+ * scaled to about +-INITIAL_HEIGHT. Frequencies are rounded to 1/65536
+ * period per sample. The loop over j runs one point per SIMD lane (8 with
+ * AVX2, 16 with AVX-512).
+ * ---------------------------------------------------------------------------- */
+void fbm_generate_region(float *out, int stride, int x0, int y0, int width, int height,
+                         unsigned int seed, const FbmSettings *settings)
+{
+    float total = 0.0f, amplitude = 1.0f;
+    
+    for (int o = 0; o < settings->octaves; o++)
+    {
+        total += amplitude;
+        amplitude *= settings->gain;
+    }
+    float scale = total > 0.0f ? INITIAL_HEIGHT / total : 0.0f;
+    
+    for (int i = 0; i < width; i++)
+    {
+        float *row = out + (size_t)i * stride;
+        
+        for (int j = 0; j < height; j++) row[j] = 0.0f;
+        
+        float frequency = settings->frequency;
+        amplitude = scale;
+        
+        for (int o = 0; o < settings->octaves; o++)
+        {
+            unsigned int octave_seed = seed + (unsigned int)o * 0x9e3779b9u;
+            unsigned int step = (unsigned int)(frequency * 65536.0f + 0.5f);
+            unsigned int x = (unsigned int)(x0 + i) * step;
+            
+            #pragma omp simd simdlen(FBM_LANES)
+            for (int j = 0; j < height; j++)
+            {
+                row[j] += amplitude * gradient_noise(x, (unsigned int)(y0 + j) * step, octave_seed);
+            }
+            
+            frequency *= settings->lacunarity;
+            amplitude *= settings->gain;
+        }
+    }
+}
+
+/* ----------------------------------------------------------------------------
+ * fBm over a whole map, FBM_CHUNK rows per task
+ * ---------------------------------------------------------------------------- */
+void fbm_generate(float *map, int size, unsigned int seed, const FbmSettings *settings)
+{
+    #pragma omp parallel for schedule(dynamic)
+    for (int x = 0; x < size; x += FBM_CHUNK)
+    {
+        int rows = size - x < FBM_CHUNK ? size - x : FBM_CHUNK;
+        fbm_generate_region(&MAP_AT(map, size, x, 0), size, x, 0, rows, size, seed, settings);
+    }
+}
+
+/* ----------------------------------------------------------------------------
+ * Generator interface, whole-map generators (Diamond-Square, spectral):
+ * the state remembers size and seed; a request for the whole map is
+ * generated in place, any other region is cut from a copy generated on the
+ * first such request.
+ * ---------------------------------------------------------------------------- */
+static void *map_generator_init(int size, unsigned int seed)
+{
+    MapGeneratorState *state = calloc(1, sizeof(MapGeneratorState));
+    if (state == NULL) return NULL;
+    
+    state->size = size;
+    state->seed = seed;
+    return state;
+}
+
+static int map_generator_region(MapGeneratorState *state, int (*fill)(float *, int, unsigned int),
+                                float *out, int stride, int x0, int y0, int width, int height)
+{
+    int size = state->size;
+    
+    if (x0 == 0 && y0 == 0 && width == size && height == size && stride == size)
+    {
+        return fill(out, size, state->seed);
+    }
+    
+    if (state->map == NULL)
+    {
+        state->map = malloc((size_t)size * size * sizeof(float));
+        if (state->map == NULL || !fill(state->map, size, state->seed)) return 0;
+    }
+    
+    for (int i = 0; i < width; i++)
+    {
+        memcpy(out + (size_t)i * stride, &MAP_AT(state->map, size, x0 + i, y0), (size_t)height * sizeof(float));
+    }
+    return 1;
+}
+
+static void map_generator_destroy(void *state)
+{
+    if (state != NULL) free(((MapGeneratorState *)state)->map);
+    free(state);
+}
+
+/* Diamond-Square in the selected order, corners at 0 */
+static int diamond_square_fill(float *map, int size, unsigned int seed)
+{
+    int last = size - 1;
+    
+    MAP_AT(map, size, 0, 0) = 0.0f;
+    MAP_AT(map, size, 0, last) = 0.0f;
+    MAP_AT(map, size, last, 0) = 0.0f;
+    MAP_AT(map, size, last, last) = 0.0f;
+    
+    if (generation_order == ORDER_DEPTH_FIRST)
+        diamond_square_depth_first(map, size, seed);
+    else if (generation_order == ORDER_PARALLEL)
+        diamond_square_parallel(map, size, seed);
+    else
+        diamond_square_breadth_first(map, size, seed);
+    return 1;
+}
+
+static int diamond_square_generator_region(void *state, float *out, int stride, int x0, int y0, int width, int height)
+{
+    return map_generator_region(state, diamond_square_fill, out, stride, x0, y0, width, height);
+}
+
+static int spectral_fill(float *map, int size, unsigned int seed)
+{
+    return spectral_generate(map, size, seed, spectral_beta);
+}
+
+static int spectral_generator_region(void *state, float *out, int stride, int x0, int y0, int width, int height)
+{
+    return map_generator_region(state, spectral_fill, out, stride, x0, y0, width, height);
+}
+
+/* ----------------------------------------------------------------------------
+ * Generator interface, fBm: regions are evaluated directly, FBM_CHUNK rows
+ * per task. The first octave has FBM_FEATURES periods across the map.
+ * ---------------------------------------------------------------------------- */
+static void *fbm_generator_init(int size, unsigned int seed)
+{
+    FbmGeneratorState *state = malloc(sizeof(FbmGeneratorState));
+    if (state == NULL) return NULL;
+    
+    state->seed = seed;
+    state->settings = fbm_settings;
+    state->settings.frequency = FBM_FEATURES / (size - 1);
+    return state;
+}
+
+static int fbm_generator_region(void *state, float *out, int stride, int x0, int y0, int width, int height)
+{
+    const FbmGeneratorState *fbm = state;
+    
+    #pragma omp parallel for schedule(dynamic)
+    for (int i = 0; i < width; i += FBM_CHUNK)
+    {
+        int rows = width - i < FBM_CHUNK ? width - i : FBM_CHUNK;
+        fbm_generate_region(out + (size_t)i * stride, stride, x0 + i, y0, rows, height, fbm->seed, &fbm->settings);
+    }
+    return 1;
+}
+
+static void fbm_generator_destroy(void *state)
+{
+    free(state);
+}
+
+/* ----------------------------------------------------------------------------
+ * Generate a whole size x size map with a registered generator.
+ * Returns 0 if out of memory.
+ * ---------------------------------------------------------------------------- */
+int generator_generate(const Generator *gen, float *map, int size, unsigned int seed)
+{
+    void *state = gen->init(size, seed);
+    if (state == NULL) return 0;
+    
+    int ok = gen->generate_region(state, map, size, 0, 0, size, size);
+    gen->destroy(state);
+    return ok;
+}
+
+/* ----------------------------------------------------------------------------
+ * Registered generator by name (NULL if unknown)
+ * ---------------------------------------------------------------------------- */
+const Generator *find_generator(const char *name)
+{
+    for (int g = 0; g < GENERATOR_COUNT; g++)
+    {
+        if (strcmp(GENERATORS[g].name, name) == 0) return &GENERATORS[g];
+    }
+    return NULL;
+}
+
+/* ----------------------------------------------------------------------------
+ * Height of the map at a continuous position, bilinear inside the cell, and
+ * its gradient (gx, gy may be NULL)
+ * ---------------------------------------------------------------------------- */
+static inline float erosion_height(const float *map, int size, float px, float py, float *gx, float *gy)
+{
+    int cx = (int)px, cy = (int)py;
+    float u = px - cx, v = py - cy;
+    float h00 = MAP_AT(map, size, cx, cy);
+    float h10 = MAP_AT(map, size, cx + 1, cy);
+    float h01 = MAP_AT(map, size, cx, cy + 1);
+    float h11 = MAP_AT(map, size, cx + 1, cy + 1);
+    
+    if (gx != NULL)
+    {
+        *gx = (h10 - h00) * (1.0f - v) + (h11 - h01) * v;
+        *gy = (h01 - h00) * (1.0f - u) + (h11 - h10) * u;
+    }
+    
+    return (h00 * (1.0f - u) + h10 * u) * (1.0f - v) + (h01 * (1.0f - u) + h11 * u) * v;
+}
+
+/* ----------------------------------------------------------------------------
+ * One droplet from (px, py): it follows the slope, erodes where it can carry
+ * more sediment and deposits where it carries too much. It stops when it
+ * leaves the window [x0, x1) x [y0, y1), which holds every sample it touches.
+ * Smaller map values are higher ground, so downhill is up the map gradient
+ * and the elevation is -height.
+ * ---------------------------------------------------------------------------- */
+static void erosion_droplet(float *map, int size, int x0, int y0, int x1, int y1, float px, float py)
+{
+    float dx = 0.0f, dy = 0.0f;
+    float speed = 1.0f, water = 1.0f, sediment = 0.0f;
+    
+    for (int step = 0; step < EROSION_LIFETIME; step++)
+    {
+        int cx = (int)px, cy = (int)py;
+        float u = px - cx, v = py - cy;
+        float gx, gy;
+        float height = erosion_height(map, size, px, py, &gx, &gy);
+        
+        /* Downhill, with some inertia */
+        dx = dx * EROSION_INERTIA + gx * (1.0f - EROSION_INERTIA);
+        dy = dy * EROSION_INERTIA + gy * (1.0f - EROSION_INERTIA);
+        float length = sqrtf(dx * dx + dy * dy);
+        if (length < 1e-6f) break;
+        dx /= length;
+        dy /= length;
+        
+        px += dx;
+        py += dy;
+        if (px < x0 || py < y0 || px >= x1 - 1 || py >= y1 - 1) break;
+        
+        float delta = height - erosion_height(map, size, px, py, NULL, NULL);    // Elevation change
+        float capacity = fmaxf(-delta * speed * water * EROSION_CAPACITY, EROSION_MIN_CAPACITY);
+        float amount;       // > 0 deposit, < 0 erode
+        
+        if (delta > 0.0f)
+        {
+            /* Uphill: fill the pit behind it, at most up to the new height */
+            amount = fminf(delta, sediment);
+        }
+        else if (sediment > capacity)
+        {
+            amount = (sediment - capacity) * EROSION_DEPOSITION;
+        }
+        else
+        {
+            /* Never dig deeper than the step down */
+            amount = -fminf((capacity - sediment) * EROSION_RATE, -delta);
+        }
+        sediment -= amount;
+        
+        /* Applied to the corners of the cell it comes from (raising the ground lowers the value) */
+        MAP_AT(map, size, cx, cy) -= amount * (1.0f - u) * (1.0f - v);
+        MAP_AT(map, size, cx + 1, cy) -= amount * u * (1.0f - v);
+        MAP_AT(map, size, cx, cy + 1) -= amount * (1.0f - u) * v;
+        MAP_AT(map, size, cx + 1, cy + 1) -= amount * u * v;
+        
+        speed = sqrtf(fmaxf(speed * speed - delta * EROSION_GRAVITY, 0.0f));
+        water *= 1.0f - EROSION_EVAPORATION;
+    }
+}
+
+/* ----------------------------------------------------------------------------
+ * Droplets of one tile in one round, from a private random sequence
+ * ---------------------------------------------------------------------------- */
+static void erosion_tile(float *map, int size, int tile_x, int tile_y, int droplets, unsigned int seed)
+{
+    int cells = size - 1;
+    int start_x = tile_x * EROSION_TILE, start_y = tile_y * EROSION_TILE;
+    int end_x = start_x + EROSION_TILE < cells ? start_x + EROSION_TILE : cells;
+    int end_y = start_y + EROSION_TILE < cells ? start_y + EROSION_TILE : cells;
+    int x0 = start_x > EROSION_HALO ? start_x - EROSION_HALO : 0;
+    int y0 = start_y > EROSION_HALO ? start_y - EROSION_HALO : 0;
+    int x1 = end_x + EROSION_HALO < size ? end_x + EROSION_HALO : size;
+    int y1 = end_y + EROSION_HALO < size ? end_y + EROSION_HALO : size;
+    unsigned int state = seed | 1u;
+    
+    for (int d = 0; d < droplets; d++)
+    {
+        /* xorshift32, 24 bits per coordinate */
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        float rx = (float)(state >> 8) * (1.0f / 16777216.0f);
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        float ry = (float)(state >> 8) * (1.0f / 16777216.0f);
+        
+        erosion_droplet(map, size, x0, y0, x1, y1,
+                        start_x + rx * (end_x - start_x), start_y + ry * (end_y - start_y));
+    }
+}
+
+/* ----------------------------------------------------------------------------
+ * Hydraulic erosion: 'droplets' droplets (the iteration budget) spread evenly
+ * over the map, in place.
+ * The map is split in EROSION_TILE tiles and every droplet starts in one of
+ * them; it can't go further than EROSION_HALO from its tile. With the halo
+ * at most half a tile, tiles two apart on both axes never touch the same
+ * samples, so a round runs the 4 tile colours one after the other and the
+ * tiles of a colour in parallel, in place: the boundary samples are merged
+ * by the colour order, which is fixed. Each tile has its own random sequence
+ * (seed, round, tile), so the result does not depend on the thread count.
+ * Returns the number of rounds.
+ * ---------------------------------------------------------------------------- */
+int erode_hydraulic(float *map, int size, int droplets, unsigned int seed)
+{
+    int tiles = (size - 2) / EROSION_TILE + 1;
+    int per_round = tiles * tiles * EROSION_TILE_DROPLETS;
+    int rounds = (droplets + per_round - 1) / per_round;
+    
+    for (int round = 0; round < rounds; round++)
+    {
+        /* The last round shares out what is left of the budget */
+        int budget = round < rounds - 1 ? per_round : droplets - round * per_round;
+        
+        for (int colour = 0; colour < 4; colour++)
+        {
+            #pragma omp parallel for schedule(dynamic)
+            for (int t = 0; t < tiles * tiles; t++)
+            {
+                int tile_x = t / tiles, tile_y = t % tiles;
+                if ((tile_x & 1) + 2 * (tile_y & 1) != colour) continue;
+                
+                int count = budget / (tiles * tiles) + (t < budget % (tiles * tiles));
+                unsigned int tile_seed = seed ^ ((unsigned int)round * 0x9e3779b9u) ^ ((unsigned int)t * 0x85ebca6bu);
+                
+                tile_seed ^= tile_seed >> 16;
+                tile_seed *= 0x7feb352du;
+                tile_seed ^= tile_seed >> 15;
+                
+                erosion_tile(map, size, tile_x, tile_y, count, tile_seed);
+            }
+        }
+    }
+    
+    return rounds;
+}
+
+/* ----------------------------------------------------------------------------
+ * Grid erosion, pass 1: virtual pipes between neighbouring samples.
+ * flux_x has size + 1 rows, row x holding the flow from row x - 1 to row x;
+ * flux_y has size + 1 entries per row, entry y the flow from y - 1 to y.
+ * The first and last rows/entries stay 0 (closed border). Each pipe carries
+ * at most a quarter of the water of the sample it drains. The water surface
+ * is d - b, smaller map values being higher ground.
+ * ---------------------------------------------------------------------------- */
+static void grid_flux_pass(const float *height, const float *water, float *flux_x, float *flux_y, int size)
+{
+    #pragma omp parallel for schedule(static)
+    for (int x = 0; x < size; x++)
+    {
+        const float *b = height + (size_t)x * size, *d = water + (size_t)x * size;
+        float *fy = flux_y + (size_t)x * (size + 1);
+        
+        if (x + 1 < size)
+        {
+            const float *bn = b + size, *dn = d + size;
+            float *fx = flux_x + (size_t)(x + 1) * size;
+            
+            #pragma omp simd
+            for (int y = 0; y < size; y++)
+            {
+                float q = fx[y] + GRID_PIPE_GAIN * ((d[y] - b[y]) - (dn[y] - bn[y]));
+                fx[y] = fminf(fmaxf(q, -0.25f * dn[y]), 0.25f * d[y]);
+            }
+        }
+        
+        #pragma omp simd
+        for (int y = 0; y < size - 1; y++)
+        {
+            float q = fy[y + 1] + GRID_PIPE_GAIN * ((d[y] - b[y]) - (d[y + 1] - b[y + 1]));
+            fy[y + 1] = fminf(fmaxf(q, -0.25f * d[y + 1]), 0.25f * d[y]);
+        }
+    }
+}
+
+/* ----------------------------------------------------------------------------
+ * Grid erosion, pass 2 (one sample): water balance, then the flow dissolves
+ * ground up to its capacity or deposits what it can't carry.
+ * ym, yp are the neighbours along y (clamped on the border).
+ * ---------------------------------------------------------------------------- */
+static inline void grid_water_cell(const float *b_prev, const float *b, const float *b_next, float *b_out,
+                                   float *d, float *s, const float *fx_in, const float *fx_out,
+                                   const float *fy, int y, int ym, int yp)
+{
+    float ux = 0.5f * (fx_in[y] + fx_out[y]);
+    float uy = 0.5f * (fy[y] + fy[y + 1]);
+    float gx = 0.5f * (b_next[y] - b_prev[y]);
+    float gy = 0.5f * (b[yp] - b[ym]);
+    float slope = fmaxf(sqrtf(gx * gx + gy * gy), GRID_MIN_SLOPE);
+    float capacity = GRID_CAPACITY * slope * sqrtf(ux * ux + uy * uy);
+    float rate = s[y] < capacity ? GRID_DISSOLVE : GRID_DEPOSIT;
+    float amount = rate * (capacity - s[y]);        // > 0 dissolve, < 0 deposit
+    
+    b_out[y] = b[y] + amount;
+    s[y] += amount;
+    d[y] = (d[y] + fx_in[y] - fx_out[y] + fy[y] - fy[y + 1] + GRID_RAIN) * (1.0f - GRID_EVAPORATION);
+}
+
+static void grid_water_pass(const float *height, float *height_out, float *water, float *sediment,
+                            const float *flux_x, const float *flux_y, int size)
+{
+    #pragma omp parallel for schedule(static)
+    for (int x = 0; x < size; x++)
+    {
+        const float *b = height + (size_t)x * size;
+        const float *b_prev = x > 0 ? b - size : b;
+        const float *b_next = x + 1 < size ? b + size : b;
+        float *b_out = height_out + (size_t)x * size;
+        float *d = water + (size_t)x * size, *s = sediment + (size_t)x * size;
+        const float *fx_in = flux_x + (size_t)x * size, *fx_out = fx_in + size;
+        const float *fy = flux_y + (size_t)x * (size + 1);
+        
+        grid_water_cell(b_prev, b, b_next, b_out, d, s, fx_in, fx_out, fy, 0, 0, 1);
+        #pragma omp simd
+        for (int y = 1; y < size - 1; y++)
+        {
+            grid_water_cell(b_prev, b, b_next, b_out, d, s, fx_in, fx_out, fy, y, y - 1, y + 1);
+        }
+        grid_water_cell(b_prev, b, b_next, b_out, d, s, fx_in, fx_out, fy, size - 1, size - 2, size - 1);
+    }
+}
+
+/* ----------------------------------------------------------------------------
+ * Grid erosion, pass 3: sediment moved along a pipe with flow q (positive
+ * from 'from' to 'to'), at the concentration of the sample it leaves and
+ * never more than a quarter of its sediment. Both samples of a pipe compute
+ * the same value, so the sediment is conserved exactly.
+ * ---------------------------------------------------------------------------- */
+static inline float grid_carried(float q, float s_from, float d_from, float s_to, float d_to)
+{
+    float s_source = q > 0.0f ? s_from : s_to;
+    float d_source = q > 0.0f ? d_from : d_to;
+    float moved = s_source * fminf(fabsf(q) / fmaxf(d_source, 1e-6f), 0.25f);
+    
+    return q > 0.0f ? moved : -moved;
+}
+
+static inline void grid_transport_cell(const float *s_prev, const float *s, const float *s_next,
+                                       const float *d_prev, const float *d, const float *d_next, float *s_out,
+                                       const float *fx_in, const float *fx_out, const float *fy,
+                                       int y, int ym, int yp)
+{
+    s_out[y] = s[y]
+             + grid_carried(fx_in[y], s_prev[y], d_prev[y], s[y], d[y])
+             - grid_carried(fx_out[y], s[y], d[y], s_next[y], d_next[y])
+             + grid_carried(fy[y], s[ym], d[ym], s[y], d[y])
+             - grid_carried(fy[y + 1], s[y], d[y], s[yp], d[yp]);
+}
+
+static void grid_transport_pass(const float *sediment, float *sediment_out, const float *water,
+                                const float *flux_x, const float *flux_y, int size)
+{
+    #pragma omp parallel for schedule(static)
+    for (int x = 0; x < size; x++)
+    {
+        const float *s = sediment + (size_t)x * size, *d = water + (size_t)x * size;
+        const float *s_prev = x > 0 ? s - size : s, *d_prev = x > 0 ? d - size : d;
+        const float *s_next = x + 1 < size ? s + size : s, *d_next = x + 1 < size ? d + size : d;
+        float *s_out = sediment_out + (size_t)x * size;
+        const float *fx_in = flux_x + (size_t)x * size, *fx_out = fx_in + size;
+        const float *fy = flux_y + (size_t)x * (size + 1);
+        
+        grid_transport_cell(s_prev, s, s_next, d_prev, d, d_next, s_out, fx_in, fx_out, fy, 0, 0, 1);
+        #pragma omp simd
+        for (int y = 1; y < size - 1; y++)
+        {
+            grid_transport_cell(s_prev, s, s_next, d_prev, d, d_next, s_out, fx_in, fx_out, fy, y, y - 1, y + 1);
+        }
+        grid_transport_cell(s_prev, s, s_next, d_prev, d, d_next, s_out, fx_in, fx_out, fy,
+                            size - 1, size - 2, size - 1);
+    }
+}
+
+/* ----------------------------------------------------------------------------
+ * Grid erosion, pass 4: thermal weathering. Wherever the slope to a
+ * neighbour exceeds GRID_TALUS, part of the excess slides down to it
+ * (from the smaller map value, the higher ground, to the larger).
+ * ---------------------------------------------------------------------------- */
+static inline float grid_talus(float from, float to)
+{
+    return fmaxf(to - from - GRID_TALUS, 0.0f);
+}
+
+static inline void grid_thermal_cell(const float *h_prev, const float *h, const float *h_next, float *h_out,
+                                     int y, int ym, int yp)
+{
+    float c = h[y];
+    float gain = grid_talus(h_prev[y], c) + grid_talus(h_next[y], c) + grid_talus(h[ym], c) + grid_talus(h[yp], c);
+    float loss = grid_talus(c, h_prev[y]) + grid_talus(c, h_next[y]) + grid_talus(c, h[ym]) + grid_talus(c, h[yp]);
+    
+    h_out[y] = c - GRID_THERMAL_RATE * (gain - loss);
+}
+
+static void grid_thermal_pass(const float *height, float *height_out, int size)
+{
+    #pragma omp parallel for schedule(static)
+    for (int x = 0; x < size; x++)
+    {
+        const float *h = height + (size_t)x * size;
+        const float *h_prev = x > 0 ? h - size : h;
+        const float *h_next = x + 1 < size ? h + size : h;
+        float *h_out = height_out + (size_t)x * size;
+        
+        grid_thermal_cell(h_prev, h, h_next, h_out, 0, 0, 1);
+        #pragma omp simd
+        for (int y = 1; y < size - 1; y++)
+        {
+            grid_thermal_cell(h_prev, h, h_next, h_out, y, y - 1, y + 1);
+        }
+        grid_thermal_cell(h_prev, h, h_next, h_out, size - 1, size - 2, size - 1);
+    }
+}
+
+/* ----------------------------------------------------------------------------
+ * Grid erosion: 'iterations' steps of a pipe-model hydraulic erosion (rain,
+ * flow, dissolution/deposition, sediment transport) followed by thermal
+ * weathering, in place.
+ * Every pass reads the previous state and writes a separate buffer (the
+ * buffers rotate, the map included), so each sample is a pure function of
+ * its neighbourhood: the rows are split over the threads and the samples of
+ * a row are vectorised, and the result does not depend on the thread count.
+ * Sediment still in the water at the end settles where it is.
+ * Returns 0 if out of memory.
+ * ---------------------------------------------------------------------------- */
+int erode_grid(float *map, int size, int iterations)
+{
+    size_t count = (size_t)size * size;
+    float *water = calloc(count, sizeof(float));
+    float *sediment_buffer = calloc(count, sizeof(float));
+    float *spare_buffer = malloc(count * sizeof(float));
+    float *flux_x = calloc(count + size, sizeof(float));
+    float *flux_y = calloc(count + size, sizeof(float));
+    int ok = water != NULL && sediment_buffer != NULL && spare_buffer != NULL && flux_x != NULL && flux_y != NULL;
+    
+    if (ok)
+    {
+        float *height = map, *sediment = sediment_buffer, *spare = spare_buffer, *swap;
+        
+        for (int i = 0; i < iterations; i++)
+        {
+            grid_flux_pass(height, water, flux_x, flux_y, size);
+            
+            grid_water_pass(height, spare, water, sediment, flux_x, flux_y, size);
+            swap = height; height = spare; spare = swap;
+            
+            grid_transport_pass(sediment, spare, water, flux_x, flux_y, size);
+            swap = sediment; sediment = spare; spare = swap;
+            
+            grid_thermal_pass(height, spare, size);
+            swap = height; height = spare; spare = swap;
+        }
+        
+        /* The map may be any of the three buffers by now */
+        #pragma omp parallel for schedule(static)
+        for (size_t i = 0; i < count; i++)
+        {
+            map[i] = height[i] - sediment[i];
+        }
+    }
+    
+    free(water);
+    free(sediment_buffer);
+    free(spare_buffer);
+    free(flux_x);
+    free(flux_y);
+    return ok;
+}
+
+/* ----------------------------------------------------------------------------
+ * Erosion stage: the droplets (--erode) and then the grid erosion
+ * (--erode-grid), each only if enabled
+ * ---------------------------------------------------------------------------- */
+void erode_terrain(float *map, int size, unsigned int seed)
+{
+    if (erosion_droplets > 0) erode_hydraulic(map, size, erosion_droplets, seed);
+    if (erosion_iterations > 0 && !erode_grid(map, size, erosion_iterations))
+    {
+        fprintf(stderr, "Out of memory for the grid erosion of %dx%d\n", size, size);
+    }
+}
+
+/* ----------------------------------------------------------------------------
+ * Filters. rows[k] is input row x - radius + k (clamped to the map), out
+ * the output row x; point-wise filters (radius 0) may run with
+ * out == rows[0]. Every loop is over one row, so it vectorises.
+ * ---------------------------------------------------------------------------- */
+
+/* Smoothing: 3x3 binomial blur, blended by params[0] (0..1) */
+static void filter_smooth(const float *const *rows, float *out, int size, const float *params)
+{
+    const float *a = rows[0], *b = rows[1], *c = rows[2];
+    float strength = params[0];
+    
+    /* Vertical 1 2 1 first, then horizontal, with the border replicated */
+    float left = a[0] + 2.0f * b[0] + c[0];
+    float centre = left;
+    
+    for (int y = 0; y < size; y++)
+    {
+        float right = y + 1 < size ? a[y + 1] + 2.0f * b[y + 1] + c[y + 1] : centre;
+        float blur = (left + 2.0f * centre + right) * (1.0f / 16.0f);
+        
+        left = centre;
+        centre = right;
+        out[y] = b[y] + strength * (blur - b[y]);
+    }
+}
+
+/* Terracing: steps of params[0], each flattened by the exponent params[1] */
+static void filter_terrace(const float *const *rows, float *out, int size, const float *params)
+{
+    const float *in = rows[0];
+    float step = params[0], inverse = 1.0f / params[0], sharpness = params[1];
+    
+    #pragma omp simd
+    for (int y = 0; y < size; y++)
+    {
+        float level = floorf(in[y] * inverse);
+        float fraction = in[y] * inverse - level;
+        out[y] = step * (level + powf(fraction, sharpness));
+    }
+}
+
+/* Redistribution: power curve params[0] of the elevation, 0 at INITIAL_HEIGHT
+   (the lowest ground) to 1 at -INITIAL_HEIGHT (> 1 widens the valleys and
+   sharpens the peaks), odd beyond the range */
+static void filter_redistribute(const float *const *rows, float *out, int size, const float *params)
+{
+    const float *in = rows[0];
+    float exponent = params[0] - 1.0f;
+    
+    #pragma omp simd
+    for (int y = 0; y < size; y++)
+    {
+        float t = (INITIAL_HEIGHT - in[y]) * (0.5f / INITIAL_HEIGHT);
+        out[y] = INITIAL_HEIGHT - 2.0f * INITIAL_HEIGHT * t * powf(fabsf(t), exponent);
+    }
+}
+
+/* Sea level: nothing deeper than the map value params[0] (larger values are
+   lower ground, so the sea floor is clamped from above) */
+static void filter_sea_level(const float *const *rows, float *out, int size, const float *params)
+{
+    const float *in = rows[0];
+    float level = params[0];
+    
+    #pragma omp simd
+    for (int y = 0; y < size; y++)
+    {
+        out[y] = fminf(in[y], level);
+    }
+}
+
+/* ----------------------------------------------------------------------------
+ * Add a stage to a filter chain, by name with up to 2 parameters
+ * (FILTER_KINDS defaults where not given). Returns 0 if unknown or full.
+ * ---------------------------------------------------------------------------- */
+int filter_chain_add(FilterChain *chain, const char *name, int param_count, const float *params)
+{
+    if (chain->count >= FILTER_MAX) return 0;
+    
+    for (int k = 0; k < FILTER_KIND_COUNT; k++)
+    {
+        if (strcmp(FILTER_KINDS[k].name, name) == 0)
+        {
+            Filter *filter = &chain->stages[chain->count++];
+            
+            *filter = FILTER_KINDS[k];
+            for (int p = 0; p < param_count && p < 2; p++) filter->params[p] = params[p];
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* ----------------------------------------------------------------------------
+ * Check the parameters of a filter stage: terrace step and sharpness and
+ * redistribution exponent above 0 (the filters divide by or raise 0 to them)
+ * ---------------------------------------------------------------------------- */
+int is_valid_filter(const Filter *filter)
+{
+    if (filter->apply == filter_terrace) return filter->params[0] > 0.0f && filter->params[1] > 0.0f;
+    if (filter->apply == filter_redistribute) return filter->params[0] > 0.0f;
+    return 1;
+}
+
+/* ----------------------------------------------------------------------------
+ * Filter chain on one band of rows [x0, x1). 'a' and 'b' hold rows lo..hi-1
+ * (the band plus the halo the stencils need); runs of point-wise stages are
+ * applied row by row while the row is in cache, stencil stages go from one
+ * buffer to the other and narrow the valid rows by their radius (not on
+ * the map border, where the rows are replicated). Returns the buffer that
+ * holds the result.
+ * ---------------------------------------------------------------------------- */
+static float *filter_band(const FilterChain *chain, float *a, float *b, int size, int lo, int hi)
+{
+    const float *rows[2 * FILTER_MAX_RADIUS + 1];
+    int valid_lo = lo, valid_hi = hi;
+    int s = 0;
+    
+    while (s < chain->count)
+    {
+        if (chain->stages[s].radius == 0)
+        {
+            /* Fused: all consecutive point-wise stages on one row at a time */
+            int end = s;
+            while (end < chain->count && chain->stages[end].radius == 0) end++;
+            
+            for (int x = valid_lo; x < valid_hi; x++)
+            {
+                float *row = a + (size_t)(x - lo) * size;
+                rows[0] = row;
+                for (int p = s; p < end; p++) chain->stages[p].apply(rows, row, size, chain->stages[p].params);
+            }
+            s = end;
+        }
+        else
+        {
+            const Filter *filter = &chain->stages[s];
+            int r = filter->radius;
+            int next_lo = valid_lo == 0 ? 0 : valid_lo + r;
+            int next_hi = valid_hi == size ? size : valid_hi - r;
+            
+            for (int x = next_lo; x < next_hi; x++)
+            {
+                for (int k = 0; k <= 2 * r; k++)
+                {
+                    int source = x - r + k;
+                    source = source < 0 ? 0 : (source >= size ? size - 1 : source);
+                    rows[k] = a + (size_t)(source - lo) * size;
+                }
+                filter->apply(rows, b + (size_t)(x - lo) * size, size, filter->params);
+            }
+            
+            float *swap = a; a = b; b = swap;
+            valid_lo = next_lo;
+            valid_hi = next_hi;
+            s++;
+        }
+    }
+    
+    return a;
+}
+
+/* ----------------------------------------------------------------------------
+ * Run a filter chain over the map in place, in bands of FILTER_BAND rows
+ * spread over the threads. Each band is read once, goes through the whole
+ * chain in a private buffer (recomputing the halo rows its stencils need,
+ * saved beforehand since the neighbours overwrite them) and is written back
+ * once: one sweep over memory for the whole chain. The result does not
+ * depend on the thread count. Returns 0 if out of memory.
+ * ---------------------------------------------------------------------------- */
+int filter_chain_run(const FilterChain *chain, float *map, int size)
+{
+    int halo = 0;
+    for (int s = 0; s < chain->count; s++) halo += chain->stages[s].radius;
+    
+    int bands = (size + FILTER_BAND - 1) / FILTER_BAND;
+    size_t row_bytes = (size_t)size * sizeof(float);
+    float *saved = NULL;
+    int failures = 0;
+    
+    if (chain->count == 0) return 1;
+    
+    /* Original rows around every band boundary: [x0 - halo, x0 + halo) */
+    if (halo > 0)
+    {
+        saved = malloc((size_t)bands * 2 * halo * row_bytes);
+        if (saved == NULL) return 0;
+        
+        #pragma omp parallel for schedule(static)
+        for (int band = 1; band < bands; band++)
+        {
+            for (int k = 0; k < 2 * halo; k++)
+            {
+                int x = band * FILTER_BAND - halo + k;
+                if (x >= 0 && x < size)
+                {
+                    memcpy(saved + ((size_t)band * 2 * halo + k) * size, &MAP_AT(map, size, x, 0), row_bytes);
+                }
+            }
+        }
+    }
+    
+    #pragma omp parallel reduction(+:failures)
+    {
+        size_t rows = (size_t)FILTER_BAND + 2 * halo;
+        float *a = malloc(rows * row_bytes);
+        float *b = malloc(rows * row_bytes);
+        
+        if (a == NULL || b == NULL) failures++;
+        
+        #pragma omp for schedule(static)
+        for (int band = 0; band < bands; band++)
+        {
+            if (a == NULL || b == NULL) continue;
+            
+            int x0 = band * FILTER_BAND;
+            int x1 = x0 + FILTER_BAND < size ? x0 + FILTER_BAND : size;
+            int lo = x0 - halo > 0 ? x0 - halo : 0;
+            int hi = x1 + halo < size ? x1 + halo : size;
+            
+            for (int x = lo; x < hi; x++)
+            {
+                /* Rows of the neighbouring bands come from the saved copy */
+                const float *source = &MAP_AT(map, size, x, 0);
+                if (x < x0) source = saved + ((size_t)band * 2 * halo + (x - (x0 - halo))) * size;
+                if (x >= x1) source = saved + ((size_t)(band + 1) * 2 * halo + (x - (x1 - halo))) * size;
+                memcpy(a + (size_t)(x - lo) * size, source, row_bytes);
+            }
+            
+            float *result = filter_band(chain, a, b, size, lo, hi);
+            memcpy(&MAP_AT(map, size, x0, 0), result + (size_t)(x0 - lo) * size, (size_t)(x1 - x0) * row_bytes);
+        }
+        
+        free(a);
+        free(b);
+    }
+    
+    free(saved);
+    return failures == 0;
+}
+
+/* ----------------------------------------------------------------------------
+ * Filter stage: the --filter chain, if any
+ * ---------------------------------------------------------------------------- */
+void filter_terrain(float *map, int size)
+{
+    if (filter_chain.count > 0 && !filter_chain_run(&filter_chain, map, size))
+    {
+        fprintf(stderr, "Out of memory for the filters of %dx%d\n", size, size);
+    }
+}
+
+/* ----------------------------------------------------------------------------
+ * Blur along the lines of a strip: in holds n + 2 * radius lines of 'width'
+ * samples (line i is sample i - radius, the border replicated), out gets
+ * the n blurred lines (out_stride apart). Each line is one vector of
+ * independent columns; the box blur keeps a running sum per column, so its
+ * cost does not depend on the radius.
+ * ---------------------------------------------------------------------------- */
+static void blur_lines(const float *restrict in, float *restrict out, int out_stride, int n, int width,
+                       const BlurKernel *kernel)
+{
+    int r = kernel->radius;
+    
+    if (kernel->box)
+    {
+        double sums[BLUR_STRIP];
+        double scale = 1.0 / (2 * r + 1);
+        
+        for (int c = 0; c < width; c++) sums[c] = 0.0;
+        for (int k = 0; k <= 2 * r; k++)
+        {
+            #pragma omp simd
+            for (int c = 0; c < width; c++) sums[c] += in[(size_t)k * width + c];
+        }
+        
+        for (int i = 0; i < n; i++)
+        {
+            const float *leaving = in + (size_t)i * width;
+            const float *entering = in + (size_t)(i + 2 * r + 1) * width;
+            float *line = out + (size_t)i * out_stride;
+            
+            #pragma omp simd
+            for (int c = 0; c < width; c++) line[c] = (float)(sums[c] * scale);
+            if (i + 1 == n) break;
+            
+            #pragma omp simd
+            for (int c = 0; c < width; c++) sums[c] += (double)entering[c] - leaving[c];
+        }
+        return;
+    }
+    
+    for (int i = 0; i < n; i++)
+    {
+        float *line = out + (size_t)i * out_stride;
+        float acc[BLUR_STRIP];
+        
+        #pragma omp simd
+        for (int c = 0; c < width; c++) acc[c] = 0.0f;
+        for (int k = 0; k <= 2 * r; k++)
+        {
+            const float *source = in + (size_t)(i + k) * width;
+            float weight = kernel->weights[k];
+            
+            #pragma omp simd
+            for (int c = 0; c < width; c++) acc[c] += weight * source[c];
+        }
+        
+        #pragma omp simd
+        for (int c = 0; c < width; c++) line[c] = acc[c];
+    }
+}
+
+/* ----------------------------------------------------------------------------
+ * Transpose a rows x columns block (out[j][i] = in[i][j]) in tiles of
+ * BLUR_TILE x BLUR_TILE, so that both sides are walked in whole cache lines
+ * ---------------------------------------------------------------------------- */
+static void blur_transpose(const float *restrict in, int in_stride, float *restrict out, int out_stride,
+                           int rows, int columns)
+{
+    for (int i0 = 0; i0 < rows; i0 += BLUR_TILE)
+    {
+        int i1 = i0 + BLUR_TILE < rows ? i0 + BLUR_TILE : rows;
+        
+        for (int j0 = 0; j0 < columns; j0 += BLUR_TILE)
+        {
+            int j1 = j0 + BLUR_TILE < columns ? j0 + BLUR_TILE : columns;
+            
+            for (int j = j0; j < j1; j++)
+            {
+                for (int i = i0; i < i1; i++)
+                {
+                    out[(size_t)j * out_stride + i] = in[(size_t)i * in_stride + j];
+                }
+            }
+        }
+    }
+}
+
+/* ----------------------------------------------------------------------------
+ * Replicate the first and last of the n lines of a padded strip into the
+ * 'radius' lines around them
+ * ---------------------------------------------------------------------------- */
+static void blur_pad(float *strip, int n, int width, int radius)
+{
+    size_t line = (size_t)width * sizeof(float);
+    
+    for (int k = 0; k < radius; k++)
+    {
+        memcpy(strip + (size_t)k * width, strip + (size_t)radius * width, line);
+        memcpy(strip + (size_t)(radius + n + k) * width, strip + (size_t)(radius + n - 1) * width, line);
+    }
+}
+
+/* ----------------------------------------------------------------------------
+ * One axis of a separable blur, in place, 'passes' times. The map is split
+ * into strips of BLUR_STRIP columns (axis 0, blurred along x) or rows
+ * (axis 1, blurred along y, transposed on the way in and out), spread
+ * over the threads. A strip is copied once into a padded buffer that stays
+ * in cache for all the passes and is then written back, so the map is
+ * swept once per axis. Returns 0 if out of memory.
+ * ---------------------------------------------------------------------------- */
+static int blur_axis(float *map, int size, const BlurKernel *kernel, int passes, int axis)
+{
+    int r = kernel->radius;
+    int strips = (size + BLUR_STRIP - 1) / BLUR_STRIP;
+    size_t lines = (size_t)size + 2 * r;
+    int failures = 0;
+    
+    #pragma omp parallel reduction(+:failures)
+    {
+        float *a = malloc(lines * BLUR_STRIP * sizeof(float));
+        float *b = malloc(lines * BLUR_STRIP * sizeof(float));
+        
+        if (a == NULL || b == NULL) failures++;
+        
+        #pragma omp for schedule(static)
+        for (int strip = 0; strip < strips; strip++)
+        {
+            if (a == NULL || b == NULL) continue;
+            
+            int first = strip * BLUR_STRIP;
+            int width = first + BLUR_STRIP < size ? BLUR_STRIP : size - first;
+            
+            /* Line i of the buffer: sample i along the axis, 'width' across it */
+            if (axis == 0)
+            {
+                for (int i = 0; i < size; i++)
+                {
+                    memcpy(a + (size_t)(i + r) * width, &MAP_AT(map, size, i, first), (size_t)width * sizeof(float));
+                }
+            }
+            else
+            {
+                blur_transpose(&MAP_AT(map, size, first, 0), size, a + (size_t)r * width, width, width, size);
+            }
+            
+            for (int pass = 0; pass < passes; pass++)
+            {
+                blur_pad(a, size, width, r);
+                blur_lines(a, b + (size_t)r * width, width, size, width, kernel);
+                float *swap = a; a = b; b = swap;
+            }
+            
+            if (axis == 0)
+            {
+                for (int i = 0; i < size; i++)
+                {
+                    memcpy(&MAP_AT(map, size, i, first), a + (size_t)(i + r) * width, (size_t)width * sizeof(float));
+                }
+            }
+            else
+            {
+                blur_transpose(a + (size_t)r * width, width, &MAP_AT(map, size, first, 0), size, size, width);
+            }
+        }
+        
+        free(a);
+        free(b);
+    }
+    
+    return failures == 0;
+}
+
+/* ----------------------------------------------------------------------------
+ * Gaussian blur of the map in place (radius 3 sigma, at most
+ * BLUR_MAX_RADIUS). Returns 0 if out of memory.
+ * ---------------------------------------------------------------------------- */
+int blur_gaussian(float *map, int size, float sigma)
+{
+    BlurKernel kernel = {0};
+    float total = 0.0f;
+    
+    if (sigma <= 0.0f) return 1;
+    
+    kernel.radius = (int)ceilf(3.0f * sigma);
+    if (kernel.radius > BLUR_MAX_RADIUS) kernel.radius = BLUR_MAX_RADIUS;
+    
+    for (int k = 0; k <= 2 * kernel.radius; k++)
+    {
+        float d = (float)(k - kernel.radius);
+        kernel.weights[k] = expf(-d * d / (2.0f * sigma * sigma));
+        total += kernel.weights[k];
+    }
+    for (int k = 0; k <= 2 * kernel.radius; k++) kernel.weights[k] /= total;
+    
+    return blur_axis(map, size, &kernel, 1, 0) && blur_axis(map, size, &kernel, 1, 1);
+}
+
+/* ----------------------------------------------------------------------------
+ * Box blur of the map in place, 'passes' times (3 passes are close to a
+ * Gaussian of sigma ~ radius), O(1) per sample and pass whatever the radius.
+ * Returns 0 if out of memory.
+ * ---------------------------------------------------------------------------- */
+int blur_box(float *map, int size, int radius, int passes)
+{
+    BlurKernel kernel = {0};
+    
+    if (radius <= 0 || passes <= 0) return 1;
+    
+    kernel.radius = radius < BLUR_MAX_RADIUS ? radius : BLUR_MAX_RADIUS;
+    kernel.box = 1;
+    
+    return blur_axis(map, size, &kernel, passes, 0) && blur_axis(map, size, &kernel, passes, 1);
+}
+
+/* ----------------------------------------------------------------------------
+ * Check blur settings: Gaussian sigma from BLUR_MIN_SIGMA to a third of
+ * BLUR_MAX_RADIUS (the kernel spans 3 sigma), box radius from 1 to
+ * BLUR_MAX_RADIUS and at least 1 pass
+ * ---------------------------------------------------------------------------- */
+int is_valid_blur(const BlurSettings *blur)
+{
+    if (blur->type == BLUR_GAUSSIAN) return blur->sigma >= BLUR_MIN_SIGMA && blur->sigma <= BLUR_MAX_RADIUS / 3.0f;
+    if (blur->type == BLUR_BOX) return blur->radius >= 1 && blur->radius <= BLUR_MAX_RADIUS && blur->passes >= 1;
+    return 1;
+}
+
+/* ----------------------------------------------------------------------------
+ * Blur stage (--blur), right after generation, if enabled
+ * ---------------------------------------------------------------------------- */
+void blur_terrain(float *map, int size)
+{
+    int ok = 1;
+    
+    if (blur_settings.type == BLUR_GAUSSIAN) ok = blur_gaussian(map, size, blur_settings.sigma);
+    else if (blur_settings.type == BLUR_BOX) ok = blur_box(map, size, blur_settings.radius, blur_settings.passes);
+    
+    if (!ok) fprintf(stderr, "Out of memory for the blur of %dx%d\n", size, size);
+}
+
+/* ----------------------------------------------------------------------------
+ * Calculate minimum and maximum heights
+ * ---------------------------------------------------------------------------- */
+void calculate_min_max_height(void)
+{
+    /* The root of the pyramid already holds them */
+    if (terrain_pyramid.levels > 0 && terrain_pyramid.map == &terrain[0][0])
+    {
+        int top = terrain_pyramid.levels - 1;
+        min_height = terrain_pyramid.min[top][0];
+        max_height = terrain_pyramid.max[top][0];
+        return;
+    }
+    
+    find_min_max(&terrain[0][0], (size_t)ITERATIONS * ITERATIONS, &min_height, &max_height);
+}
+
+/* ----------------------------------------------------------------------------
+ * Minimum and maximum of a heightmap
+ * ---------------------------------------------------------------------------- */
+void find_min_max(const float *map, size_t count, float *min_value, float *max_value)
+{
+    float low = map[0];
+    float high = map[0];
+    
+    for (size_t i = 0; i < count; i++)
+    {
+        if (map[i] < low) low = map[i];
+        if (map[i] > high) high = map[i];
+    }
+    
+    *min_value = low;
+    *max_value = high;
+}
+
+/* ----------------------------------------------------------------------------
+ * Build (or rebuild) the min/max pyramid of a map, to call after every
+ * generation. Level 0 is one pass over the samples, the upper levels add
+ * a third of that. Memory is about 2.7 times the map. Returns 0 if out of
+ * memory (the pyramid is then left empty).
+ * ---------------------------------------------------------------------------- */
+int height_pyramid_build(HeightPyramid *pyramid, const float *map, int size)
+{
+    if (pyramid->levels == 0 || pyramid->size != size)
+    {
+        height_pyramid_free(pyramid);
+        
+        int levels = 0;
+        for (int cells = size - 1; cells >= 1; cells /= 2)
+        {
+            size_t count = (size_t)cells * cells;
+            pyramid->min[levels] = malloc(count * sizeof(float));
+            pyramid->max[levels] = malloc(count * sizeof(float));
+            levels++;
+            
+            if (pyramid->min[levels - 1] == NULL || pyramid->max[levels - 1] == NULL)
+            {
+                pyramid->levels = levels;
+                height_pyramid_free(pyramid);
+                return 0;
+            }
+        }
+        
+        pyramid->levels = levels;
+        pyramid->size = size;
+    }
+    
+    pyramid->map = map;
+    
+    /* Level 0: the 4 samples at the corners of each cell */
+    int cells = size - 1;
+    
+    #pragma omp parallel for schedule(static) if (size > 512)
+    for (int cx = 0; cx < cells; cx++)
+    {
+        const float *row = &MAP_AT(map, size, cx, 0);
+        const float *next = &MAP_AT(map, size, cx + 1, 0);
+        float *low = &pyramid->min[0][(size_t)cx * cells];
+        float *high = &pyramid->max[0][(size_t)cx * cells];
+        
+        for (int cy = 0; cy < cells; cy++)
+        {
+            low[cy] = fminf(fminf(row[cy], row[cy + 1]), fminf(next[cy], next[cy + 1]));
+            high[cy] = fmaxf(fmaxf(row[cy], row[cy + 1]), fmaxf(next[cy], next[cy + 1]));
+        }
+    }
+    
+    /* Upper levels: 2x2 children */
+    for (int level = 1; level < pyramid->levels; level++)
+    {
+        int children = cells;
+        cells /= 2;
+        const float *child_low = pyramid->min[level - 1];
+        const float *child_high = pyramid->max[level - 1];
+        float *low = pyramid->min[level];
+        float *high = pyramid->max[level];
+        
+        for (int cx = 0; cx < cells; cx++)
+        {
+            const float *a_low = &child_low[(size_t)(2 * cx) * children];
+            const float *b_low = a_low + children;
+            const float *a_high = &child_high[(size_t)(2 * cx) * children];
+            const float *b_high = a_high + children;
+            
+            for (int cy = 0; cy < cells; cy++)
+            {
+                low[(size_t)cx * cells + cy] = fminf(fminf(a_low[2 * cy], a_low[2 * cy + 1]),
+                                                     fminf(b_low[2 * cy], b_low[2 * cy + 1]));
+                high[(size_t)cx * cells + cy] = fmaxf(fmaxf(a_high[2 * cy], a_high[2 * cy + 1]),
+                                                      fmaxf(b_high[2 * cy], b_high[2 * cy + 1]));
+            }
+        }
+    }
+    
+    return 1;
+}
+
+/* ----------------------------------------------------------------------------
+ * Release the pyramid memory
+ * ---------------------------------------------------------------------------- */
+void height_pyramid_free(HeightPyramid *pyramid)
+{
+    for (int level = 0; level < pyramid->levels; level++)
+    {
+        free(pyramid->min[level]);
+        free(pyramid->max[level]);
+    }
+    
+    pyramid->levels = 0;
+    pyramid->map = NULL;
+}
+
+/* ----------------------------------------------------------------------------
+ * Build (or rebuild) the mip pyramid of a map. Each level filters the one
+ * below with 1-2-1 weights on both axes (clamped at the edges) and keeps
+ * every other sample, so decimated grids don't alias the ridges. Returns
+ * 0 if out of memory (the pyramid is then left empty).
+ * ---------------------------------------------------------------------------- */
+int height_mips_build(HeightMips *mips, const float *map, int size)
+{
+    if (mips->levels == 0 || mips->size != size)
+    {
+        height_mips_free(mips);
+        
+        int levels = 1;
+        for (int cells = (size - 1) / 2; cells >= 1; cells /= 2)
+        {
+            size_t side = (size_t)cells + 1;
+            mips->level[levels] = malloc(side * side * sizeof(float));
+            levels++;
+            
+            if (mips->level[levels - 1] == NULL)
+            {
+                mips->levels = levels;
+                height_mips_free(mips);
+                return 0;
+            }
+        }
+        
+        mips->levels = levels;
+        mips->size = size;
+    }
+    
+    mips->map = map;
+    
+    for (int level = 1; level < mips->levels; level++)
+    {
+        const float *fine = height_mips_level(mips, level - 1);
+        int fine_side = ((size - 1) >> (level - 1)) + 1;
+        int side = ((size - 1) >> level) + 1;
+        float *coarse = mips->level[level];
+        
+        #pragma omp parallel for schedule(static) if (side > 512)
+        for (int x = 0; x < side; x++)
+        {
+            const float *row[3];
+            for (int k = 0; k < 3; k++)
+            {
+                int fx = 2 * x + k - 1;
+                fx = fx < 0 ? 0 : (fx >= fine_side ? fine_side - 1 : fx);
+                row[k] = &MAP_AT(fine, fine_side, fx, 0);
+            }
+            
+            for (int y = 0; y < side; y++)
+            {
+                int y0 = 2 * y > 0 ? 2 * y - 1 : 0;
+                int y1 = 2 * y;
+                int y2 = 2 * y + 1 < fine_side ? 2 * y + 1 : fine_side - 1;
+                float column[3];
+                
+                for (int k = 0; k < 3; k++)
+                {
+                    column[k] = row[k][y0] + 2.0f * row[k][y1] + row[k][y2];
+                }
+                
+                MAP_AT(coarse, side, x, y) = (column[0] + 2.0f * column[1] + column[2]) * (1.0f / 16.0f);
+            }
+        }
+    }
+    
+    return 1;
+}
+
+/* ----------------------------------------------------------------------------
+ * Release the mip pyramid memory (level 0 belongs to the map)
+ * ---------------------------------------------------------------------------- */
+void height_mips_free(HeightMips *mips)
+{
+    for (int level = 1; level < mips->levels; level++)
+    {
+        free(mips->level[level]);
+    }
+    
+    mips->levels = 0;
+    mips->map = NULL;
+}
+
+/* ----------------------------------------------------------------------------
+ * Samples of a mip level, (size - 1) / 2^level + 1 per side
+ * ---------------------------------------------------------------------------- */
+const float *height_mips_level(const HeightMips *mips, int level)
+{
+    return level == 0 ? mips->map : mips->level[level];
+}
+
+/* ----------------------------------------------------------------------------
+ * Conservative min/max of the samples [x0, x1] x [y0, y1] (inclusive, in
+ * range): the bounds of the at most 2x2 cells of the first level whose
+ * cells are as large as the region. Constant time, for culling.
+ * ---------------------------------------------------------------------------- */
+void height_pyramid_bounds(const HeightPyramid *pyramid, int x0, int y0, int x1, int y1,
+                           float *min_value, float *max_value)
+{
+    int extent = (x1 - x0 > y1 - y0 ? x1 - x0 : y1 - y0);
+    int level = 0;
+    
+    while (level < pyramid->levels - 1 && (1 << level) < extent) level++;
+    
+    int cells = (pyramid->size - 1) >> level;
+    int cx0 = x0 >> level, cx1 = (x1 > x0 ? x1 - 1 : x1) >> level;
+    int cy0 = y0 >> level, cy1 = (y1 > y0 ? y1 - 1 : y1) >> level;
+    if (cx0 >= cells) cx0 = cells - 1;
+    if (cx1 >= cells) cx1 = cells - 1;
+    if (cy0 >= cells) cy0 = cells - 1;
+    if (cy1 >= cells) cy1 = cells - 1;
+    
+    float low = 1e30f, high = -1e30f;
+    
+    for (int cx = cx0; cx <= cx1; cx++)
+    {
+        for (int cy = cy0; cy <= cy1; cy++)
+        {
+            low = fminf(low, pyramid->min[level][(size_t)cx * cells + cy]);
+            high = fmaxf(high, pyramid->max[level][(size_t)cx * cells + cy]);
+        }
+    }
+    
+    *min_value = low;
+    *max_value = high;
+}
+
+/* Cell (or single sample, level -1) waiting in the exact query heap */
+typedef struct PyramidEntry
+{
+    float key;
+    int level, cx, cy;
+} PyramidEntry;
+
+/* ----------------------------------------------------------------------------
+ * Push an entry on the max-heap of the exact query. Returns 0 if out of memory.
+ * ---------------------------------------------------------------------------- */
+static int pyramid_heap_push(PyramidEntry **heap, int *count, int *capacity, PyramidEntry entry)
+{
+    if (*count == *capacity)
+    {
+        int grown = *capacity * 2;
+        PyramidEntry *bigger = realloc(*heap, (size_t)grown * sizeof(PyramidEntry));
+        if (bigger == NULL) return 0;
+        *heap = bigger;
+        *capacity = grown;
+    }
+    
+    int i = (*count)++;
+    while (i > 0 && (*heap)[(i - 1) / 2].key < entry.key)
+    {
+        (*heap)[i] = (*heap)[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    (*heap)[i] = entry;
+    return 1;
+}
+
+/* ----------------------------------------------------------------------------
+ * Pop the entry with the largest key
+ * ---------------------------------------------------------------------------- */
+static PyramidEntry pyramid_heap_pop(PyramidEntry *heap, int *count)
+{
+    PyramidEntry top = heap[0];
+    PyramidEntry last = heap[--(*count)];
+    int i = 0;
+    
+    for (;;)
+    {
+        int child = 2 * i + 1;
+        if (child >= *count) break;
+        if (child + 1 < *count && heap[child + 1].key > heap[child].key) child++;
+        if (heap[child].key <= last.key) break;
+        heap[i] = heap[child];
+        i = child;
+    }
+    if (*count > 0) heap[i] = last;
+    
+    return top;
+}
+
+/* ----------------------------------------------------------------------------
+ * Best-first search of the largest value of sign * height in the region.
+ * Cells come out of the heap by decreasing bound: the first one that lies
+ * inside the region (or the first single sample) is the exact answer.
+ * ---------------------------------------------------------------------------- */
+static float height_pyramid_extreme(const HeightPyramid *pyramid, int x0, int y0, int x1, int y1, float sign)
+{
+    int capacity = 64, count = 0;
+    PyramidEntry *heap = malloc((size_t)capacity * sizeof(PyramidEntry));
+    int top = pyramid->levels - 1;
+    float result = sign * MAP_AT(pyramid->map, pyramid->size, x0, y0);
+    
+    if (heap == NULL) return sign * result;
+    
+    PyramidEntry root = {sign > 0 ? pyramid->max[top][0] : -pyramid->min[top][0], top, 0, 0};
+    pyramid_heap_push(&heap, &count, &capacity, root);
+    
+    while (count > 0)
+    {
+        PyramidEntry entry = pyramid_heap_pop(heap, &count);
+        
+        if (entry.level < 0)
+        {
+            result = entry.key;
+            break;
+        }
+        
+        int sx0 = entry.cx << entry.level, sx1 = (entry.cx + 1) << entry.level;
+        int sy0 = entry.cy << entry.level, sy1 = (entry.cy + 1) << entry.level;
+        
+        /* Cell inside the region: its bound is reached by one of its samples */
+        if (sx0 >= x0 && sx1 <= x1 && sy0 >= y0 && sy1 <= y1)
+        {
+            result = entry.key;
+            break;
+        }
+        
+        if (entry.level == 0)
+        {
+            /* Partially covered finest cell: queue its samples in the region */
+            for (int x = sx0; x <= sx1; x++)
+            {
+                for (int y = sy0; y <= sy1; y++)
+                {
+                    if (x < x0 || x > x1 || y < y0 || y > y1) continue;
+                    PyramidEntry sample = {sign * MAP_AT(pyramid->map, pyramid->size, x, y), -1, x, y};
+                    if (!pyramid_heap_push(&heap, &count, &capacity, sample)) count = 0;
+                }
+            }
+            continue;
+        }
+        
+        /* Queue the children that touch the region */
+        int level = entry.level - 1;
+        int cells = (pyramid->size - 1) >> level;
+        
+        for (int cx = 2 * entry.cx; cx <= 2 * entry.cx + 1; cx++)
+        {
+            for (int cy = 2 * entry.cy; cy <= 2 * entry.cy + 1; cy++)
+            {
+                if ((cx + 1) << level < x0 || cx << level > x1) continue;
+                if ((cy + 1) << level < y0 || cy << level > y1) continue;
+                
+                size_t i = (size_t)cx * cells + cy;
+                PyramidEntry child = {sign > 0 ? pyramid->max[level][i] : -pyramid->min[level][i], level, cx, cy};
+                if (!pyramid_heap_push(&heap, &count, &capacity, child)) count = 0;
+            }
+        }
+    }
+    
+    free(heap);
+    return sign * result;
+}
+
+/* ----------------------------------------------------------------------------
+ * Exact min/max of the samples [x0, x1] x [y0, y1] (inclusive, in range).
+ * Best-first descent of the pyramid: only the cells whose bounds beat the
+ * answer are opened, so a query usually touches O(log N) cells per level
+ * path instead of the whole region.
+ * ---------------------------------------------------------------------------- */
+void height_pyramid_query(const HeightPyramid *pyramid, int x0, int y0, int x1, int y1,
+                          float *min_value, float *max_value)
+{
+    *min_value = height_pyramid_extreme(pyramid, x0, y0, x1, y1, -1.0f);
+    *max_value = height_pyramid_extreme(pyramid, x0, y0, x1, y1, 1.0f);
+}
+
+/* ----------------------------------------------------------------------------
+ * First hit of the ray with one finest cell, between parameters t_a and t_b.
+ * The surface of the cell is the bilinear patch of its 4 samples, so the
+ * ray height minus the surface height is a quadratic in t: it is sampled
+ * at both ends and in the middle and its first root is returned.
+ * ---------------------------------------------------------------------------- */
+static int cell_ray_hit(const HeightPyramid *pyramid, int cx, int cy, Vector3 origin, Vector3 direction,
+                        float t_a, float t_b, float *hit_t)
+{
+    const float *map = pyramid->map;
+    int size = pyramid->size;
+    float h00 = MAP_AT(map, size, cx, cy), h10 = MAP_AT(map, size, cx + 1, cy);
+    float h01 = MAP_AT(map, size, cx, cy + 1), h11 = MAP_AT(map, size, cx + 1, cy + 1);
+    float f[3];
+    
+    for (int k = 0; k < 3; k++)
+    {
+        float t = t_a + (t_b - t_a) * 0.5f * k;
+        float u = fminf(fmaxf(origin.x + direction.x * t - cx, 0.0f), 1.0f);
+        float v = fminf(fmaxf(origin.y + direction.y * t - cy, 0.0f), 1.0f);
+        float surface = (h00 * (1.0f - u) + h10 * u) * (1.0f - v) + (h01 * (1.0f - u) + h11 * u) * v;
+        f[k] = origin.z + direction.z * t - surface;
+    }
+    
+    if (f[0] <= 0.0f)
+    {
+        *hit_t = t_a;
+        return 1;
+    }
+    
+    /* f(s) = a s^2 + b s + c over s in [0, 1] */
+    float a = 2.0f * f[2] - 4.0f * f[1] + 2.0f * f[0];
+    float b = 4.0f * f[1] - f[2] - 3.0f * f[0];
+    float c = f[0];
+    float s = -1.0f;
+    
+    if (fabsf(a) < 1e-6f)
+    {
+        if (b < 0.0f) s = -c / b;
+    }
+    else
+    {
+        float discriminant = b * b - 4.0f * a * c;
+        if (discriminant >= 0.0f)
+        {
+            float root = sqrtf(discriminant);
+            float s1 = (-b - root) / (2.0f * a), s2 = (-b + root) / (2.0f * a);
+            if (s1 > s2) { float t = s1; s1 = s2; s2 = t; }
+            s = s1 >= 0.0f ? s1 : s2;
+        }
+    }
+    
+    if (s < 0.0f || s > 1.0f) return 0;
+    
+    *hit_t = t_a + (t_b - t_a) * s;
+    return 1;
+}
+
+/* ----------------------------------------------------------------------------
+ * First intersection of the ray origin + t * direction (0 <= t <= max_t)
+ * with the terrain (x, y in samples, z = height). Empty-space skipping over
+ * the min/max pyramid: a cell whose maximum stays below the ray along the
+ * whole crossing is jumped over at once, otherwise the walk goes down a
+ * level; after leaving a cell it climbs back up. Returns 1 and the hit
+ * parameter, or 0 if the ray leaves the map or reaches max_t.
+ * ---------------------------------------------------------------------------- */
+int terrain_ray_intersect(const HeightPyramid *pyramid, Vector3 origin, Vector3 direction, float max_t, float *hit_t)
+{
+    float limit = (float)(pyramid->size - 1);
+    float t_start = 0.0f, t_end = max_t;
+    float start[2] = {origin.x, origin.y}, step[2] = {direction.x, direction.y};
+    
+    /* Clip to the map square */
+    for (int axis = 0; axis < 2; axis++)
+    {
+        if (fabsf(step[axis]) < 1e-12f)
+        {
+            if (start[axis] < 0.0f || start[axis] > limit) return 0;
+            continue;
+        }
+        
+        float t0 = (0.0f - start[axis]) / step[axis];
+        float t1 = (limit - start[axis]) / step[axis];
+        if (t0 > t1) { float t = t0; t0 = t1; t1 = t; }
+        t_start = fmaxf(t_start, t0);
+        t_end = fminf(t_end, t1);
+    }
+    
+    int top = pyramid->levels - 1;
+    int level = top;
+    float t = t_start;
+    
+    /* Parameter step of 1/1000 sample, the least progress per cell */
+    float planar = fmaxf(fabsf(direction.x), fabsf(direction.y));
+    float min_step = planar > 0.0f ? 1e-3f / planar : t_end - t_start + 1.0f;
+    
+    while (t <= t_end)
+    {
+        int cells = (pyramid->size - 1) >> level;
+        
+        /* Cell under the ray, nudged forward so a boundary belongs to the next cell */
+        float px = origin.x + direction.x * t + (direction.x > 0.0f ? 1e-3f : -1e-3f);
+        float py = origin.y + direction.y * t + (direction.y > 0.0f ? 1e-3f : -1e-3f);
+        int cx = (int)floorf(px) >> level, cy = (int)floorf(py) >> level;
+        if (cx < 0) cx = 0;
+        if (cy < 0) cy = 0;
+        if (cx >= cells) cx = cells - 1;
+        if (cy >= cells) cy = cells - 1;
+        
+        /* Where the ray leaves the cell */
+        float cell = (float)(1 << level);
+        float t_exit = t_end;
+        if (direction.x != 0.0f)
+        {
+            float edge = direction.x > 0.0f ? (cx + 1) * cell : cx * cell;
+            t_exit = fminf(t_exit, (edge - origin.x) / direction.x);
+        }
+        if (direction.y != 0.0f)
+        {
+            float edge = direction.y > 0.0f ? (cy + 1) * cell : cy * cell;
+            t_exit = fminf(t_exit, (edge - origin.y) / direction.y);
+        }
+        if (t_exit < t + min_step) t_exit = t + min_step;
+        
+        float ray_low = fminf(origin.z + direction.z * t, origin.z + direction.z * t_exit);
+        
+        if (ray_low > pyramid->max[level][(size_t)cx * cells + cy])
+        {
+            /* Empty space: skip the cell and try a coarser one next */
+            if (level < top) level++;
+        }
+        else if (level > 0)
+        {
+            level--;
+            continue;
+        }
+        else if (cell_ray_hit(pyramid, cx, cy, origin, direction, t, t_exit, hit_t))
+        {
+            return 1;
+        }
+        else if (level < top)
+        {
+            level++;
+        }
+        
+        if (t_exit >= t_end) break;
+        t = t_exit;
+    }
+    
+    return 0;
+}
+
+/* ----------------------------------------------------------------------------
+ * Point to point visibility: 1 if the segment from -> to stays above the
+ * terrain (the end points themselves may touch it)
+ * ---------------------------------------------------------------------------- */
+int terrain_line_of_sight(const HeightPyramid *pyramid, Vector3 from, Vector3 to)
+{
+    Vector3 direction = {to.x - from.x, to.y - from.y, to.z - from.z};
+    float length = sqrtf(direction.x * direction.x + direction.y * direction.y);
+    float margin = length > 0.0f ? 1e-3f / length : 0.0f;
+    float hit_t;
+    
+    return !terrain_ray_intersect(pyramid, from, direction, 1.0f - margin, &hit_t);
+}
+
+/* ----------------------------------------------------------------------------
+ * Many rays at once: split over the threads in chunks of consecutive rays.
+ * Every ray still walks the pyramid on its own; nothing is shared between
+ * rays but the cache, so queue rays that are close to each other together.
+ * hit_t[i] is negative when ray i misses.
+ * ---------------------------------------------------------------------------- */
+void terrain_ray_intersect_batch(const HeightPyramid *pyramid, const Vector3 *origins, const Vector3 *directions,
+                                 int count, float max_t, float *hit_t)
+{
+    #pragma omp parallel for schedule(dynamic, 64)
+    for (int i = 0; i < count; i++)
+    {
+        if (!terrain_ray_intersect(pyramid, origins[i], directions[i], max_t, &hit_t[i])) hit_t[i] = -1.0f;
+    }
+}
+
+void terrain_line_of_sight_batch(const HeightPyramid *pyramid, const Vector3 *from, const Vector3 *to,
+                                 int count, unsigned char *visible)
+{
+    #pragma omp parallel for schedule(dynamic, 64)
+    for (int i = 0; i < count; i++)
+    {
+        visible[i] = (unsigned char)terrain_line_of_sight(pyramid, from[i], to[i]);
+    }
+}
+
+/* ----------------------------------------------------------------------------
+ * Border sample whose viewshed ray decides sample (x, y): the point where the
+ * line from the observer through the sample leaves the map, rounded. The
+ * ray to that border sample passes within half a sample of (x, y).
+ * ---------------------------------------------------------------------------- */
+static void viewshed_owner(int size, int observer_x, int observer_y, int x, int y, int *border_x, int *border_y)
+{
+    float limit = (float)(size - 1);
+    float dx = (float)(x - observer_x), dy = (float)(y - observer_y);
+    float s = 1e30f;
+    
+    if (dx > 0.0f) s = fminf(s, (limit - observer_x) / dx);
+    if (dx < 0.0f) s = fminf(s, -observer_x / dx);
+    if (dy > 0.0f) s = fminf(s, (limit - observer_y) / dy);
+    if (dy < 0.0f) s = fminf(s, -observer_y / dy);
+    
+    *border_x = (int)fminf(fmaxf(floorf(observer_x + dx * s + 0.5f), 0.0f), limit);
+    *border_y = (int)fminf(fmaxf(floorf(observer_y + dy * s + 0.5f), 0.0f), limit);
+}
+
+/* ----------------------------------------------------------------------------
+ * Ground on the grid line major of a viewshed ray, at position minor along
+ * it: the linear blend of the two samples around it (the bilinear surface)
+ * ---------------------------------------------------------------------------- */
+static float viewshed_ground(const float *map, int size, int x_major, int major, float minor)
+{
+    int low = (int)floorf(minor);
+    int high = low < size - 1 ? low + 1 : low;
+    float blend = minor - low;
+    float a = x_major ? MAP_AT(map, size, major, low) : MAP_AT(map, size, low, major);
+    float b = x_major ? MAP_AT(map, size, major, high) : MAP_AT(map, size, high, major);
+    
+    return a + (b - a) * blend;
+}
+
+/* ----------------------------------------------------------------------------
+ * One viewshed ray, from the observer to a border sample, one step per
+ * sample along its major axis. The line of sight to a sample this ray owns
+ * crosses each earlier grid line within half a sample of the ray, so the
+ * ray keeps two horizons: the steepest slope from the eye of the lowest and
+ * of the highest ground in that band. A sample above the high horizon is
+ * visible unless the ground of its last step hides it, one below the low
+ * horizon is hidden; one in between gets an exact line of sight. Only the
+ * samples this ray owns are written.
+ * ---------------------------------------------------------------------------- */
+static void viewshed_ray(const HeightPyramid *pyramid, int observer_x, int observer_y, float eye, int border_x,
+                         int border_y, unsigned char *visible)
+{
+    const float *map = pyramid->map;
+    int size = pyramid->size;
+    float limit = (float)(size - 1);
+    int dx = border_x - observer_x, dy = border_y - observer_y;
+    int x_major = abs(dx) >= abs(dy);
+    int steps = x_major ? abs(dx) : abs(dy);
+    int major_step = x_major ? (dx > 0 ? 1 : -1) : (dy > 0 ? 1 : -1);
+    float minor_step = (float)(x_major ? dy : dx) / steps;
+    int major_origin = x_major ? observer_x : observer_y, minor_origin = x_major ? observer_y : observer_x;
+    float step_length = sqrtf((float)dx * dx + (float)dy * dy) / steps;
+    float horizon_low = -1e30f, horizon_high = -1e30f;
+    
+    for (int k = 1; k <= steps; k++)
+    {
+        /* Exact on the major axis, clamped on the other against rounding */
+        int major = major_origin + major_step * k;
+        float minor = fminf(fmaxf(minor_origin + minor_step * k, 0.0f), limit);
+        int low = (int)floorf(minor);
+        int high = low < size - 1 ? low + 1 : low;
+        
+        for (int m = low; m <= high; m++)
+        {
+            int x = x_major ? major : m, y = x_major ? m : major;
+            int owner_x, owner_y;
+            viewshed_owner(size, observer_x, observer_y, x, y, &owner_x, &owner_y);
+            if (owner_x != border_x || owner_y != border_y) continue;
+            
+            float ddx = (float)(x - observer_x), ddy = (float)(y - observer_y);
+            float ground = MAP_AT(map, size, x, y);
+            float slope = (ground - eye) / sqrtf(ddx * ddx + ddy * ddy);
+            
+            Vector3 from = {(float)observer_x, (float)observer_y, eye};
+            Vector3 to = {(float)x, (float)y, ground};
+            
+            if (slope > horizon_high)
+            {
+                /* Clear up to the last grid line; the ground right before the sample may still hide it */
+                float back = 1.0f / k;
+                Vector3 last = {to.x - (to.x - from.x) * back, to.y - (to.y - from.y) * back,
+                                to.z - (to.z - from.z) * back};
+                MAP_AT(visible, size, x, y) = (unsigned char)terrain_line_of_sight(pyramid, last, to);
+            }
+            else if (slope <= horizon_low)
+            {
+                MAP_AT(visible, size, x, y) = 0;
+            }
+            else
+            {
+                MAP_AT(visible, size, x, y) = (unsigned char)terrain_line_of_sight(pyramid, from, to);
+            }
+        }
+        
+        /* Ground band half a sample either side: its ends and the samples inside */
+        float band_start = fmaxf(minor - 0.5f, 0.0f), band_end = fminf(minor + 0.5f, limit);
+        float a = viewshed_ground(map, size, x_major, major, band_start);
+        float b = viewshed_ground(map, size, x_major, major, band_end);
+        float ground_low = fminf(a, b), ground_high = fmaxf(a, b);
+        for (int m = (int)ceilf(band_start); m <= (int)floorf(band_end); m++)
+        {
+            float ground = x_major ? MAP_AT(map, size, major, m) : MAP_AT(map, size, m, major);
+            ground_low = fminf(ground_low, ground);
+            ground_high = fmaxf(ground_high, ground);
+        }
+        
+        float distance = k * step_length;
+        horizon_low = fmaxf(horizon_low, (ground_low - eye) / distance);
+        horizon_high = fmaxf(horizon_high, (ground_high - eye) / distance);
+    }
+}
+
+/* ----------------------------------------------------------------------------
+ * Viewshed: visible[x * size + y] = 1 if the ground at sample (x, y) can be
+ * seen from eye_height above sample (observer_x, observer_y). Swept outward
+ * from the observer along one ray per border sample (R2), so every ray
+ * carries its horizon along instead of each sample walking its own line of
+ * sight. Each sample is judged by the ray that passes closest to it, and
+ * only the samples the ray cannot settle on its own (those between its low
+ * and high horizons) walk the pyramid with terrain_line_of_sight. Rays are
+ * spread over the threads and write disjoint samples.
+ * ---------------------------------------------------------------------------- */
+void terrain_viewshed(const HeightPyramid *pyramid, int observer_x, int observer_y, float eye_height,
+                      unsigned char *visible)
+{
+    int size = pyramid->size;
+    int border = 4 * (size - 1);
+    float eye = MAP_AT(pyramid->map, size, observer_x, observer_y) + eye_height;
+    
+    MAP_AT(visible, size, observer_x, observer_y) = 1;
+    
+    #pragma omp parallel for schedule(dynamic, 16)
+    for (int i = 0; i < border; i++)
+    {
+        /* Once around the border, starting at (0, 0) */
+        int side = i / (size - 1), j = i % (size - 1);
+        int border_x = side == 0 ? j : side == 1 ? size - 1 : side == 2 ? size - 1 - j : 0;
+        int border_y = side == 0 ? 0 : side == 1 ? j : side == 2 ? size - 1 : size - 1 - j;
+        if (border_x == observer_x && border_y == observer_y) continue;
+        
+        viewshed_ray(pyramid, observer_x, observer_y, eye, border_x, border_y, visible);
+    }
+}
+
+/* ----------------------------------------------------------------------------
+ * Bilinear heights (and gradients if gx != NULL) of a block of queries.
+ * Plain loop over the block, vectorised by the compiler with gathers.
+ * ---------------------------------------------------------------------------- */
+static void sample_block_bilinear(const float *restrict map, int size, const float *restrict xs,
+                                  const float *restrict ys, int count, float *restrict heights,
+                                  float *restrict gx, float *restrict gy)
+{
+    float limit = (float)(size - 1);
+    
+    for (int i = 0; i < count; i++)
+    {
+        float x = fminf(fmaxf(xs[i], 0.0f), limit);
+        float y = fminf(fmaxf(ys[i], 0.0f), limit);
+        int cx = (int)x < size - 1 ? (int)x : size - 2;
+        int cy = (int)y < size - 1 ? (int)y : size - 2;
+        float u = x - cx, v = y - cy;
+        size_t base = (size_t)cx * size + cy;
+        
+        float h00 = map[base], h01 = map[base + 1];
+        float h10 = map[base + size], h11 = map[base + size + 1];
+        
+        heights[i] = (h00 * (1.0f - u) + h10 * u) * (1.0f - v) + (h01 * (1.0f - u) + h11 * u) * v;
+        
+        if (gx != NULL)
+        {
+            gx[i] = (h10 - h00) * (1.0f - v) + (h11 - h01) * v;
+            gy[i] = (h01 - h00) * (1.0f - u) + (h11 - h10) * u;
+        }
+    }
+}
+
+/* ----------------------------------------------------------------------------
+ * Catmull-Rom weights of the 4 samples around t (0..1) and their derivatives
+ * ---------------------------------------------------------------------------- */
+static inline void catmull_rom_weights(float t, float w[4], float dw[4])
+{
+    float t2 = t * t, t3 = t2 * t;
+    
+    w[0] = 0.5f * (-t3 + 2.0f * t2 - t);
+    w[1] = 0.5f * (3.0f * t3 - 5.0f * t2 + 2.0f);
+    w[2] = 0.5f * (-3.0f * t3 + 4.0f * t2 + t);
+    w[3] = 0.5f * (t3 - t2);
+    
+    dw[0] = 0.5f * (-3.0f * t2 + 4.0f * t - 1.0f);
+    dw[1] = 0.5f * (9.0f * t2 - 10.0f * t);
+    dw[2] = 0.5f * (-9.0f * t2 + 8.0f * t + 1.0f);
+    dw[3] = 0.5f * (3.0f * t2 - 2.0f * t);
+}
+
+/* ----------------------------------------------------------------------------
+ * Bicubic (Catmull-Rom) heights and gradients of a block of queries.
+ * Samples outside the map are clamped to the border.
+ * ---------------------------------------------------------------------------- */
+static void sample_block_bicubic(const float *restrict map, int size, const float *restrict xs,
+                                 const float *restrict ys, int count, float *restrict heights,
+                                 float *restrict gx, float *restrict gy)
+{
+    float limit = (float)(size - 1);
+    
+    for (int i = 0; i < count; i++)
+    {
+        float x = fminf(fmaxf(xs[i], 0.0f), limit);
+        float y = fminf(fmaxf(ys[i], 0.0f), limit);
+        int cx = (int)x < size - 1 ? (int)x : size - 2;
+        int cy = (int)y < size - 1 ? (int)y : size - 2;
+        float wx[4], wy[4], dwx[4], dwy[4];
+        
+        catmull_rom_weights(x - cx, wx, dwx);
+        catmull_rom_weights(y - cy, wy, dwy);
+        
+        float height = 0.0f, slope_x = 0.0f, slope_y = 0.0f;
+        
+        for (int a = 0; a < 4; a++)
+        {
+            int sx = cx - 1 + a;
+            sx = sx < 0 ? 0 : (sx > size - 1 ? size - 1 : sx);
+            float row = 0.0f, row_slope = 0.0f;
+            
+            for (int b = 0; b < 4; b++)
+            {
+                int sy = cy - 1 + b;
+                sy = sy < 0 ? 0 : (sy > size - 1 ? size - 1 : sy);
+                float h = map[(size_t)sx * size + sy];
+                row += h * wy[b];
+                row_slope += h * dwy[b];
+            }
+            
+            height += row * wx[a];
+            slope_x += row * dwx[a];
+            slope_y += row_slope * wx[a];
+        }
+        
+        heights[i] = height;
+        if (gx != NULL)
+        {
+            gx[i] = slope_x;
+            gy[i] = slope_y;
+        }
+    }
+}
+
+/* ----------------------------------------------------------------------------
+ * Interleave the bits of x and y (Morton / Z order key)
+ * ---------------------------------------------------------------------------- */
+static inline unsigned int spread_bits(unsigned int v)
+{
+    v &= 0xffffu;
+    v = (v | (v << 8)) & 0x00ff00ffu;
+    v = (v | (v << 4)) & 0x0f0f0f0fu;
+    v = (v | (v << 2)) & 0x33333333u;
+    v = (v | (v << 1)) & 0x55555555u;
+    return v;
+}
+
+static inline unsigned int morton_key(unsigned int x, unsigned int y)
+{
+    return (spread_bits(x) << 1) | spread_bits(y);
+}
+
+/* ----------------------------------------------------------------------------
+ * terrain_sample_batch in the order submitted or, with 'sort', in Morton
+ * order. Either way the blocks of queries are split over the threads.
+ * ---------------------------------------------------------------------------- */
+static int sample_batch(const float *map, int size, const float *xs, const float *ys, int count, int filter, int sort,
+                        float *heights, float *gradient_x, float *gradient_y)
+{
+    void (*kernel)(const float *, int, const float *, const float *, int, float *, float *, float *) =
+        filter == SAMPLE_BICUBIC ? sample_block_bicubic : sample_block_bilinear;
+    int gradients = gradient_x != NULL && gradient_y != NULL;
+    
+    if (!sort)
+    {
+        #pragma omp parallel for schedule(static) if (count > 16 * SAMPLE_BLOCK)
+        for (int start = 0; start < count; start += SAMPLE_BLOCK)
+        {
+            int n = count - start < SAMPLE_BLOCK ? count - start : SAMPLE_BLOCK;
+            kernel(map, size, xs + start, ys + start, n, heights + start,
+                   gradients ? gradient_x + start : NULL, gradients ? gradient_y + start : NULL);
+        }
+        return 1;
+    }
+    
+    /* Queries keyed by the Morton code of their 128x128 tile and sorted (LSD
+       radix, 2 key bits per doubling of the map side and SAMPLE_SORT_DIGIT
+       bits per pass: one pass up to 2049x2049, two from 4097x4097;
+       coordinates moved along so the sampling reads them in order). Within
+       a tile the order does not matter, its 64 KB fit in L2. */
+    SampleQuery *queries = malloc((size_t)count * 2 * sizeof(SampleQuery));
+    if (queries == NULL) return 0;
+    
+    float limit = (float)(size - 1);
+    for (int i = 0; i < count; i++)
+    {
+        unsigned int cx = (unsigned int)fminf(fmaxf(xs[i], 0.0f), limit);
+        unsigned int cy = (unsigned int)fminf(fmaxf(ys[i], 0.0f), limit);
+        queries[i].key = morton_key(cx >> SAMPLE_SORT_TILE, cy >> SAMPLE_SORT_TILE);
+        queries[i].index = (unsigned int)i;
+        queries[i].x = xs[i];
+        queries[i].y = ys[i];
+    }
+    
+    SampleQuery *sorted = queries, *scratch = queries + count;
+    int key_bits = 0;
+    
+    while ((1u << (key_bits / 2 + SAMPLE_SORT_TILE)) < (unsigned int)size) key_bits += 2;
+    
+    for (int shift = 0; shift < key_bits; shift += SAMPLE_SORT_DIGIT)
+    {
+        static const unsigned int mask = (1u << SAMPLE_SORT_DIGIT) - 1;
+        int histogram[(1 << SAMPLE_SORT_DIGIT) + 1] = {0};
+        
+        for (int i = 0; i < count; i++) histogram[((sorted[i].key >> shift) & mask) + 1]++;
+        for (int b = 0; b < (1 << SAMPLE_SORT_DIGIT); b++) histogram[b + 1] += histogram[b];
+        for (int i = 0; i < count; i++) scratch[histogram[(sorted[i].key >> shift) & mask]++] = sorted[i];
+        
+        SampleQuery *swap = sorted;
+        sorted = scratch;
+        scratch = swap;
+    }
+    
+    /* Sample one block at a time and scatter the results */
+    #pragma omp parallel for schedule(static) if (count > 16 * SAMPLE_BLOCK)
+    for (int start = 0; start < count; start += SAMPLE_BLOCK)
+    {
+        float block_x[SAMPLE_BLOCK], block_y[SAMPLE_BLOCK];
+        float block_h[SAMPLE_BLOCK], block_gx[SAMPLE_BLOCK], block_gy[SAMPLE_BLOCK];
+        int n = count - start < SAMPLE_BLOCK ? count - start : SAMPLE_BLOCK;
+        
+        for (int i = 0; i < n; i++)
+        {
+            block_x[i] = sorted[start + i].x;
+            block_y[i] = sorted[start + i].y;
+        }
+        
+        kernel(map, size, block_x, block_y, n, block_h, gradients ? block_gx : NULL, gradients ? block_gy : NULL);
+        
+        for (int i = 0; i < n; i++)
+        {
+            unsigned int index = sorted[start + i].index;
+            heights[index] = block_h[i];
+            if (gradients)
+            {
+                gradient_x[index] = block_gx[i];
+                gradient_y[index] = block_gy[i];
+            }
+        }
+    }
+    
+    free(queries);
+    return 1;
+}
+
+/* ----------------------------------------------------------------------------
+ * Heights at fractional coordinates (x, y in samples, like terrain[x][y]),
+ * with SAMPLE_BILINEAR or SAMPLE_BICUBIC. Gradients (dh/dx, dh/dy) are
+ * written when gradient_x and gradient_y are not NULL. Coordinates are
+ * clamped to the map.
+ * Large bicubic batches on maps beyond SAMPLE_SORT_CACHE are processed in
+ * Morton order of small tiles (see sample_batch), so queries close on the
+ * map are served from the same cache lines whatever order the caller
+ * submits them in. Bilinear queries read too little for the sort to pay.
+ * Returns 0 if out of memory.
+ * ---------------------------------------------------------------------------- */
+int terrain_sample_batch(const float *map, int size, const float *xs, const float *ys, int count, int filter,
+                         float *heights, float *gradient_x, float *gradient_y)
+{
+    int sort = count >= SAMPLE_SORT_MIN && filter == SAMPLE_BICUBIC &&
+               (size_t)size * size * sizeof(float) > SAMPLE_SORT_CACHE;
+    
+    return sample_batch(map, size, xs, ys, count, filter, sort, heights, gradient_x, gradient_y);
+}
+
+/* ----------------------------------------------------------------------------
+ * Calculate random noise
+ * The value is a hash of seed and position instead of the next rand(), so
+ * the result does not depend on the order in which samples are computed.
+ * ---------------------------------------------------------------------------- */
+float calculate_noise(float amplitude, unsigned int seed, int x, int y)
+{
+    unsigned int h = hash_position(seed, x, y);
+    
+    /* Signed 24 bit value scaled by a power of 2, so the only rounding is
+       the product with the amplitude, in scalar and SIMD code alike */
+    int value = (int)(h >> 8) - 8388608;
+    
+    return (float)value * (amplitude / 8388608.0f);
+}
+
+/* ----------------------------------------------------------------------------
+ * 32 bit hash of a seed and a grid position
+ * ---------------------------------------------------------------------------- */
+unsigned int hash_position(unsigned int seed, int x, int y)
+{
+    unsigned int h = seed ^ ((unsigned int)x * 0x8da6b343u) ^ ((unsigned int)y * 0xd8163841u);
+    
+    h ^= h >> 16;
+    h *= 0x7feb352du;
+    h ^= h >> 15;
+    h *= 0x846ca68bu;
+    h ^= h >> 16;
+    
+    return h;
+}
+
+/* ----------------------------------------------------------------------------
+ * Reset the 4 corners of the terrain to 0
+ * ---------------------------------------------------------------------------- */
+void reset_canvas_corners(void)
+{
+    terrain[0][0] = 0.0f;
+    terrain[0][ITERATIONS - 1] = 0.0f;
+    terrain[ITERATIONS - 1][0] = 0.0f;
+    terrain[ITERATIONS - 1][ITERATIONS - 1] = 0.0f;
+}
+
+/* ----------------------------------------------------------------------------
+ * Wall clock time in seconds
+ * ---------------------------------------------------------------------------- */
+double get_time_seconds(void)
+{
+#ifdef _OPENMP
+    return omp_get_wtime();
+#else
+    return (double)clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+/* ----------------------------------------------------------------------------
+ * Number of worker threads, and index of the calling one
+ * ---------------------------------------------------------------------------- */
+int get_thread_count(void)
+{
+#ifdef _OPENMP
+    return omp_get_max_threads();
+#else
+    return 1;
+#endif
+}
+
+int get_thread_index(void)
+{
+#ifdef _OPENMP
+    return omp_get_thread_num();
+#else
+    return 0;
+#endif
+}
+
+/* ----------------------------------------------------------------------------
+ * Benchmark: Diamond-Square generation orders, with 1 and all threads
+ * Run with "terragen --bench", no window is opened.
+ * ---------------------------------------------------------------------------- */
+int run_benchmark(void)
+{
+    const int sizes[] = {257, 1025, 4097};
+    const int runs = 3;
+    const char *names[] = {"breadth", "depth", "tasks"};
+    void (*orders[])(float *, int, unsigned int) = {
+        diamond_square_breadth_first,
+        diamond_square_depth_first,
+        diamond_square_parallel
+    };
+    int max_threads = get_thread_count();
+    
+    printf("%-8s %8s", "size", "threads");
+    for (int o = 0; o < 3; o++) printf(" %9s (ms)", names[o]);
+    printf(" %10s\n", "identical");
+    
+    for (int s = 0; s < (int)(sizeof(sizes) / sizeof(sizes[0])); s++)
+    {
+        int size = sizes[s];
+        size_t count = (size_t)size * size;
+        float *reference = calloc(count, sizeof(float));
+        float *map = calloc(count, sizeof(float));
+        
+        if (reference == NULL || map == NULL)
+        {
+            fprintf(stderr, "Out of memory for %dx%d\n", size, size);
+            free(reference);
+            free(map);
+            return 1;
+        }
+        
+        diamond_square_breadth_first(reference, size, 12345u);
+        
+        for (int threads = 1; threads <= max_threads; threads = threads < max_threads ? max_threads : threads + 1)
+        {
+#ifdef _OPENMP
+            omp_set_num_threads(threads);
+#endif
+            int identical = 1;
+            
+            printf("%-8d %8d", size, threads);
+            
+            for (int o = 0; o < 3; o++)
+            {
+                double best = 1e9;
+                
+                for (int r = 0; r < runs; r++)
+                {
+                    memset(map, 0, count * sizeof(float));
+                    double start = get_time_seconds();
+                    orders[o](map, size, 12345u);
+                    best = fmin(best, get_time_seconds() - start);
+                }
+                
+                identical &= memcmp(reference, map, count * sizeof(float)) == 0;
+                printf(" %14.2f", best * 1000.0);
+            }
+            
+            printf(" %10s\n", identical ? "yes" : "NO");
+        }
+        
+        free(reference);
+        free(map);
+    }
+    
+#ifdef _OPENMP
+    omp_set_num_threads(max_threads);
+#endif
+    
+    if (run_ensemble_benchmark() != 0) return 1;
+    if (run_pyramid_benchmark() != 0) return 1;
+    if (run_query_benchmark() != 0) return 1;
+    if (run_sampling_benchmark() != 0) return 1;
+    if (run_erosion_benchmark() != 0) return 1;
+    if (run_spectral_benchmark() != 0) return 1;
+    if (run_fbm_benchmark() != 0) return 1;
+    if (run_generator_benchmark() != 0) return 1;
+    if (run_filter_benchmark() != 0) return 1;
+    if (run_blur_benchmark() != 0) return 1;
+    if (run_export_benchmark() != 0) return 1;
+    if (run_rtin_benchmark() != 0) return 1;
+    return run_render_benchmark();
+}
+
+/* ----------------------------------------------------------------------------
+ * Benchmark: small maps one at a time against ENSEMBLE_LANES at once
+ * ---------------------------------------------------------------------------- */
+int run_ensemble_benchmark(void)
+{
+    const int sizes[] = {65, 129, 257};
+    const int batches = 64;
+    
+    printf("\n%-8s %16s %16s %10s\n", "size", "scalar (maps/s)", "ensemble (maps/s)", "identical");
+    
+    for (int s = 0; s < (int)(sizeof(sizes) / sizeof(sizes[0])); s++)
+    {
+        int size = sizes[s];
+        size_t count = (size_t)size * size;
+        float *maps[ENSEMBLE_LANES];
+        unsigned int seeds[ENSEMBLE_LANES];
+        float *reference = calloc(count, sizeof(float));
+        int ok = reference != NULL, identical = 1;
+        
+        for (int l = 0; l < ENSEMBLE_LANES; l++)
+        {
+            maps[l] = calloc(count, sizeof(float));
+            ok = ok && maps[l] != NULL;
+        }
+        
+        if (ok)
+        {
+            /* One map at a time */
+            double start = get_time_seconds();
+            for (int b = 0; b < batches; b++)
+            {
+                for (int l = 0; l < ENSEMBLE_LANES; l++)
+                {
+                    diamond_square_breadth_first(maps[l], size, (unsigned int)(b * ENSEMBLE_LANES + l));
+                }
+            }
+            double scalar = get_time_seconds() - start;
+            
+            /* ENSEMBLE_LANES maps per pass */
+            start = get_time_seconds();
+            for (int b = 0; b < batches && ok; b++)
+            {
+                for (int l = 0; l < ENSEMBLE_LANES; l++) seeds[l] = (unsigned int)(b * ENSEMBLE_LANES + l);
+                ok = diamond_square_ensemble(maps, size, seeds);
+            }
+            double ensemble = get_time_seconds() - start;
+            
+            /* Check the last batch against the scalar generator */
+            for (int l = 0; l < ENSEMBLE_LANES; l++)
+            {
+                memset(reference, 0, count * sizeof(float));
+                diamond_square_breadth_first(reference, size, seeds[l]);
+                identical &= memcmp(reference, maps[l], count * sizeof(float)) == 0;
+            }
+            
+            double maps_total = (double)batches * ENSEMBLE_LANES;
+            printf("%-8d %16.0f %16.0f %10s\n", size, maps_total / scalar, maps_total / ensemble,
+                   identical ? "yes" : "NO");
+        }
+        
+        free(reference);
+        for (int l = 0; l < ENSEMBLE_LANES; l++) free(maps[l]);
+        
+        if (!ok)
+        {
+            fprintf(stderr, "Out of memory for %dx%d\n", size, size);
+            return 1;
+        }
+    }
+    
+    return 0;
+}
+
+/* ----------------------------------------------------------------------------
+ * Check that a grid side is 2^n+1 (at least 3)
+ * ---------------------------------------------------------------------------- */
+int is_valid_size(int size)
+{
+    return size >= 3 && ((size - 1) & (size - 2)) == 0;
+}
+
+/* ----------------------------------------------------------------------------
+ * Check fBm settings: 1..FBM_OCTAVES_MAX octaves, lacunarity and gain above
+ * 0, and the highest octave of the smallest map within the 16.16 step of
+ * fbm_generate_region
+ * ---------------------------------------------------------------------------- */
+int is_valid_fbm(const FbmSettings *settings)
+{
+    if (settings->octaves < 1 || settings->octaves > FBM_OCTAVES_MAX) return 0;
+    if (!(settings->lacunarity > 0.0f) || !(settings->gain > 0.0f)) return 0;
+    
+    double growth = pow(settings->lacunarity, settings->octaves - 1);
+    return FBM_FEATURES / 2.0 * (growth > 1.0 ? growth : 1.0) * 65536.0 < 4294967295.0;
+}
+
+/* ----------------------------------------------------------------------------
+ * Per-thread terrain: allocation and release
+ * ---------------------------------------------------------------------------- */
+int terrain_context_init(TerrainContext *ctx, int size)
+{
+    ctx->map = calloc((size_t)size * size, sizeof(float));
+    ctx->size = size;
+    ctx->seed = 0;
+    ctx->min_height = 0.0f;
+    ctx->max_height = 0.0f;
+    
+    return ctx->map != NULL;
+}
+
+void terrain_context_free(TerrainContext *ctx)
+{
+    free(ctx->map);
+    ctx->map = NULL;
+}
+
+/* ----------------------------------------------------------------------------
+ * Generate a terrain in the context with the selected generator.
+ * Called from the batch runner's threads, the generator runs on one thread
+ * there: the batch runner parallelises across terrains instead.
+ * ---------------------------------------------------------------------------- */
+void terrain_context_generate(TerrainContext *ctx, unsigned int seed)
+{
+    ctx->seed = seed;
+    if (!generator_generate(&GENERATORS[generator], ctx->map, ctx->size, seed))
+    {
+        fprintf(stderr, "Out of memory for the %s generator\n", GENERATORS[generator].name);
+    }
+}
+
+/* ----------------------------------------------------------------------------
+ * Stats stage: min and max height of the context terrain
+ * ---------------------------------------------------------------------------- */
+void terrain_context_min_max(TerrainContext *ctx)
+{
+    find_min_max(ctx->map, (size_t)ctx->size * ctx->size, &ctx->min_height, &ctx->max_height);
+}
+
+/* ----------------------------------------------------------------------------
+ * Export formats by name ("raw", "r16", "pgm", "png", "obj", "ply", "glb"), also the
+ * file extension. find_export_format returns -1 for an unknown name,
+ * export_format_of_path the format of the extension (-1 if none matches).
+ * ---------------------------------------------------------------------------- */
+int find_export_format(const char *name)
+{
+    for (int f = 0; f < EXPORT_FORMAT_COUNT; f++)
+    {
+        if (strcmp(EXPORT_FORMATS[f], name) == 0) return f;
+    }
+    return -1;
+}
+
+int export_format_of_path(const char *path)
+{
+    const char *dot = strrchr(path, '.');
+    return dot != NULL ? find_export_format(dot + 1) : -1;
+}
+
+/* ----------------------------------------------------------------------------
+ * Quantise one row of heights to 16 bits, high..low mapped to 0..65535:
+ * smaller values are higher ground, so the summits come out white
+ * ---------------------------------------------------------------------------- */
+static void export_quantize_row(const float *row, int size, float low, float high, unsigned short *out)
+{
+    float scale = high > low ? 65535.0f / (high - low) : 0.0f;
+    
+    #pragma omp simd
+    for (int y = 0; y < size; y++)
+    {
+        float v = (high - row[y]) * scale + 0.5f;
+        v = v < 0.0f ? 0.0f : (v > 65535.0f ? 65535.0f : v);
+        out[y] = (unsigned short)v;
+    }
+}
+
+/* ----------------------------------------------------------------------------
+ * CRC-32 (PNG chunks) and Adler-32 (zlib stream). adler32_combine gives the
+ * checksum of two concatenated pieces from theirs, so the PNG blocks can
+ * be summed by different threads.
+ * ---------------------------------------------------------------------------- */
+static unsigned int crc32_update(unsigned int crc, const unsigned char *data, size_t length)
+{
+    crc = ~crc;
+    for (size_t i = 0; i < length; i++)
+    {
+        crc = deflate_tables.crc[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+static unsigned int adler32_update(unsigned int adler, const unsigned char *data, size_t length)
+{
+    unsigned int a = adler & 0xFFFF, b = adler >> 16;
+    
+    while (length > 0)
+    {
+        /* 5552 bytes is the longest run without overflow before the modulo */
+        size_t run = length < 5552 ? length : 5552;
+        for (size_t i = 0; i < run; i++)
+        {
+            a += data[i];
+            b += a;
+        }
+        a %= 65521;
+        b %= 65521;
+        data += run;
+        length -= run;
+    }
+    return (b << 16) | a;
+}
+
+static unsigned int adler32_combine(unsigned int adler1, unsigned int adler2, size_t length2)
+{
+    unsigned int rem = (unsigned int)(length2 % 65521);
+    unsigned int a = adler1 & 0xFFFF;
+    unsigned int b = (unsigned int)(((unsigned long long)rem * a) % 65521);
+    
+    a += (adler2 & 0xFFFF) + 65521 - 1;
+    b += (adler1 >> 16) + (adler2 >> 16) + 65521 - rem;
+    if (a >= 65521) a -= 65521;
+    if (a >= 65521) a -= 65521;
+    if (b >= 2 * 65521) b -= 2 * 65521;
+    if (b >= 65521) b -= 65521;
+    return (b << 16) | a;
+}
+
+/* ----------------------------------------------------------------------------
+ * Tables of the fixed-Huffman deflate codes and of the CRC, built once
+ * before the compression threads start. Codes are stored bit-reversed,
+ * ready for the LSB-first bit stream.
+ * ---------------------------------------------------------------------------- */
+static unsigned int bit_reverse(unsigned int code, int bits)
+{
+    unsigned int reversed = 0;
+    for (int i = 0; i < bits; i++) reversed |= ((code >> i) & 1) << (bits - 1 - i);
+    return reversed;
+}
+
+static void deflate_tables_build(void)
+{
+    static const unsigned short length_base[29] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+                                                   35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+    static const unsigned short distance_base[30] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+                                                     257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+                                                     8193, 12289, 16385, 24577};
+    
+    for (int c = 0; c < 288; c++)
+    {
+        unsigned int code;
+        int bits;
+        
+        if (c < 144) { code = 0x30 + c; bits = 8; }
+        else if (c < 256) { code = 0x190 + (c - 144); bits = 9; }
+        else if (c < 280) { code = c - 256; bits = 7; }
+        else { code = 0xC0 + (c - 280); bits = 8; }
+        
+        deflate_tables.literal_code[c] = (unsigned short)bit_reverse(code, bits);
+        deflate_tables.literal_bits[c] = (unsigned char)bits;
+    }
+    
+    for (int c = 0; c < 29; c++)
+    {
+        int extra = c < 8 || c == 28 ? 0 : (c - 4) / 4;
+        int next = c == 28 ? 259 : (c == 27 ? 258 : length_base[c + 1]);
+        
+        for (int length = length_base[c]; length < next; length++)
+        {
+            deflate_tables.length_symbol[length] = (unsigned short)(257 + c);
+            deflate_tables.length_extra[length] = (unsigned char)extra;
+            deflate_tables.length_offset[length] = (unsigned short)(length - length_base[c]);
+        }
+    }
+    
+    for (int c = 0; c < 30; c++)
+    {
+        deflate_tables.distance_code[c] = (unsigned char)bit_reverse((unsigned int)c, 5);
+        deflate_tables.distance_extra[c] = (unsigned char)(c < 4 ? 0 : (c - 2) / 2);
+        deflate_tables.distance_base[c] = distance_base[c];
+    }
+    
+    for (int d = 0; d < 32768; d++)
+    {
+        int c = 0;
+        while (c < 29 && distance_base[c + 1] <= d + 1) c++;
+        deflate_tables.distance_symbol[d < 256 ? d : 256 + (d >> 7)] = (unsigned char)c;
+    }
+    
+    for (unsigned int n = 0; n < 256; n++)
+    {
+        unsigned int crc = n;
+        for (int k = 0; k < 8; k++) crc = crc & 1 ? 0xEDB88320u ^ (crc >> 1) : crc >> 1;
+        deflate_tables.crc[n] = crc;
+    }
+}
+
+static void deflate_tables_init(void)
+{
+    #pragma omp critical(deflate_tables)
+    {
+        if (!deflate_tables.ready) deflate_tables_build();
+        deflate_tables.ready = 1;
+    }
+}
+
+/* Distance code of a match distance (1..32768) */
+static inline int deflate_distance_symbol(int distance)
+{
+    int d = distance - 1;
+    return deflate_tables.distance_symbol[d < 256 ? d : 256 + (d >> 7)];
+}
+
+/* Append 'bits' bits (LSB first) to the stream */
+static inline void deflate_put(DeflateStream *stream, unsigned int value, int bits)
+{
+    stream->bit_buffer |= (unsigned long long)value << stream->bit_count;
+    stream->bit_count += bits;
+    while (stream->bit_count >= 8)
+    {
+        stream->out[stream->length++] = (unsigned char)stream->bit_buffer;
+        stream->bit_buffer >>= 8;
+        stream->bit_count -= 8;
+    }
+}
+
+/* ----------------------------------------------------------------------------
+ * Compress 'length' bytes as one fixed-Huffman deflate block followed by an
+ * empty stored block, which byte-aligns the stream (a zlib "sync flush"):
+ * blocks compressed independently can then simply be concatenated. LZ77
+ * with hash chains of at most DEFLATE_CHAIN candidates, within the block.
+ * out needs deflate_bound(length) bytes; returns the bytes written.
+ * ---------------------------------------------------------------------------- */
+static size_t deflate_bound(size_t length)
+{
+    return length + length / 8 + 16;
+}
+
+static size_t deflate_block(const unsigned char *data, size_t length, unsigned char *out, int *head, int *chain)
+{
+    DeflateStream stream = {out, 0, 0, 0};
+    size_t i = 0;
+    
+    for (int h = 0; h < DEFLATE_HASH_SIZE; h++) head[h] = -1;
+    
+    deflate_put(&stream, 0, 1);                 // Not the last block
+    deflate_put(&stream, 1, 2);                 // Fixed Huffman codes
+    
+    while (i < length)
+    {
+        int best_length = 0, best_distance = 0;
+        
+        if (i + 3 <= length)
+        {
+            unsigned int hash = ((unsigned int)data[i] << 16 | (unsigned int)data[i + 1] << 8 | data[i + 2]) * 2654435761u;
+            hash >>= 32 - DEFLATE_HASH_BITS;
+            
+            int limit = length - i < 258 ? (int)(length - i) : 258;
+            int candidate = head[hash];
+            
+            for (int depth = 0; candidate >= 0 && depth < DEFLATE_CHAIN; depth++)
+            {
+                int distance = (int)i - candidate;
+                if (distance > 32768) break;
+                
+                if (data[candidate + best_length] == data[i + best_length])
+                {
+                    int match = 0;
+                    while (match < limit && data[candidate + match] == data[i + match]) match++;
+                    if (match > best_length)
+                    {
+                        best_length = match;
+                        best_distance = distance;
+                        if (match == limit) break;
+                    }
+                }
+                candidate = chain[candidate & (DEFLATE_WINDOW - 1)];
+            }
+            
+            chain[i & (DEFLATE_WINDOW - 1)] = head[hash];
+            head[hash] = (int)i;
+        }
+        
+        if (best_length >= 3)
+        {
+            int symbol = deflate_tables.length_symbol[best_length];
+            int code = deflate_distance_symbol(best_distance);
+            
+            deflate_put(&stream, deflate_tables.literal_code[symbol], deflate_tables.literal_bits[symbol]);
+            deflate_put(&stream, deflate_tables.length_offset[best_length], deflate_tables.length_extra[best_length]);
+            deflate_put(&stream, deflate_tables.distance_code[code], 5);
+            deflate_put(&stream, (unsigned int)(best_distance - deflate_tables.distance_base[code]),
+                        deflate_tables.distance_extra[code]);
+            
+            /* The skipped positions still go into the hash chains */
+            for (size_t k = i + 1; k < i + (size_t)best_length && k + 3 <= length; k++)
+            {
+                unsigned int hash = ((unsigned int)data[k] << 16 | (unsigned int)data[k + 1] << 8 | data[k + 2]) * 2654435761u;
+                hash >>= 32 - DEFLATE_HASH_BITS;
+                chain[k & (DEFLATE_WINDOW - 1)] = head[hash];
+                head[hash] = (int)k;
+            }
+            i += (size_t)best_length;
+        }
+        else
+        {
+            deflate_put(&stream, deflate_tables.literal_code[data[i]], deflate_tables.literal_bits[data[i]]);
+            i++;
+        }
+    }
+    
+    deflate_put(&stream, deflate_tables.literal_code[256], deflate_tables.literal_bits[256]);
+    
+    /* Empty stored block: 3 header bits, pad to the byte, LEN 0, NLEN 0xFFFF */
+    deflate_put(&stream, 0, 3);
+    if (stream.bit_count > 0) deflate_put(&stream, 0, 8 - stream.bit_count);
+    out[stream.length++] = 0x00;
+    out[stream.length++] = 0x00;
+    out[stream.length++] = 0xFF;
+    out[stream.length++] = 0xFF;
+    
+    return stream.length;
+}
+
+/* ----------------------------------------------------------------------------
+ * PNG row filter 'type' (0 none, 1 sub, 2 up, 3 average, 4 Paeth) of a row
+ * of 'length' bytes, 'pixel' bytes per pixel, previous the row above (all
+ * zero on the first row). One loop per type, so each vectorises.
+ * ---------------------------------------------------------------------------- */
+static void png_filter_apply(int type, const unsigned char *restrict row, const unsigned char *restrict previous,
+                             size_t length, size_t pixel, unsigned char *restrict out)
+{
+    /* The first pixel has no left neighbour: a = c = 0 */
+    for (size_t i = 0; i < pixel && i < length; i++)
+    {
+        int b = previous[i];
+        out[i] = (unsigned char)(row[i] - (type == 2 || type == 4 ? b : (type == 3 ? b / 2 : 0)));
+    }
+    
+    if (type == 0) memcpy(out + pixel, row + pixel, length - pixel);
+    else if (type == 1)
+    {
+        #pragma omp simd
+        for (size_t i = pixel; i < length; i++) out[i] = (unsigned char)(row[i] - row[i - pixel]);
+    }
+    else if (type == 2)
+    {
+        #pragma omp simd
+        for (size_t i = pixel; i < length; i++) out[i] = (unsigned char)(row[i] - previous[i]);
+    }
+    else if (type == 3)
+    {
+        #pragma omp simd
+        for (size_t i = pixel; i < length; i++) out[i] = (unsigned char)(row[i] - ((row[i - pixel] + previous[i]) >> 1));
+    }
+    else
+    {
+        #pragma omp simd
+        for (size_t i = pixel; i < length; i++)
+        {
+            int a = row[i - pixel], b = previous[i], c = previous[i - pixel];
+            int pa = abs(b - c), pb = abs(a - c), pc = abs(a + b - 2 * c);
+            int predictor = pa <= pb && pa <= pc ? a : (pb <= pc ? b : c);
+            out[i] = (unsigned char)(row[i] - predictor);
+        }
+    }
+}
+
+/* ----------------------------------------------------------------------------
+ * Filter a PNG row with the type that gives the smallest sum of absolute
+ * (signed) bytes, the usual heuristic. out gets the type byte and the
+ * filtered bytes, scratch needs 'length' bytes.
+ * ---------------------------------------------------------------------------- */
+static void png_filter_row(const unsigned char *row, const unsigned char *previous, size_t length, size_t pixel,
+                           unsigned char *out, unsigned char *scratch)
+{
+    unsigned int best_cost = 0xFFFFFFFFu;
+    
+    for (int type = 0; type < 5; type++)
+    {
+        unsigned int cost = 0;
+        
+        png_filter_apply(type, row, previous, length, pixel, scratch);
+        
+        #pragma omp simd reduction(+:cost)
+        for (size_t i = 0; i < length; i++)
+        {
+            int value = (signed char)scratch[i];
+            cost += (unsigned int)abs(value);
+        }
+        
+        if (cost < best_cost)
+        {
+            best_cost = cost;
+            out[0] = (unsigned char)type;
+            memcpy(out + 1, scratch, length);
+        }
+    }
+}
+
+/* Bytes of image row y: big-endian 16-bit samples of a map row, or RGB pixels */
+static void png_encode_row(const PngImage *image, int y, unsigned short *samples, unsigned char *bytes)
+{
+    if (image->pixels != NULL)
+    {
+        memcpy(bytes, image->pixels + (size_t)y * image->width * 3, (size_t)image->width * 3);
+        return;
+    }
+    
+    export_quantize_row(&MAP_AT(image->map, image->width, y, 0), image->width, image->low, image->high, samples);
+    for (int x = 0; x < image->width; x++)
+    {
+        bytes[2 * x] = (unsigned char)(samples[x] >> 8);
+        bytes[2 * x + 1] = (unsigned char)samples[x];
+    }
+}
+
+/* Write a 32-bit big-endian value */
+static void put_be32(unsigned char *out, unsigned int value)
+{
+    out[0] = (unsigned char)(value >> 24);
+    out[1] = (unsigned char)(value >> 16);
+    out[2] = (unsigned char)(value >> 8);
+    out[3] = (unsigned char)value;
+}
+
+/* Write a PNG chunk: length, type, data and the CRC of type and data */
+static int png_write_chunk(FILE *file, const char *type, const unsigned char *data, size_t length)
+{
+    unsigned char header[8], trailer[4];
+    
+    put_be32(header, (unsigned int)length);
+    memcpy(header + 4, type, 4);
+    put_be32(trailer, crc32_update(crc32_update(0, header + 4, 4), data, length));
+    
+    return fwrite(header, 1, 8, file) == 8 && (length == 0 || fwrite(data, 1, length, file) == length)
+           && fwrite(trailer, 1, 4, file) == 4;
+}
+
+/* ----------------------------------------------------------------------------
+ * 16-bit grayscale PNG of a map (map rows are image rows)
+ * ---------------------------------------------------------------------------- */
+static int export_png(const float *map, int size, float low, float high, FILE *file)
+{
+    PngImage image = {size, size, map, low, high, NULL};
+    
+    return png_write(&image, file);
+}
+
+/* ----------------------------------------------------------------------------
+ * Write a PNG image. It is cut into blocks of EXPORT_PNG_BLOCK rows,
+ * filtered and deflated independently by the threads (one block each) and
+ * written in order as one IDAT chunk per block; memory is a few blocks per
+ * thread, whatever the image size. Returns 0 on I/O error or out of
+ * memory.
+ * ---------------------------------------------------------------------------- */
+int png_write(const PngImage *image, FILE *file)
+{
+    static const unsigned char signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+    int threads = get_thread_count();
+    int size = image->height;
+    int blocks = (size + EXPORT_PNG_BLOCK - 1) / EXPORT_PNG_BLOCK;
+    size_t pixel = image->pixels != NULL ? 3 : 2;
+    size_t row_bytes = (size_t)image->width * pixel;
+    size_t block_bytes = (size_t)EXPORT_PNG_BLOCK * (row_bytes + 1);
+    size_t bound = deflate_bound(block_bytes) + 2;
+    unsigned char *compressed = malloc((size_t)threads * bound);
+    size_t *compressed_length = malloc((size_t)threads * sizeof(size_t));
+    unsigned int *block_adler = malloc((size_t)threads * sizeof(unsigned int));
+    unsigned int adler = 1;
+    int failures = 0;
+    int ok = compressed != NULL && compressed_length != NULL && block_adler != NULL;
+    
+    deflate_tables_init();
+    
+    unsigned char header[13];
+    put_be32(header, (unsigned int)image->width);
+    put_be32(header + 4, (unsigned int)image->height);
+    header[8] = image->pixels != NULL ? 8 : 16; // Bit depth
+    header[9] = image->pixels != NULL ? 2 : 0;  // RGB or grayscale
+    header[10] = header[11] = header[12] = 0;   // Deflate, adaptive filters, no interlace
+    
+    ok = ok && fwrite(signature, 1, 8, file) == 8 && png_write_chunk(file, "IHDR", header, 13);
+    
+    /* Blocks in groups of one per thread, each group written before the next */
+    for (int group = 0; ok && group < blocks; group += threads)
+    {
+        int count = blocks - group < threads ? blocks - group : threads;
+        
+        #pragma omp parallel reduction(+:failures)
+        {
+            unsigned short *samples = malloc((size_t)image->width * sizeof(unsigned short));
+            unsigned char *rows = malloc(3 * row_bytes);
+            unsigned char *filtered = malloc(block_bytes);
+            int *head = malloc(DEFLATE_HASH_SIZE * sizeof(int));
+            int *chain = malloc(DEFLATE_WINDOW * sizeof(int));
+            int ready = samples != NULL && rows != NULL && filtered != NULL && head != NULL && chain != NULL;
+            
+            if (!ready) failures++;
+            
+            #pragma omp for schedule(static)
+            for (int k = 0; k < count; k++)
+            {
+                if (!ready) continue;
+                
+                int x0 = (group + k) * EXPORT_PNG_BLOCK;
+                int x1 = x0 + EXPORT_PNG_BLOCK < size ? x0 + EXPORT_PNG_BLOCK : size;
+                unsigned char *previous = rows, *current = rows + row_bytes, *scratch = rows + 2 * row_bytes;
+                unsigned char *out = compressed + (size_t)k * bound;
+                size_t filtered_length = (size_t)(x1 - x0) * (row_bytes + 1);
+                size_t length = 0;
+                
+                /* Filters look at the row above, also across the block border */
+                if (x0 > 0) png_encode_row(image, x0 - 1, samples, previous);
+                else memset(previous, 0, row_bytes);
+                
+                for (int x = x0; x < x1; x++)
+                {
+                    png_encode_row(image, x, samples, current);
+                    png_filter_row(current, previous, row_bytes, pixel, filtered + (size_t)(x - x0) * (row_bytes + 1),
+                                   scratch);
+                    unsigned char *swap = previous; previous = current; current = swap;
+                }
+                
+                if (x0 == 0)
+                {
+                    out[length++] = 0x78;               // zlib header: deflate, 32K window
+                    out[length++] = 0x01;
+                }
+                compressed_length[k] = length + deflate_block(filtered, filtered_length, out + length, head, chain);
+                block_adler[k] = adler32_update(1, filtered, filtered_length);
+            }
+            
+            free(samples);
+            free(rows);
+            free(filtered);
+            free(head);
+            free(chain);
+        }
+        
+        if (failures > 0) ok = 0;
+        
+        for (int k = 0; ok && k < count; k++)
+        {
+            int x0 = (group + k) * EXPORT_PNG_BLOCK;
+            int x1 = x0 + EXPORT_PNG_BLOCK < size ? x0 + EXPORT_PNG_BLOCK : size;
+            
+            adler = adler32_combine(adler, block_adler[k], (size_t)(x1 - x0) * (row_bytes + 1));
+            ok = png_write_chunk(file, "IDAT", compressed + (size_t)k * bound, compressed_length[k]);
+        }
+    }
+    
+    /* Final empty fixed block, the checksum, then the end of the image */
+    if (ok)
+    {
+        unsigned char trailer[6] = {0x03, 0x00};
+        put_be32(trailer + 2, adler);
+        ok = png_write_chunk(file, "IDAT", trailer, 6) && png_write_chunk(file, "IEND", trailer, 0);
+    }
+    
+    free(compressed);
+    free(compressed_length);
+    free(block_adler);
+    return ok;
+}
+
+/* ----------------------------------------------------------------------------
+ * RTIN simplification (right-triangulated irregular network). The
+ * 2^n+1 map is the root of a binary tree of right triangles: two triangles
+ * split along the diagonal, each split again at the middle of its
+ * hypotenuse down to single cells. The error of a vertex is how far the
+ * map is from the triangle it splits if it is left out, including
+ * (through the maximum) the errors of all the vertices below it; a mesh
+ * for any threshold is then every triangle whose split vertex is within
+ * it, crack-free since both triangles of a hypotenuse see the same vertex.
+ * Triangles are (a, b, c): right angle at c, hypotenuse a-b.
+ * ---------------------------------------------------------------------------- */
+
+/* Error of the split vertices of the triangles at 'depth' below (a, b, c),
+   subtrees as tasks for the first 'spawn' levels */
+static void rtin_errors_level(Rtin *rtin, const float *map, int depth, int spawn,
+                              int ax, int ay, int bx, int by, int cx, int cy)
+{
+    int size = rtin->size;
+    int mx = (ax + bx) >> 1, my = (ay + by) >> 1;
+    
+    if (depth > 0)
+    {
+        if (spawn > 0)
+        {
+            #pragma omp task
+            rtin_errors_level(rtin, map, depth - 1, spawn - 1, cx, cy, ax, ay, mx, my);
+            #pragma omp task
+            rtin_errors_level(rtin, map, depth - 1, spawn - 1, bx, by, cx, cy, mx, my);
+            #pragma omp taskwait
+        }
+        else
+        {
+            rtin_errors_level(rtin, map, depth - 1, 0, cx, cy, ax, ay, mx, my);
+            rtin_errors_level(rtin, map, depth - 1, 0, bx, by, cx, cy, mx, my);
+        }
+        return;
+    }
+    
+    /* The split vertex is shared with the neighbour across the hypotenuse
+       (apex o): only one of the two writes it, with the children of both */
+    int ox = 2 * mx - cx, oy = 2 * my - cy;
+    int neighbour = ox >= 0 && ox < size && oy >= 0 && oy < size;
+    if (neighbour && (ox < cx || (ox == cx && oy < cy))) return;
+    
+    float interpolated = 0.5f * (MAP_AT(map, size, ax, ay) + MAP_AT(map, size, bx, by));
+    float error = fabsf(interpolated - MAP_AT(map, size, mx, my));
+    
+    if (((ax ^ cx) & 1) == 0 && ((ay ^ cy) & 1) == 0)
+    {
+        /* The split vertices of the children (if on the grid), already final */
+        error = fmaxf(error, MAP_AT(rtin->errors, size, (ax + cx) >> 1, (ay + cy) >> 1));
+        error = fmaxf(error, MAP_AT(rtin->errors, size, (bx + cx) >> 1, (by + cy) >> 1));
+        if (neighbour)
+        {
+            error = fmaxf(error, MAP_AT(rtin->errors, size, (ax + ox) >> 1, (ay + oy) >> 1));
+            error = fmaxf(error, MAP_AT(rtin->errors, size, (bx + ox) >> 1, (by + oy) >> 1));
+        }
+    }
+    
+    MAP_AT(rtin->errors, size, mx, my) = error;
+}
+
+/* ----------------------------------------------------------------------------
+ * Vertex errors of a map, one level of the triangle tree at a time from the
+ * smallest triangles up (a level is complete before its parents read it),
+ * the subtrees of a level spread over the threads as tasks. Every vertex
+ * is written once, so the result does not depend on the thread count.
+ * Returns 0 if out of memory.
+ * ---------------------------------------------------------------------------- */
+int rtin_init(Rtin *rtin, const float *map, int size)
+{
+    int tile = size - 1;
+    int levels = 0;
+    
+    rtin->size = size;
+    rtin->errors = calloc((size_t)size * size, sizeof(float));
+    rtin->indices = calloc((size_t)size * size, sizeof(unsigned int));
+    if (rtin->errors == NULL || rtin->indices == NULL)
+    {
+        rtin_free(rtin);
+        return 0;
+    }
+    
+    while ((1 << levels) < tile) levels++;
+    
+    /* The deepest triangles with a split vertex have legs of one cell diagonal */
+    #pragma omp parallel
+    #pragma omp single
+    for (int depth = 2 * levels - 1; depth >= 0; depth--)
+    {
+        int spawn = depth < RTIN_TASK_DEPTH ? depth : RTIN_TASK_DEPTH;
+        
+        #pragma omp task
+        rtin_errors_level(rtin, map, depth, spawn, 0, 0, tile, tile, tile, 0);
+        #pragma omp task
+        rtin_errors_level(rtin, map, depth, spawn, tile, tile, 0, 0, 0, tile);
+        #pragma omp taskwait
+    }
+    
+    return 1;
+}
+
+void rtin_free(Rtin *rtin)
+{
+    free(rtin->errors);
+    free(rtin->indices);
+    rtin->errors = NULL;
+    rtin->indices = NULL;
+}
+
+/* ----------------------------------------------------------------------------
+ * Mesh extraction: count (numbering the vertices in rtin->indices), then
+ * emit, then clear the indices of the vertices used. Every step only
+ * visits the triangles kept and their ancestors.
+ * ---------------------------------------------------------------------------- */
+static void rtin_count(const Rtin *rtin, float max_error, int ax, int ay, int bx, int by, int cx, int cy,
+                       RtinMesh *mesh)
+{
+    int size = rtin->size;
+    int mx = (ax + bx) >> 1, my = (ay + by) >> 1;
+    
+    if (abs(ax - cx) + abs(ay - cy) > 1 && MAP_AT(rtin->errors, size, mx, my) > max_error)
+    {
+        rtin_count(rtin, max_error, cx, cy, ax, ay, mx, my, mesh);
+        rtin_count(rtin, max_error, bx, by, cx, cy, mx, my, mesh);
+        return;
+    }
+    
+    unsigned int *corners[3] = {&MAP_AT(rtin->indices, size, ax, ay), &MAP_AT(rtin->indices, size, bx, by),
+                                &MAP_AT(rtin->indices, size, cx, cy)};
+    for (int k = 0; k < 3; k++)
+    {
+        if (*corners[k] == 0) *corners[k] = (unsigned int)++mesh->vertex_count;
+    }
+    mesh->triangle_count++;
+}
+
+static void rtin_emit(const Rtin *rtin, float max_error, int ax, int ay, int bx, int by, int cx, int cy,
+                      RtinMesh *mesh)
+{
+    int size = rtin->size;
+    int mx = (ax + bx) >> 1, my = (ay + by) >> 1;
+    
+    if (abs(ax - cx) + abs(ay - cy) > 1 && MAP_AT(rtin->errors, size, mx, my) > max_error)
+    {
+        rtin_emit(rtin, max_error, cx, cy, ax, ay, mx, my, mesh);
+        rtin_emit(rtin, max_error, bx, by, cx, cy, mx, my, mesh);
+        return;
+    }
+    
+    int xs[3] = {ax, bx, cx}, ys[3] = {ay, by, cy};
+    unsigned int *triangle = mesh->triangles + 3 * (size_t)mesh->triangle_count++;
+    
+    for (int k = 0; k < 3; k++)
+    {
+        unsigned int index = MAP_AT(rtin->indices, size, xs[k], ys[k]) - 1;
+        mesh->vertices[2 * index] = xs[k];
+        mesh->vertices[2 * index + 1] = ys[k];
+        triangle[k] = index;
+    }
+    
+    /* Counter-clockwise from above (same as the full grid of the exporters) */
+    if ((bx - ax) * (cy - ay) - (by - ay) * (cx - ax) > 0)
+    {
+        unsigned int swap = triangle[1]; triangle[1] = triangle[2]; triangle[2] = swap;
+    }
+}
+
+/* ----------------------------------------------------------------------------
+ * Mesh of the map within max_error (height units) of it. The arrays of
+ * 'mesh' are reused (grown if needed) from one extraction to the next;
+ * zero-initialise it before the first one. Returns 0 if out of memory.
+ * ---------------------------------------------------------------------------- */
+int rtin_extract(Rtin *rtin, float max_error, RtinMesh *mesh)
+{
+    int tile = rtin->size - 1;
+    
+    mesh->vertex_count = 0;
+    mesh->triangle_count = 0;
+    rtin_count(rtin, max_error, 0, 0, tile, tile, tile, 0, mesh);
+    rtin_count(rtin, max_error, tile, tile, 0, 0, 0, tile, mesh);
+    
+    if (mesh->vertex_count > mesh->vertex_capacity)
+    {
+        int *vertices = realloc(mesh->vertices, (size_t)mesh->vertex_count * 2 * sizeof(int));
+        if (vertices != NULL)
+        {
+            mesh->vertices = vertices;
+            mesh->vertex_capacity = mesh->vertex_count;
+        }
+    }
+    if (mesh->triangle_count > mesh->triangle_capacity)
+    {
+        unsigned int *triangles = realloc(mesh->triangles, (size_t)mesh->triangle_count * 3 * sizeof(unsigned int));
+        if (triangles != NULL)
+        {
+            mesh->triangles = triangles;
+            mesh->triangle_capacity = mesh->triangle_count;
+        }
+    }
+    
+    int ok = mesh->vertex_count <= mesh->vertex_capacity && mesh->triangle_count <= mesh->triangle_capacity;
+    if (ok)
+    {
+        mesh->triangle_count = 0;
+        rtin_emit(rtin, max_error, 0, 0, tile, tile, tile, 0, mesh);
+        rtin_emit(rtin, max_error, tile, tile, 0, 0, 0, tile, mesh);
+        
+        for (int i = 0; i < mesh->vertex_count; i++)
+        {
+            MAP_AT(rtin->indices, rtin->size, mesh->vertices[2 * i], mesh->vertices[2 * i + 1]) = 0;
+        }
+    }
+    else
+    {
+        /* Without the vertex list the numbering has to be cleared in full */
+        memset(rtin->indices, 0, (size_t)rtin->size * rtin->size * sizeof(unsigned int));
+        mesh->vertex_count = 0;
+        mesh->triangle_count = 0;
+    }
+    
+    return ok;
+}
+
+void rtin_mesh_free(RtinMesh *mesh)
+{
+    free(mesh->vertices);
+    free(mesh->triangles);
+    memset(mesh, 0, sizeof(*mesh));
+}
+
+/* ----------------------------------------------------------------------------
+ * Mesh export. Vertex (x, y) of the map is at position (x, -height, y) (Y
+ * up, the height being -z as in the views; one unit per sample), with the
+ * normal from central differences and the calculate_height_color colour.
+ * The full grid has vertex x * size + y
+ * and 2 triangles per cell, generated from the row and column while
+ * writing: nothing is stored per vertex. A simplified mesh (mesh->rtin)
+ * lists its vertices and triangles. Triangles are counter-clockwise seen
+ * from above.
+ * ---------------------------------------------------------------------------- */
+static void mesh_vertex(const MeshExport *mesh, int x, int y, float position[3], float normal[3], Color *color)
+{
+    const float *map = mesh->map;
+    int size = mesh->size;
+    int x0 = x > 0 ? x - 1 : x, x1 = x < size - 1 ? x + 1 : x;
+    int y0 = y > 0 ? y - 1 : y, y1 = y < size - 1 ? y + 1 : y;
+    float height = MAP_AT(map, size, x, y);
+    float dx = (MAP_AT(map, size, x1, y) - MAP_AT(map, size, x0, y)) / (float)(x1 - x0);
+    float dy = (MAP_AT(map, size, x, y1) - MAP_AT(map, size, x, y0)) / (float)(y1 - y0);
+    float length = sqrtf(dx * dx + 1.0f + dy * dy);
+    
+    position[0] = (float)x;
+    position[1] = -height;
+    position[2] = (float)y;
+    normal[0] = dx / length;
+    normal[1] = 1.0f / length;
+    normal[2] = dy / length;
+    *color = calculate_height_color(height, mesh->high, mesh->low);
+}
+
+static size_t mesh_vertex_count(const MeshExport *mesh)
+{
+    return mesh->rtin != NULL ? (size_t)mesh->rtin->vertex_count : (size_t)mesh->size * mesh->size;
+}
+
+static size_t mesh_triangle_count(const MeshExport *mesh)
+{
+    return mesh->rtin != NULL ? (size_t)mesh->rtin->triangle_count : 2 * (size_t)(mesh->size - 1) * (mesh->size - 1);
+}
+
+/* Map sample of vertex i */
+static inline void mesh_vertex_sample(const MeshExport *mesh, size_t i, int *x, int *y)
+{
+    if (mesh->rtin != NULL)
+    {
+        *x = mesh->rtin->vertices[2 * i];
+        *y = mesh->rtin->vertices[2 * i + 1];
+    }
+    else
+    {
+        *x = (int)(i / (size_t)mesh->size);
+        *y = (int)(i % (size_t)mesh->size);
+    }
+}
+
+/* Corners of triangle t, 'base' added (1 for OBJ) */
+static inline void mesh_triangle(const MeshExport *mesh, size_t t, unsigned int base, unsigned int corners[3])
+{
+    if (mesh->rtin != NULL)
+    {
+        for (int k = 0; k < 3; k++) corners[k] = mesh->rtin->triangles[3 * t + k] + base;
+        return;
+    }
+    
+    /* Cell (x, y) with corners a = (x, y), b = (x + 1, y), c = (x, y + 1), d: a c b, b c d */
+    size_t cell = t / 2;
+    unsigned int size = (unsigned int)mesh->size;
+    unsigned int x = (unsigned int)(cell / (size - 1)), y = (unsigned int)(cell % (size - 1));
+    unsigned int a = x * size + y + base;
+    
+    if (t % 2 == 0)
+    {
+        corners[0] = a; corners[1] = a + 1; corners[2] = a + size;
+    }
+    else
+    {
+        corners[0] = a + size; corners[1] = a + 1; corners[2] = a + size + 1;
+    }
+}
+
+/* Write a 32-bit little-endian value */
+static void put_le32(unsigned char *out, unsigned int value)
+{
+    out[0] = (unsigned char)value;
+    out[1] = (unsigned char)(value >> 8);
+    out[2] = (unsigned char)(value >> 16);
+    out[3] = (unsigned char)(value >> 24);
+}
+
+static void put_le_float(unsigned char *out, float value)
+{
+    unsigned int bits;
+    memcpy(&bits, &value, 4);
+    put_le32(out, bits);
+}
+
+/* ----------------------------------------------------------------------------
+ * Text numbers for OBJ, much faster than printf: an unsigned integer, and
+ * a value with 'decimals' fixed decimals (|value| < 2^53 / 10^decimals).
+ * Return the characters written.
+ * ---------------------------------------------------------------------------- */
+static int format_uint(char *out, unsigned long long value)
+{
+    char digits[20];
+    int count = 0;
+    
+    do
+    {
+        digits[count++] = (char)('0' + value % 10);
+        value /= 10;
+    } while (value > 0);
+    
+    for (int k = 0; k < count; k++) out[k] = digits[count - 1 - k];
+    return count;
+}
+
+static int format_fixed(char *out, float value, int decimals)
+{
+    static const double scales[] = {1.0, 10.0, 100.0, 1000.0, 10000.0};
+    double scaled = (double)value * scales[decimals];
+    long long units = (long long)(scaled < 0.0 ? scaled - 0.5 : scaled + 0.5);
+    unsigned long long magnitude = units < 0 ? (unsigned long long)-units : (unsigned long long)units;
+    unsigned long long whole = magnitude / (unsigned long long)scales[decimals];
+    unsigned long long fraction = magnitude % (unsigned long long)scales[decimals];
+    int length = 0;
+    
+    if (units < 0) out[length++] = '-';
+    length += format_uint(out + length, whole);
+    if (decimals > 0)
+    {
+        out[length++] = '.';
+        for (int k = decimals - 1; k >= 0; k--)
+        {
+            out[length + k] = (char)('0' + fraction % 10);
+            fraction /= 10;
+        }
+        length += decimals;
+    }
+    return length;
+}
+
+/* ----------------------------------------------------------------------------
+ * Item encoders: vertices or triangles [first, first + count) into 'out'
+ * (at most the bytes per item given to mesh_write_items each). Return the
+ * bytes written.
+ * ---------------------------------------------------------------------------- */
+static size_t obj_vertex_items(const MeshExport *mesh, size_t first, size_t count, unsigned char *out)
+{
+    char *text = (char *)out;
+    size_t length = 0;
+    
+    for (size_t i = first; i < first + count; i++)
+    {
+        float position[3], normal[3];
+        Color color;
+        int x, y;
+        
+        mesh_vertex_sample(mesh, i, &x, &y);
+        mesh_vertex(mesh, x, y, position, normal, &color);
+        
+        /* v x y z r g b */
+        text[length++] = 'v';
+        text[length++] = ' ';
+        length += (size_t)format_uint(text + length, (unsigned int)x);
+        text[length++] = ' ';
+        length += (size_t)format_fixed(text + length, position[1], 4);
+        text[length++] = ' ';
+        length += (size_t)format_uint(text + length, (unsigned int)y);
+        for (int k = 0; k < 3; k++)
+        {
+            unsigned char channel = k == 0 ? color.r : (k == 1 ? color.g : color.b);
+            text[length++] = ' ';
+            length += (size_t)format_fixed(text + length, channel / 255.0f, 3);
+        }
+        
+        /* vn nx ny nz */
+        text[length++] = '\n';
+        text[length++] = 'v';
+        text[length++] = 'n';
+        for (int k = 0; k < 3; k++)
+        {
+            text[length++] = ' ';
+            length += (size_t)format_fixed(text + length, normal[k], 4);
+        }
+        text[length++] = '\n';
+    }
+    return length;
+}
+
+static size_t obj_triangle_items(const MeshExport *mesh, size_t first, size_t count, unsigned char *out)
+{
+    char *text = (char *)out;
+    size_t length = 0;
+    
+    for (size_t t = first; t < first + count; t++)
+    {
+        unsigned int v[3];
+        
+        mesh_triangle(mesh, t, 1, v);
+        
+        /* f a//a b//b c//c (same index for position and normal) */
+        text[length++] = 'f';
+        for (int k = 0; k < 3; k++)
+        {
+            text[length++] = ' ';
+            length += (size_t)format_uint(text + length, v[k]);
+            text[length++] = '/';
+            text[length++] = '/';
+            length += (size_t)format_uint(text + length, v[k]);
+        }
+        text[length++] = '\n';
+    }
+    return length;
+}
+
+/* PLY vertex: float x, y, z, nx, ny, nz, uchar red, green, blue */
+static size_t ply_vertex_items(const MeshExport *mesh, size_t first, size_t count, unsigned char *out)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        unsigned char *vertex = out + i * 27;
+        float position[3], normal[3];
+        Color color;
+        int x, y;
+        
+        mesh_vertex_sample(mesh, first + i, &x, &y);
+        mesh_vertex(mesh, x, y, position, normal, &color);
+        for (int k = 0; k < 3; k++)
+        {
+            put_le_float(vertex + 4 * k, position[k]);
+            put_le_float(vertex + 12 + 4 * k, normal[k]);
+        }
+        vertex[24] = color.r;
+        vertex[25] = color.g;
+        vertex[26] = color.b;
+    }
+    return count * 27;
+}
+
+/* PLY face: uchar 3, uint a, b, c */
+static size_t ply_triangle_items(const MeshExport *mesh, size_t first, size_t count, unsigned char *out)
+{
+    for (size_t t = 0; t < count; t++)
+    {
+        unsigned char *face = out + t * 13;
+        unsigned int v[3];
+        
+        mesh_triangle(mesh, first + t, 0, v);
+        face[0] = 3;
+        for (int k = 0; k < 3; k++) put_le32(face + 1 + 4 * k, v[k]);
+    }
+    return count * 13;
+}
+
+/* glTF vertex, interleaved: float position[3], normal[3], ubyte colour[4] */
+static size_t glb_vertex_items(const MeshExport *mesh, size_t first, size_t count, unsigned char *out)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        unsigned char *vertex = out + i * 28;
+        float position[3], normal[3];
+        Color color;
+        int x, y;
+        
+        mesh_vertex_sample(mesh, first + i, &x, &y);
+        mesh_vertex(mesh, x, y, position, normal, &color);
+        for (int k = 0; k < 3; k++)
+        {
+            put_le_float(vertex + 4 * k, position[k]);
+            put_le_float(vertex + 12 + 4 * k, normal[k]);
+        }
+        vertex[24] = color.r;
+        vertex[25] = color.g;
+        vertex[26] = color.b;
+        vertex[27] = 255;
+    }
+    return count * 28;
+}
+
+/* glTF indices: uint32 */
+static size_t glb_triangle_items(const MeshExport *mesh, size_t first, size_t count, unsigned char *out)
+{
+    for (size_t t = 0; t < count; t++)
+    {
+        unsigned int v[3];
+        
+        mesh_triangle(mesh, first + t, 0, v);
+        for (int k = 0; k < 3; k++) put_le32(out + t * 12 + 4 * k, v[k]);
+    }
+    return count * 12;
+}
+
+/* ----------------------------------------------------------------------------
+ * Stream 'total' items through an encoder: EXPORT_MESH_RUNS runs of
+ * EXPORT_MESH_CHUNK items at a time are encoded in parallel into one
+ * buffer, then written in order. Returns 0 on I/O error or out of memory.
+ * ---------------------------------------------------------------------------- */
+static int mesh_write_items(FILE *file, const MeshExport *mesh, size_t total, size_t item_bytes,
+                            size_t (*encode)(const MeshExport *mesh, size_t first, size_t count, unsigned char *out))
+{
+    size_t run_bytes = EXPORT_MESH_CHUNK * item_bytes;
+    size_t runs = (total + EXPORT_MESH_CHUNK - 1) / EXPORT_MESH_CHUNK;
+    unsigned char *buffer = malloc(EXPORT_MESH_RUNS * run_bytes);
+    size_t lengths[EXPORT_MESH_RUNS];
+    int ok = buffer != NULL;
+    
+    for (size_t first = 0; ok && first < runs; first += EXPORT_MESH_RUNS)
+    {
+        int count = runs - first < EXPORT_MESH_RUNS ? (int)(runs - first) : EXPORT_MESH_RUNS;
+        
+        #pragma omp parallel for schedule(dynamic)
+        for (int k = 0; k < count; k++)
+        {
+            size_t item = (first + (size_t)k) * EXPORT_MESH_CHUNK;
+            size_t items = total - item < EXPORT_MESH_CHUNK ? total - item : EXPORT_MESH_CHUNK;
+            lengths[k] = encode(mesh, item, items, buffer + (size_t)k * run_bytes);
+        }
+        
+        for (int k = 0; ok && k < count; k++)
+        {
+            ok = fwrite(buffer + (size_t)k * run_bytes, 1, lengths[k], file) == lengths[k];
+        }
+    }
+    
+    free(buffer);
+    return ok;
+}
+
+/* ----------------------------------------------------------------------------
+ * Triangle mesh of the map: Wavefront OBJ (text, vertex colours after the
+ * position), binary little-endian PLY or binary glTF (GLB, interleaved
+ * vertices and 32-bit indices in one buffer). Returns 0 on I/O error, out
+ * of memory or a map too large for 32-bit counts (GLB: a 4 GB file).
+ * ---------------------------------------------------------------------------- */
+static int export_mesh(const MeshExport *mesh, int format, FILE *file)
+{
+    int size = mesh->size;
+    size_t vertices = mesh_vertex_count(mesh);
+    size_t triangles = mesh_triangle_count(mesh);
+    
+    if (triangles * 3 > 0xFFFFFFFFu) return 0;
+    
+    if (format == EXPORT_OBJ)
+    {
+        return fprintf(file, "# terragen %dx%d, %u vertices, %u triangles\n", size, size, (unsigned int)vertices,
+                       (unsigned int)triangles) > 0
+               && mesh_write_items(file, mesh, vertices, 160, obj_vertex_items)
+               && mesh_write_items(file, mesh, triangles, 80, obj_triangle_items);
+    }
+    
+    if (format == EXPORT_PLY)
+    {
+        return fprintf(file, "ply\nformat binary_little_endian 1.0\ncomment terragen %dx%d\n"
+                             "element vertex %u\nproperty float x\nproperty float y\nproperty float z\n"
+                             "property float nx\nproperty float ny\nproperty float nz\n"
+                             "property uchar red\nproperty uchar green\nproperty uchar blue\n"
+                             "element face %u\nproperty list uchar uint vertex_indices\nend_header\n",
+                       size, size, (unsigned int)vertices, (unsigned int)triangles) > 0
+               && mesh_write_items(file, mesh, vertices, 27, ply_vertex_items)
+               && mesh_write_items(file, mesh, triangles, 13, ply_triangle_items);
+    }
+    
+    /* glTF wants the exact height range of the vertices written */
+    float low = mesh->low, high = mesh->high;
+    if (mesh->rtin != NULL)
+    {
+        low = high = MAP_AT(mesh->map, size, 0, 0);
+        for (size_t i = 0; i < vertices; i++)
+        {
+            float height = MAP_AT(mesh->map, size, mesh->rtin->vertices[2 * i], mesh->rtin->vertices[2 * i + 1]);
+            low = fminf(low, height);
+            high = fmaxf(high, height);
+        }
+    }
+    
+    /* GLB: header, JSON chunk (padded with spaces), BIN chunk */
+    size_t vertex_bytes = vertices * 28;
+    size_t index_bytes = triangles * 3 * 4;
+    char json[2048];
+    int json_length = snprintf(json, sizeof(json),
+        "{\"asset\":{\"version\":\"2.0\",\"generator\":\"terragen\"},\"scene\":0,\"scenes\":[{\"nodes\":[0]}],"
+        "\"nodes\":[{\"mesh\":0}],\"meshes\":[{\"primitives\":[{\"attributes\":{\"POSITION\":0,\"NORMAL\":1,"
+        "\"COLOR_0\":2},\"indices\":3,\"mode\":4}]}],\"buffers\":[{\"byteLength\":%u}],"
+        "\"bufferViews\":[{\"buffer\":0,\"byteOffset\":0,\"byteLength\":%u,\"byteStride\":28,\"target\":34962},"
+        "{\"buffer\":0,\"byteOffset\":%u,\"byteLength\":%u,\"target\":34963}],"
+        "\"accessors\":[{\"bufferView\":0,\"byteOffset\":0,\"componentType\":5126,\"count\":%u,\"type\":\"VEC3\","
+        "\"min\":[0,%.9g,0],\"max\":[%d,%.9g,%d]},"
+        "{\"bufferView\":0,\"byteOffset\":12,\"componentType\":5126,\"count\":%u,\"type\":\"VEC3\"},"
+        "{\"bufferView\":0,\"byteOffset\":24,\"componentType\":5121,\"normalized\":true,\"count\":%u,\"type\":\"VEC4\"},"
+        "{\"bufferView\":1,\"byteOffset\":0,\"componentType\":5125,\"count\":%u,\"type\":\"SCALAR\"}]}",
+        (unsigned int)(vertex_bytes + index_bytes), (unsigned int)vertex_bytes, (unsigned int)vertex_bytes,
+        (unsigned int)index_bytes, (unsigned int)vertices, -high, size - 1, -low, size - 1,
+        (unsigned int)vertices, (unsigned int)vertices, (unsigned int)(triangles * 3));
+    size_t json_padded = ((size_t)json_length + 3) & ~(size_t)3;
+    size_t total = 12 + 8 + json_padded + 8 + vertex_bytes + index_bytes;
+    unsigned char header[20];
+    
+    if (total > 0xFFFFFFFFu) return 0;
+    memset(json + json_length, ' ', json_padded - (size_t)json_length);
+    
+    put_le32(header, 0x46546C67);                       // "glTF"
+    put_le32(header + 4, 2);
+    put_le32(header + 8, (unsigned int)total);
+    put_le32(header + 12, (unsigned int)json_padded);
+    put_le32(header + 16, 0x4E4F534A);                  // "JSON"
+    if (fwrite(header, 1, 20, file) != 20 || fwrite(json, 1, json_padded, file) != json_padded) return 0;
+    
+    put_le32(header, (unsigned int)(vertex_bytes + index_bytes));
+    put_le32(header + 4, 0x004E4942);                   // "BIN"
+    return fwrite(header, 1, 8, file) == 8
+           && mesh_write_items(file, mesh, vertices, 28, glb_vertex_items)
+           && mesh_write_items(file, mesh, triangles, 12, glb_triangle_items);
+}
+
+/* ----------------------------------------------------------------------------
+ * Export a heightmap in one of the EXPORT_* formats, one row at a time with
+ * one row of extra memory (a few row blocks per thread for PNG):
+ * - raw: little-endian float32 heights as they are (smaller is higher)
+ * - r16: little-endian int16, high..low mapped to -32768..32767
+ * - pgm: binary 16-bit PGM (big-endian), high..low mapped to 0..65535
+ * - png: 16-bit grayscale PNG, same mapping as pgm
+ * - obj, ply, glb: triangle mesh (see export_mesh), colours over low..high,
+ *   simplified within simplify_error by RTIN if not negative
+ * Rows are map rows (samples (x, 0) .. (x, size - 1)). Returns 0 on I/O
+ * error or out of memory.
+ * ---------------------------------------------------------------------------- */
+int export_heightmap(const float *map, int size, float low, float high, int format, const char *path)
+{
+    FILE *file = fopen(path, "wb");
+    if (file == NULL) return 0;
+    
+    unsigned short *samples = malloc((size_t)size * sizeof(unsigned short));
+    unsigned char *bytes = malloc((size_t)size * 4);
+    int ok = samples != NULL && bytes != NULL;
+    
+    if (ok && format == EXPORT_PNG)
+    {
+        ok = export_png(map, size, low, high, file);
+    }
+    else if (ok && format >= EXPORT_OBJ)
+    {
+        MeshExport mesh = {map, size, low, high, NULL};
+        Rtin rtin;
+        RtinMesh simplified = {0};
+        
+        if (simplify_error >= 0.0f)
+        {
+            ok = rtin_init(&rtin, map, size);
+            if (ok)
+            {
+                ok = rtin_extract(&rtin, simplify_error, &simplified);
+                rtin_free(&rtin);
+            }
+            mesh.rtin = &simplified;
+        }
+        if (ok) ok = export_mesh(&mesh, format, file);
+        rtin_mesh_free(&simplified);
+    }
+    else if (ok)
+    {
+        if (format == EXPORT_PGM) ok = fprintf(file, "P5\n%d %d\n65535\n", size, size) > 0;
+        
+        for (int x = 0; ok && x < size; x++)
+        {
+            const float *row = &MAP_AT(map, size, x, 0);
+            size_t length = (size_t)size * 2;
+            
+            if (format == EXPORT_RAW)
+            {
+                for (int y = 0; y < size; y++)
+                {
+                    unsigned int v;
+                    memcpy(&v, &row[y], 4);
+                    bytes[4 * y] = (unsigned char)v;
+                    bytes[4 * y + 1] = (unsigned char)(v >> 8);
+                    bytes[4 * y + 2] = (unsigned char)(v >> 16);
+                    bytes[4 * y + 3] = (unsigned char)(v >> 24);
+                }
+                length = (size_t)size * 4;
+            }
+            else
+            {
+                export_quantize_row(row, size, low, high, samples);
+                for (int y = 0; y < size; y++)
+                {
+                    /* r16: offset to signed, low byte first; pgm: high byte first */
+                    unsigned int v = format == EXPORT_R16 ? (unsigned int)samples[y] ^ 0x8000u : samples[y];
+                    bytes[2 * y] = (unsigned char)(format == EXPORT_R16 ? v : v >> 8);
+                    bytes[2 * y + 1] = (unsigned char)(format == EXPORT_R16 ? v >> 8 : v);
+                }
+            }
+            
+            ok = fwrite(bytes, 1, length, file) == length;
+        }
+    }
+    
+    free(samples);
+    free(bytes);
+    return fclose(file) == 0 && ok;
+}
+
+/* ----------------------------------------------------------------------------
+ * Export stage: the context terrain in 'format', the 16-bit formats over
+ * its min..max height (terrain_context_min_max first). Returns 0 on I/O
+ * error or out of memory.
+ * ---------------------------------------------------------------------------- */
+int terrain_context_export(const TerrainContext *ctx, const char *path, int format)
+{
+    return export_heightmap(ctx->map, ctx->size, ctx->min_height, ctx->max_height, format, path);
+}
+
+/* ----------------------------------------------------------------------------
+ * Single terrain export: generate one terrain through every stage and
+ * write it to 'path', in the format of its extension. Run with
+ * "terragen --export FILE [--size S] [--seed S] [...]".
+ * ---------------------------------------------------------------------------- */
+int run_export(int size, unsigned int seed, const char *path)
+{
+    TerrainContext ctx;
+    
+    if (!terrain_context_init(&ctx, size))
+    {
+        fprintf(stderr, "Out of memory for %dx%d\n", size, size);
+        return 1;
+    }
+    
+    terrain_context_generate(&ctx, seed);
+    blur_terrain(ctx.map, size);
+    erode_terrain(ctx.map, size, seed);
+    filter_terrain(ctx.map, size);
+    terrain_context_min_max(&ctx);
+    
+    double start = get_time_seconds();
+    int ok = terrain_context_export(&ctx, path, export_format_of_path(path));
+    double elapsed = get_time_seconds() - start;
+    
+    if (ok)
+    {
+        printf("Exported %s: %dx%d, seed %u, heights %.2f..%.2f, %.1f ms\n", path, size, size, seed,
+               ctx.min_height, ctx.max_height, elapsed * 1000.0);
+    }
+    else
+    {
+        fprintf(stderr, "Cannot write %s\n", path);
+    }
+    
+    terrain_context_free(&ctx);
+    return ok ? 0 : 1;
+}
+
+/* ----------------------------------------------------------------------------
+ * Software renderer: the isometric view of a map as filled cells, with
+ * the height colours and the Lambert light of the shaded mode, into
+ * width x height RGB pixels (black background), without a window. The
+ * cells are read from the mip level of about one pixel per cell, like the
+ * grid mode. Vertices are projected once by all threads, the triangles
+ * binned to RASTER_TILE pixel tiles in order, then the tiles are filled in
+ * parallel with a depth buffer each (nearest = smallest depth along the
+ * view, first triangle on ties), so the image does not depend on the
+ * thread count. Returns 0 if out of memory.
+ * ---------------------------------------------------------------------------- */
+
+/* Vertices of triangle t: 2 per cell, cells in map order */
+static inline void raster_corners(size_t t, int side, size_t corner[3])
+{
+    size_t cell = t >> 1;
+    size_t a = (cell / (size_t)(side - 1)) * side + cell % (size_t)(side - 1);
+    
+    corner[0] = a + ((t & 1) ? 0 : side + 1);
+    corner[1] = a + side;
+    corner[2] = a + 1;
+}
+
+/* Edge function of a to b at p, computed the same way for both triangles of
+   an edge (from the lower vertex), so shared edges leave no gaps */
+static inline float raster_edge(const float *sx, const float *sy, size_t a, size_t b, float px, float py)
+{
+    if (a > b) return -raster_edge(sx, sy, b, a, px, py);
+    return (sx[b] - sx[a]) * (py - sy[a]) - (sy[b] - sy[a]) * (px - sx[a]);
+}
+
+int render_terrain(const float *map, int size, float low, float high, int width, int height, unsigned char *pixels)
+{
+    float scale, view_x, view_y;
+    HeightMips mips = {0};
+    
+    fit_view(map, size, width, height, 0, &scale, &view_x, &view_y);
+    if (!height_mips_build(&mips, map, size)) return 0;
+    
+    int level = lod_level(scale, mips.levels);
+    int step = 1 << level;
+    int side = ((size - 1) >> level) + 1;
+    const float *heights = height_mips_level(&mips, level);
+    size_t samples = (size_t)side * side;
+    size_t triangles = 2 * (size_t)(side - 1) * (side - 1);
+    int tiles_x = (width + RASTER_TILE - 1) / RASTER_TILE;
+    int tiles_y = (height + RASTER_TILE - 1) / RASTER_TILE;
+    int tiles = tiles_x * tiles_y;
+    
+    float *sx = malloc(samples * sizeof(float));
+    float *sy = malloc(samples * sizeof(float));
+    float *depth = malloc(samples * sizeof(float));
+    float *shade = malloc(samples * sizeof(float));
+    size_t *bin_first = calloc((size_t)tiles + 1, sizeof(size_t));
+    unsigned int *bins = NULL;
+    int ok = sx != NULL && sy != NULL && depth != NULL && shade != NULL && bin_first != NULL;
+    
+    if (ok)
+    {
+        float depth_x = sinf(ROTATION_ANGLE * DEG2RAD) * step;
+        float depth_y = cosf(ROTATION_ANGLE * DEG2RAD) * step;
+        
+        terrain_shade(heights, side, (float)step, shade);
+        
+        #pragma omp parallel for schedule(static)
+        for (int x = 0; x < side; x++)
+        {
+            for (int y = 0; y < side; y++)
+            {
+                size_t i = (size_t)x * side + y;
+                Vector2 base = isometric_projection(x * step, y * step, heights[i]);
+                
+                sx[i] = base.x * scale + view_x;
+                sy[i] = height - (base.y * scale + view_y);
+                depth[i] = x * depth_x + y * depth_y;
+            }
+        }
+        
+        /* Binning: count, then fill in triangle order */
+        for (int pass = 0; ok && pass < 2; pass++)
+        {
+            for (size_t t = 0; t < triangles; t++)
+            {
+                size_t v[3];
+                raster_corners(t, side, v);
+                
+                float x0 = fminf(sx[v[0]], fminf(sx[v[1]], sx[v[2]]));
+                float x1 = fmaxf(sx[v[0]], fmaxf(sx[v[1]], sx[v[2]]));
+                float y0 = fminf(sy[v[0]], fminf(sy[v[1]], sy[v[2]]));
+                float y1 = fmaxf(sy[v[0]], fmaxf(sy[v[1]], sy[v[2]]));
+                if (x1 < 0.0f || y1 < 0.0f || x0 >= width || y0 >= height) continue;
+                
+                int tx0 = x0 > 0.0f ? (int)x0 / RASTER_TILE : 0;
+                int ty0 = y0 > 0.0f ? (int)y0 / RASTER_TILE : 0;
+                int tx1 = x1 < width ? (int)x1 / RASTER_TILE : tiles_x - 1;
+                int ty1 = y1 < height ? (int)y1 / RASTER_TILE : tiles_y - 1;
+                
+                for (int ty = ty0; ty <= ty1; ty++)
+                {
+                    for (int tx = tx0; tx <= tx1; tx++)
+                    {
+                        size_t tile = (size_t)ty * tiles_x + tx;
+                        if (pass == 0) bin_first[tile + 1]++;
+                        else bins[bin_first[tile]++] = (unsigned int)t;
+                    }
+                }
+            }
+            
+            if (pass == 0)
+            {
+                for (int tile = 0; tile < tiles; tile++) bin_first[tile + 1] += bin_first[tile];
+                bins = malloc((bin_first[tiles] > 0 ? bin_first[tiles] : 1) * sizeof(unsigned int));
+                ok = bins != NULL;
+            }
+        }
+        
+        /* The fill pass moved every start to the next bin's */
+        if (ok)
+        {
+            for (int tile = tiles; tile > 0; tile--) bin_first[tile] = bin_first[tile - 1];
+            bin_first[0] = 0;
+        }
+    }
+    
+    if (ok)
+    {
+        #pragma omp parallel for schedule(dynamic)
+        for (int tile = 0; tile < tiles; tile++)
+        {
+            float nearest[RASTER_TILE * RASTER_TILE], tile_height[RASTER_TILE * RASTER_TILE];
+            float tile_shade[RASTER_TILE * RASTER_TILE];
+            int px0 = (tile % tiles_x) * RASTER_TILE, py0 = (tile / tiles_x) * RASTER_TILE;
+            int px1 = px0 + RASTER_TILE < width ? px0 + RASTER_TILE : width;
+            int py1 = py0 + RASTER_TILE < height ? py0 + RASTER_TILE : height;
+            
+            for (int k = 0; k < RASTER_TILE * RASTER_TILE; k++) nearest[k] = 1e30f;
+            
+            for (size_t b = bin_first[tile]; b < bin_first[tile + 1]; b++)
+            {
+                size_t v[3];
+                raster_corners(bins[b], side, v);
+                
+                float area = raster_edge(sx, sy, v[0], v[1], sx[v[2]], sy[v[2]]);
+                if (area == 0.0f) continue;
+                float inverse_area = 1.0f / area;
+                
+                /* Pixel centres inside the bounding box and the tile */
+                float x0 = fminf(sx[v[0]], fminf(sx[v[1]], sx[v[2]]));
+                float x1 = fmaxf(sx[v[0]], fmaxf(sx[v[1]], sx[v[2]]));
+                float y0 = fminf(sy[v[0]], fminf(sy[v[1]], sy[v[2]]));
+                float y1 = fmaxf(sy[v[0]], fmaxf(sy[v[1]], sy[v[2]]));
+                int ix0 = (int)fmaxf(ceilf(x0 - 0.5f), (float)px0), ix1 = (int)fminf(floorf(x1 - 0.5f), (float)(px1 - 1));
+                int iy0 = (int)fmaxf(ceilf(y0 - 0.5f), (float)py0), iy1 = (int)fminf(floorf(y1 - 0.5f), (float)(py1 - 1));
+                
+                for (int py = iy0; py <= iy1; py++)
+                {
+                    for (int px = ix0; px <= ix1; px++)
+                    {
+                        float cx = px + 0.5f, cy = py + 0.5f;
+                        float w0 = raster_edge(sx, sy, v[1], v[2], cx, cy) * inverse_area;
+                        float w1 = raster_edge(sx, sy, v[2], v[0], cx, cy) * inverse_area;
+                        float w2 = raster_edge(sx, sy, v[0], v[1], cx, cy) * inverse_area;
+                        if (w0 < 0.0f || w1 < 0.0f || w2 < 0.0f) continue;
+                        
+                        int k = (py - py0) * RASTER_TILE + (px - px0);
+                        float d = w0 * depth[v[0]] + w1 * depth[v[1]] + w2 * depth[v[2]];
+                        if (d < nearest[k])
+                        {
+                            nearest[k] = d;
+                            tile_height[k] = w0 * heights[v[0]] + w1 * heights[v[1]] + w2 * heights[v[2]];
+                            tile_shade[k] = w0 * shade[v[0]] + w1 * shade[v[1]] + w2 * shade[v[2]];
+                        }
+                    }
+                }
+            }
+            
+            /* Colour of the nearest surface of every pixel */
+            for (int py = py0; py < py1; py++)
+            {
+                unsigned char *out = pixels + ((size_t)py * width + px0) * 3;
+                
+                for (int px = px0; px < px1; px++, out += 3)
+                {
+                    int k = (py - py0) * RASTER_TILE + (px - px0);
+                    Color color = BLACK;
+                    float light = 1.0f;
+                    
+                    if (nearest[k] < 1e30f)
+                    {
+                        color = calculate_height_color(tile_height[k], high, low);
+                        light = tile_shade[k];
+                    }
+                    out[0] = (unsigned char)(color.r * light);
+                    out[1] = (unsigned char)(color.g * light);
+                    out[2] = (unsigned char)(color.b * light);
+                }
+            }
+        }
+    }
+    
+    height_mips_free(&mips);
+    free(sx);
+    free(sy);
+    free(depth);
+    free(shade);
+    free(bin_first);
+    free(bins);
+    return ok;
+}
+
+/* ----------------------------------------------------------------------------
+ * Image formats of the renderer by file extension: 0 png, 1 ppm, -1 other
+ * ---------------------------------------------------------------------------- */
+int image_format_of_path(const char *path)
+{
+    const char *dot = strrchr(path, '.');
+    
+    if (dot != NULL && strcmp(dot + 1, "png") == 0) return 0;
+    if (dot != NULL && strcmp(dot + 1, "ppm") == 0) return 1;
+    return -1;
+}
+
+/* ----------------------------------------------------------------------------
+ * Write RGB pixels as PNG (8 bits per channel) or binary PPM, from the
+ * extension of 'path'. Returns 0 on I/O error or out of memory.
+ * ---------------------------------------------------------------------------- */
+int write_image(const char *path, const unsigned char *pixels, int width, int height)
+{
+    int format = image_format_of_path(path);
+    if (format < 0) return 0;
+    
+    FILE *file = fopen(path, "wb");
+    if (file == NULL) return 0;
+    
+    int ok;
+    if (format == 0)
+    {
+        PngImage image = {width, height, NULL, 0.0f, 0.0f, pixels};
+        ok = png_write(&image, file);
+    }
+    else
+    {
+        size_t bytes = (size_t)width * height * 3;
+        ok = fprintf(file, "P6\n%d %d\n255\n", width, height) > 0 && fwrite(pixels, 1, bytes, file) == bytes;
+    }
+    
+    if (fclose(file) != 0) ok = 0;
+    return ok;
+}
+
+/* ----------------------------------------------------------------------------
+ * Single terrain image: generate one terrain through every stage and
+ * render it to 'path' (.png or .ppm). Run with "terragen --render FILE
+ * [--resolution WxH] [--size S] [--seed S] [...]".
+ * ---------------------------------------------------------------------------- */
+int run_render(int size, unsigned int seed, const char *path, int width, int height)
+{
+    TerrainContext ctx;
+    unsigned char *pixels = malloc((size_t)width * height * 3);
+    
+    if (pixels == NULL || !terrain_context_init(&ctx, size))
+    {
+        fprintf(stderr, "Out of memory for %dx%d\n", size, size);
+        free(pixels);
+        return 1;
+    }
+    
+    terrain_context_generate(&ctx, seed);
+    blur_terrain(ctx.map, size);
+    erode_terrain(ctx.map, size, seed);
+    filter_terrain(ctx.map, size);
+    terrain_context_min_max(&ctx);
+    
+    double t0 = get_time_seconds();
+    int ok = render_terrain(ctx.map, size, ctx.min_height, ctx.max_height, width, height, pixels);
+    double t1 = get_time_seconds();
+    
+    if (!ok)
+    {
+        fprintf(stderr, "Out of memory for the image\n");
+    }
+    else if (!(ok = write_image(path, pixels, width, height)))
+    {
+        fprintf(stderr, "Cannot write %s\n", path);
+    }
+    else
+    {
+        printf("Rendered %s: %dx%d map, %dx%d image, seed %u, render %.1f ms, write %.1f ms\n", path, size, size,
+               width, height, seed, (t1 - t0) * 1000.0, (get_time_seconds() - t1) * 1000.0);
+    }
+    
+    terrain_context_free(&ctx);
+    free(pixels);
+    return ok ? 0 : 1;
+}
+
+/* ----------------------------------------------------------------------------
+ * Batch run: 'count' independent terrains (generate and blur, erode, filter, stats, export)
+ * spread over all threads. Every thread owns one TerrainContext, so nothing
+ * is shared except the job counter. Prints aggregate maps/s and stage times.
+ * Run with "terragen --batch N [--size S] [--seed S] [--erode D] [--erode-grid I]
+ * [--blur B] [--filter F]... [--output DIR [--format F]]".
+ * ---------------------------------------------------------------------------- */
+int run_batch(int count, int size, unsigned int first_seed, const char *output_dir)
+{
+    int threads = get_thread_count();
+    double stage_time[6] = {0.0, 0.0, 0.0, 0.0, 0.0, 0.0};
+    float lowest = 1e9f, highest = -1e9f;
+    int failures = 0;
+    
+    double start = get_time_seconds();
+    
+    #pragma omp parallel num_threads(threads) reduction(+:failures) reduction(min:lowest) reduction(max:highest)
+    {
+        TerrainContext ctx;
+        double generate_time = 0.0, blur_time = 0.0, erosion_time = 0.0, filter_time = 0.0, stats_time = 0.0;
+        double export_time = 0.0;
+        char path[1024];
+        
+        if (!terrain_context_init(&ctx, size))
+        {
+            failures++;
+        }
+        else
+        {
+            #pragma omp for schedule(dynamic)
+            for (int job = 0; job < count; job++)
+            {
+                double t0 = get_time_seconds();
+                terrain_context_generate(&ctx, first_seed + (unsigned int)job);
+                double t1 = get_time_seconds();
+                blur_terrain(ctx.map, size);
+                double t2 = get_time_seconds();
+                erode_terrain(ctx.map, size, ctx.seed);
+                double t3 = get_time_seconds();
+                filter_terrain(ctx.map, size);
+                double t4 = get_time_seconds();
+                terrain_context_min_max(&ctx);
+                double t5 = get_time_seconds();
+                
+                if (ctx.min_height < lowest) lowest = ctx.min_height;
+                if (ctx.max_height > highest) highest = ctx.max_height;
+                
+                if (output_dir != NULL)
+                {
+                    snprintf(path, sizeof(path), "%s/terrain_%05d.%s", output_dir, job, EXPORT_FORMATS[export_format]);
+                    if (!terrain_context_export(&ctx, path, export_format)) failures++;
+                }
+                
+                generate_time += t1 - t0;
+                blur_time += t2 - t1;
+                erosion_time += t3 - t2;
+                filter_time += t4 - t3;
+                stats_time += t5 - t4;
+                export_time += get_time_seconds() - t5;
+            }
+            
+            terrain_context_free(&ctx);
+        }
+        
+        #pragma omp critical
+        {
+            stage_time[0] += generate_time;
+            stage_time[1] += blur_time;
+            stage_time[2] += erosion_time;
+            stage_time[3] += filter_time;
+            stage_time[4] += stats_time;
+            stage_time[5] += export_time;
+        }
+    }
+    
+    double elapsed = get_time_seconds() - start;
+    
+    printf("Batch: %d maps %dx%d on %d threads in %.3f s (%.1f maps/s)\n",
+           count, size, size, threads, elapsed, count / elapsed);
+    printf("  heights from %.2f to %.2f\n", lowest, highest);
+    printf("  generate %10.3f ms/map\n", stage_time[0] * 1000.0 / count);
+    printf("  blur     %10.3f ms/map%s\n", stage_time[1] * 1000.0 / count,
+           blur_settings.type != BLUR_NONE ? "" : " (no --blur)");
+    printf("  erode    %10.3f ms/map%s\n", stage_time[2] * 1000.0 / count,
+           erosion_droplets > 0 || erosion_iterations > 0 ? "" : " (no --erode, --erode-grid)");
+    printf("  filter   %10.3f ms/map%s\n", stage_time[3] * 1000.0 / count,
+           filter_chain.count > 0 ? "" : " (no --filter)");
+    printf("  stats    %10.3f ms/map\n", stage_time[4] * 1000.0 / count);
+    printf("  export   %10.3f ms/map%s\n", stage_time[5] * 1000.0 / count,
+           output_dir != NULL ? "" : " (no --output)");
+    
+    if (failures > 0)
+    {
+        fprintf(stderr, "Batch: %d failures (out of memory or I/O error)\n", failures);
+        return 1;
+    }
+    return 0;
+}
+
+/* ----------------------------------------------------------------------------
+ * Benchmark: region min/max with the pyramid against a scan of the region
+ * ---------------------------------------------------------------------------- */
+int run_pyramid_benchmark(void)
+{
+    const int size = 4097;
+    const int queries = 2000;
+    TerrainContext ctx;
+    HeightPyramid pyramid = {0};
+    
+    if (!terrain_context_init(&ctx, size)) return 1;
+    terrain_context_generate(&ctx, 12345u);
+    
+    double start = get_time_seconds();
+    if (!height_pyramid_build(&pyramid, ctx.map, size))
+    {
+        terrain_context_free(&ctx);
+        return 1;
+    }
+    double build = get_time_seconds() - start;
+    
+    /* Random regions, checked against a plain scan */
+    double pyramid_time = 0.0, scan_time = 0.0;
+    int mismatches = 0;
+    srand(1);
+    
+    for (int q = 0; q < queries; q++)
+    {
+        int x0 = rand() % size, x1 = rand() % size;
+        int y0 = rand() % size, y1 = rand() % size;
+        if (x0 > x1) { int t = x0; x0 = x1; x1 = t; }
+        if (y0 > y1) { int t = y0; y0 = y1; y1 = t; }
+        
+        float low, high, scan_low = MAP_AT(ctx.map, size, x0, y0), scan_high = scan_low;
+        
+        double t0 = get_time_seconds();
+        height_pyramid_query(&pyramid, x0, y0, x1, y1, &low, &high);
+        double t1 = get_time_seconds();
+        for (int x = x0; x <= x1; x++)
+        {
+            for (int y = y0; y <= y1; y++)
+            {
+                scan_low = fminf(scan_low, MAP_AT(ctx.map, size, x, y));
+                scan_high = fmaxf(scan_high, MAP_AT(ctx.map, size, x, y));
+            }
+        }
+        double t2 = get_time_seconds();
+        
+        pyramid_time += t1 - t0;
+        scan_time += t2 - t1;
+        mismatches += low != scan_low || high != scan_high;
+    }
+    
+    printf("\nPyramid %dx%d: build %.2f ms, query %.2f us, scan %.2f us, %s\n",
+           size, size, build * 1000.0, pyramid_time * 1e6 / queries, scan_time * 1e6 / queries,
+           mismatches == 0 ? "exact" : "MISMATCH");
+    
+    height_pyramid_free(&pyramid);
+    terrain_context_free(&ctx);
+    return mismatches != 0;
+}
+
+/* ----------------------------------------------------------------------------
+ * Line of sight by plain marching, 4 steps per cell (benchmark reference)
+ * ---------------------------------------------------------------------------- */
+static int line_of_sight_marching(const float *map, int size, Vector3 from, Vector3 to)
+{
+    float length = sqrtf((to.x - from.x) * (to.x - from.x) + (to.y - from.y) * (to.y - from.y));
+    int steps = (int)(length * 4.0f) + 1;
+    
+    for (int i = 1; i < steps; i++)
+    {
+        float t = (float)i / steps;
+        float x = from.x + (to.x - from.x) * t, y = from.y + (to.y - from.y) * t;
+        int cx = (int)x < size - 1 ? (int)x : size - 2, cy = (int)y < size - 1 ? (int)y : size - 2;
+        float u = x - cx, v = y - cy;
+        float surface = (MAP_AT(map, size, cx, cy) * (1.0f - u) + MAP_AT(map, size, cx + 1, cy) * u) * (1.0f - v) +
+                        (MAP_AT(map, size, cx, cy + 1) * (1.0f - u) + MAP_AT(map, size, cx + 1, cy + 1) * u) * v;
+        if (from.z + (to.z - from.z) * t < surface) return 0;
+    }
+    return 1;
+}
+
+/* ----------------------------------------------------------------------------
+ * Benchmark: lines of sight (pyramid against marching) and viewshed
+ * ---------------------------------------------------------------------------- */
+int run_query_benchmark(void)
+{
+    const int size = 1025;
+    const int rays = 100000;
+    TerrainContext ctx;
+    HeightPyramid pyramid = {0};
+    Vector3 *from = malloc((size_t)rays * sizeof(Vector3));
+    Vector3 *to = malloc((size_t)rays * sizeof(Vector3));
+    unsigned char *visible = malloc((size_t)size * size);
+    unsigned char *exact = malloc((size_t)size * size);
+    int ok = from != NULL && to != NULL && visible != NULL && exact != NULL && terrain_context_init(&ctx, size);
+    
+    if (ok)
+    {
+        terrain_context_generate(&ctx, 12345u);
+        ok = height_pyramid_build(&pyramid, ctx.map, size);
+        if (!ok) terrain_context_free(&ctx);
+    }
+    
+    if (!ok)
+    {
+        free(from);
+        free(to);
+        free(visible);
+        free(exact);
+        return 1;
+    }
+    
+    /* Observers 2 units above random points, looking at random ground points */
+    srand(2);
+    for (int i = 0; i < rays; i++)
+    {
+        int x0 = rand() % size, y0 = rand() % size, x1 = rand() % size, y1 = rand() % size;
+        from[i] = (Vector3){(float)x0, (float)y0, MAP_AT(ctx.map, size, x0, y0) + 2.0f};
+        to[i] = (Vector3){(float)x1, (float)y1, MAP_AT(ctx.map, size, x1, y1) + 2.0f};
+    }
+    
+    double start = get_time_seconds();
+    terrain_line_of_sight_batch(&pyramid, from, to, rays, visible);
+    double pyramid_time = get_time_seconds() - start;
+    
+    int agree = 0, visible_count = 0;
+    start = get_time_seconds();
+    for (int i = 0; i < rays; i++)
+    {
+        int marching = line_of_sight_marching(ctx.map, size, from[i], to[i]);
+        agree += marching == visible[i];
+        visible_count += visible[i];
+    }
+    double marching_time = get_time_seconds() - start;
+    
+    start = get_time_seconds();
+    terrain_viewshed(&pyramid, size / 2, size / 2, 2.0f, visible);
+    double viewshed_time = get_time_seconds() - start;
+    
+    /* The same viewshed as one line of sight per sample */
+    Vector3 eye = {(float)(size / 2), (float)(size / 2), MAP_AT(ctx.map, size, size / 2, size / 2) + 2.0f};
+    start = get_time_seconds();
+    #pragma omp parallel for schedule(dynamic, 4)
+    for (int x = 0; x < size; x++)
+    {
+        for (int y = 0; y < size; y++)
+        {
+            Vector3 target = {(float)x, (float)y, MAP_AT(ctx.map, size, x, y)};
+            MAP_AT(exact, size, x, y) = (unsigned char)((x == size / 2 && y == size / 2)
+                                                        || terrain_line_of_sight(&pyramid, eye, target));
+        }
+    }
+    double exact_time = get_time_seconds() - start;
+    
+    size_t viewshed_agree = 0;
+    for (size_t i = 0; i < (size_t)size * size; i++) viewshed_agree += visible[i] == exact[i];
+    
+    printf("\nLine of sight %dx%d: pyramid %.0f rays/s, marching %.0f rays/s (%.2f%% agree, %.1f%% visible)\n",
+           size, size, rays / pyramid_time, rays / marching_time, 100.0 * agree / rays, 100.0 * visible_count / rays);
+    printf("Viewshed %dx%d: sweep %.1f ms, per-sample lines of sight %.1f ms (%.3f%% agree)\n", size, size,
+           viewshed_time * 1000.0, exact_time * 1000.0, 100.0 * viewshed_agree / ((double)size * size));
+    
+    height_pyramid_free(&pyramid);
+    terrain_context_free(&ctx);
+    free(from);
+    free(to);
+    free(visible);
+    free(exact);
+    return 0;
+}
+
+/* ----------------------------------------------------------------------------
+ * Benchmark: batched sampling, random order with and without Morton sorting,
+ * both with all threads, and the order terrain_sample_batch picks
+ * ---------------------------------------------------------------------------- */
+int run_sampling_benchmark(void)
+{
+    const int size = 4097;
+    const int count = 1 << 22;
+    TerrainContext ctx;
+    float *xs = malloc((size_t)count * sizeof(float));
+    float *ys = malloc((size_t)count * sizeof(float));
+    float *heights = malloc((size_t)count * sizeof(float));
+    float *gx = malloc((size_t)count * sizeof(float));
+    float *gy = malloc((size_t)count * sizeof(float));
+    int ok = xs != NULL && ys != NULL && heights != NULL && gx != NULL && gy != NULL && terrain_context_init(&ctx, size);
+    
+    if (ok)
+    {
+        terrain_context_generate(&ctx, 12345u);
+        
+        srand(3);
+        for (int i = 0; i < count; i++)
+        {
+            xs[i] = (float)rand() / (float)RAND_MAX * (size - 1);
+            ys[i] = (float)rand() / (float)RAND_MAX * (size - 1);
+        }
+        
+        printf("\nSampling %dx%d, %d random queries with gradients (Msamples/s):\n", size, size, count);
+        
+        for (int filter = SAMPLE_BILINEAR; filter <= SAMPLE_BICUBIC && ok; filter++)
+        {
+            /* Both orders as one batch over all threads */
+            double start = get_time_seconds();
+            ok = sample_batch(ctx.map, size, xs, ys, count, filter, 0, heights, gx, gy);
+            double unsorted = get_time_seconds() - start;
+            
+            float check[2] = {heights[count / 3], gx[count - 1]};
+            
+            start = get_time_seconds();
+            ok = ok && sample_batch(ctx.map, size, xs, ys, count, filter, 1, heights, gx, gy);
+            double sorted = get_time_seconds() - start;
+            
+            int sort = filter == SAMPLE_BICUBIC && (size_t)size * size * sizeof(float) > SAMPLE_SORT_CACHE;
+            
+            printf("  %-9s unsorted %8.1f   Morton-sorted %8.1f   default %s %s\n",
+                   filter == SAMPLE_BICUBIC ? "bicubic" : "bilinear", count / unsorted / 1e6, count / sorted / 1e6,
+                   sort ? "sorted" : "unsorted",
+                   check[0] == heights[count / 3] && check[1] == gx[count - 1] ? "" : "MISMATCH");
+        }
+        
+        terrain_context_free(&ctx);
+    }
+    
+    free(xs);
+    free(ys);
+    free(heights);
+    free(gx);
+    free(gy);
+    return !ok;
+}
+
+/* ----------------------------------------------------------------------------
+ * Check: a droplet on the side of a cone changes the ground further from
+ * the apex than where it started, i.e. it runs down toward the rim
+ * ---------------------------------------------------------------------------- */
+static int erosion_runs_downhill(void)
+{
+    const int size = 65;
+    const float centre = (size - 1) * 0.5f, start_x = centre + 10.3f, start_y = centre + 4.7f;
+    float *map = malloc((size_t)size * size * sizeof(float));
     
-    DrawText("X", axis_x.x + 10, SCREEN_HEIGHT - axis_x.y, 14, RED);
-    DrawText("Y", axis_y.x + 10, SCREEN_HEIGHT - axis_y.y, 14, GREEN);
-    DrawText("Z", axis_z.x + 10, SCREEN_HEIGHT - axis_z.y, 14, BLUE);
+    if (map == NULL) return 0;
+    
+    /* Apex (the smallest value, the highest ground) in the middle */
+    for (int x = 0; x < size; x++)
+    {
+        for (int y = 0; y < size; y++) MAP_AT(map, size, x, y) = hypotf(x - centre, y - centre) - centre;
+    }
+    
+    erosion_droplet(map, size, 0, 0, size, size, start_x, start_y);
+    
+    /* Mean distance to the apex of the changes, weighted by their size */
+    double moved = 0.0, distance = 0.0;
+    for (int x = 0; x < size; x++)
+    {
+        for (int y = 0; y < size; y++)
+        {
+            float r = hypotf(x - centre, y - centre);
+            float change = fabsf(MAP_AT(map, size, x, y) - (r - centre));
+            moved += change;
+            distance += change * r;
+        }
+    }
+    
+    free(map);
+    return moved > 0.0 && distance / moved > hypotf(start_x - centre, start_y - centre);
 }
 
 /* ----------------------------------------------------------------------------
- * Calculate normalized height
+ * Benchmark: droplet erosion, with 1 and all threads
  * ---------------------------------------------------------------------------- */
-float calculate_normalized_height(float height, float max_alt, float min_alt)
+int run_erosion_benchmark(void)
 {
-    float range = max_alt - min_alt;
-    float normalized = (height - min_alt) / range;
+    const int sizes[] = {257, 1025};
+    int max_threads = get_thread_count();
     
-    return normalized;
+    int downhill = erosion_runs_downhill();
+    printf("\nDroplet on a cone runs toward the rim: %s\n", downhill ? "yes" : "NO");
+    if (!downhill) return 1;
+    
+    printf("\n%-8s %8s %10s %8s %14s %16s %10s\n", "size", "threads", "droplets", "rounds", "erosion (ms)",
+           "droplets/s", "identical");
+    
+    for (int s = 0; s < (int)(sizeof(sizes) / sizeof(sizes[0])); s++)
+    {
+        int size = sizes[s];
+        int droplets = (size - 1) * (size - 1);     // One per cell
+        size_t count = (size_t)size * size;
+        TerrainContext ctx;
+        float *reference = malloc(count * sizeof(float));
+        
+        if (reference == NULL || !terrain_context_init(&ctx, size))
+        {
+            fprintf(stderr, "Out of memory for %dx%d\n", size, size);
+            free(reference);
+            return 1;
+        }
+        
+        for (int threads = 1; threads <= max_threads; threads = threads < max_threads ? max_threads : threads + 1)
+        {
+#ifdef _OPENMP
+            omp_set_num_threads(threads);
+#endif
+            terrain_context_generate(&ctx, 12345u);
+            double start = get_time_seconds();
+            int rounds = erode_hydraulic(ctx.map, size, droplets, 12345u);
+            double elapsed = get_time_seconds() - start;
+            
+            /* The first run is the reference of the others */
+            if (threads == 1) memcpy(reference, ctx.map, count * sizeof(float));
+            int identical = memcmp(reference, ctx.map, count * sizeof(float)) == 0;
+            
+            printf("%-8d %8d %10d %8d %14.2f %16.0f %10s\n", size, threads, droplets, rounds,
+                   elapsed * 1000.0, droplets / elapsed, identical ? "yes" : "NO");
+        }
+        
+        terrain_context_free(&ctx);
+        free(reference);
+    }
+    
+    /* Grid erosion, a fixed number of iterations */
+    const int grid_sizes[] = {1025, 4097};
+    const int iterations = 20;
+    
+    printf("\n%-8s %8s %10s %14s %16s %10s\n", "size", "threads", "iterations", "erosion (ms)",
+           "Msamples/s", "identical");
+    
+    for (int s = 0; s < (int)(sizeof(grid_sizes) / sizeof(grid_sizes[0])); s++)
+    {
+        int size = grid_sizes[s];
+        size_t count = (size_t)size * size;
+        TerrainContext ctx;
+        float *reference = malloc(count * sizeof(float));
+        int ok = reference != NULL && terrain_context_init(&ctx, size);
+        
+        for (int threads = 1; ok && threads <= max_threads; threads = threads < max_threads ? max_threads : threads + 1)
+        {
+#ifdef _OPENMP
+            omp_set_num_threads(threads);
+#endif
+            terrain_context_generate(&ctx, 12345u);
+            double start = get_time_seconds();
+            ok = erode_grid(ctx.map, size, iterations);
+            double elapsed = get_time_seconds() - start;
+            
+            if (threads == 1) memcpy(reference, ctx.map, count * sizeof(float));
+            int identical = memcmp(reference, ctx.map, count * sizeof(float)) == 0;
+            
+            printf("%-8d %8d %10d %14.2f %16.1f %10s\n", size, threads, iterations, elapsed * 1000.0,
+                   (double)count * iterations / elapsed / 1e6, identical ? "yes" : "NO");
+        }
+        
+        if (reference != NULL && ctx.map != NULL) terrain_context_free(&ctx);
+        free(reference);
+        
+        if (!ok)
+        {
+            fprintf(stderr, "Out of memory for %dx%d\n", size, size);
+            return 1;
+        }
+    }
+    
+#ifdef _OPENMP
+    omp_set_num_threads(max_threads);
+#endif
+    
+    return 0;
 }
 
 /* ----------------------------------------------------------------------------
- * Calculate color based on height
+ * Benchmark: spectral generator against Diamond-Square, with 1 and all threads
  * ---------------------------------------------------------------------------- */
-Color calculate_height_color(float height, float max_alt, float min_alt)
+int run_spectral_benchmark(void)
 {
-    float normalized = calculate_normalized_height(height, max_alt, min_alt);
+    const int sizes[] = {257, 1025, 4097};
+    int max_threads = get_thread_count();
     
-    /* Height levels (inverted: snow at top, water at bottom) */
-    if (normalized < 0.2f)  return COLOR_SNOW;
-    if (normalized < 0.35f) return COLOR_ROCK;
-    if (normalized < 0.65f) return COLOR_GRASS;
-    if (normalized < 0.85f) return COLOR_SAND;
+    printf("\n%-8s %8s %16s %16s %10s %10s\n", "size", "threads", "spectral (ms)", "diamond-sq (ms)",
+           "tileable", "identical");
     
-    return COLOR_WATER;
+    for (int s = 0; s < (int)(sizeof(sizes) / sizeof(sizes[0])); s++)
+    {
+        int size = sizes[s];
+        size_t count = (size_t)size * size;
+        float *map = calloc(count, sizeof(float));
+        float *reference = malloc(count * sizeof(float));
+        int ok = map != NULL && reference != NULL;
+        
+        for (int threads = 1; ok && threads <= max_threads; threads = threads < max_threads ? max_threads : threads + 1)
+        {
+#ifdef _OPENMP
+            omp_set_num_threads(threads);
+#endif
+            double start = get_time_seconds();
+            ok = spectral_generate(map, size, 12345u, SPECTRAL_BETA);
+            double spectral = get_time_seconds() - start;
+            
+            int tileable = 1;
+            for (int i = 0; i < size; i++)
+            {
+                tileable &= MAP_AT(map, size, 0, i) == MAP_AT(map, size, size - 1, i);
+                tileable &= MAP_AT(map, size, i, 0) == MAP_AT(map, size, i, size - 1);
+            }
+            
+            if (threads == 1) memcpy(reference, map, count * sizeof(float));
+            int identical = memcmp(reference, map, count * sizeof(float)) == 0;
+            
+            memset(map, 0, count * sizeof(float));
+            start = get_time_seconds();
+            diamond_square_parallel(map, size, 12345u);
+            double diamond_square = get_time_seconds() - start;
+            
+            printf("%-8d %8d %16.2f %16.2f %10s %10s\n", size, threads, spectral * 1000.0,
+                   diamond_square * 1000.0, tileable ? "yes" : "NO", identical ? "yes" : "NO");
+        }
+        
+        free(map);
+        free(reference);
+        
+        if (!ok)
+        {
+            fprintf(stderr, "Out of memory for %dx%d\n", size, size);
+            return 1;
+        }
+    }
+    
+#ifdef _OPENMP
+    omp_set_num_threads(max_threads);
+#endif
+    
+    return 0;
 }
 
 /* ----------------------------------------------------------------------------
- * Generate terrain using Diamond-Square algorithm
+ * Benchmark: fBm generator, whole maps with 1 and all threads, and chunks
+ * evaluated one at a time (checked against the whole map)
  * ---------------------------------------------------------------------------- */
-void generate_terrain(void)
+int run_fbm_benchmark(void)
 {
-    int length = ITERATIONS - 1;
-    float amplitude = INITIAL_HEIGHT;
+    const int sizes[] = {1025, 4097};
+    const int chunk = 64, chunks = 256;
+    int max_threads = get_thread_count();
+    FbmSettings settings = {FBM_OCTAVES, FBM_LACUNARITY, FBM_GAIN, 0.0f};
     
-    /* Reset min/max */
-    min_height = 0.0f;
-    max_height = 0.0f;
+    printf("\n%-8s %8s %8s %14s %14s %10s\n", "size", "threads", "octaves", "fbm (ms)", "ns/sample", "identical");
     
-    while (length > 1)
+    for (int s = 0; s < (int)(sizeof(sizes) / sizeof(sizes[0])); s++)
     {
-        int half = length / 2;
+        int size = sizes[s];
+        size_t count = (size_t)size * size;
+        float *map = malloc(count * sizeof(float));
+        float *reference = malloc(count * sizeof(float));
         
-        /* SQUARE STEP */
-        for (int x = 0; x < ITERATIONS - 1; x += length)
+        if (map == NULL || reference == NULL)
+        {
+            fprintf(stderr, "Out of memory for %dx%d\n", size, size);
+            free(map);
+            free(reference);
+            return 1;
+        }
+        
+        settings.frequency = FBM_FEATURES / (size - 1);
+        
+        for (int threads = 1; threads <= max_threads; threads = threads < max_threads ? max_threads : threads + 1)
+        {
+#ifdef _OPENMP
+            omp_set_num_threads(threads);
+#endif
+            double start = get_time_seconds();
+            fbm_generate(map, size, 12345u, &settings);
+            double elapsed = get_time_seconds() - start;
+            
+            if (threads == 1) memcpy(reference, map, count * sizeof(float));
+            int identical = memcmp(reference, map, count * sizeof(float)) == 0;
+            
+            printf("%-8d %8d %8d %14.2f %14.2f %10s\n", size, threads, settings.octaves, elapsed * 1000.0,
+                   elapsed * 1e9 / count, identical ? "yes" : "NO");
+        }
+        
+        /* Chunks at scattered positions, one at a time (single thread) */
+        float block[64 * 64];
+        int seamless = 1;
+        double start = get_time_seconds();
+        for (int c = 0; c < chunks; c++)
         {
-            for (int y = 0; y < ITERATIONS - 1; y += length)
+            int x0 = (int)(hash_position(7u, c, 0) % (unsigned int)(size - chunk));
+            int y0 = (int)(hash_position(7u, c, 1) % (unsigned int)(size - chunk));
+            
+            fbm_generate_region(block, chunk, x0, y0, chunk, chunk, 12345u, &settings);
+            
+            for (int i = 0; i < chunk; i++)
             {
-                float average = (terrain[x][y] +
-                               terrain[x + length][y] +
-                               terrain[x][y + length] +
-                               terrain[x + length][y + length]) / 4.0f;
-                
-                terrain[x + half][y + half] = average + calculate_noise(amplitude);
+                seamless &= memcmp(&block[i * chunk], &MAP_AT(reference, size, x0 + i, y0), chunk * sizeof(float)) == 0;
             }
         }
+        double elapsed = get_time_seconds() - start;
         
-        /* DIAMOND STEP */
-        for (int x = 0; x < ITERATIONS; x += half)
+        printf("  %dx%d chunks: %.1f us per chunk, %s the whole map\n", chunk, chunk, elapsed * 1e6 / chunks,
+               seamless ? "identical to" : "DIFFERENT from");
+        
+        free(map);
+        free(reference);
+    }
+    
+#ifdef _OPENMP
+    omp_set_num_threads(max_threads);
+#endif
+    
+    return 0;
+}
+
+/* ----------------------------------------------------------------------------
+ * Benchmark: every registered generator, whole maps at several sizes with 1
+ * and all threads. Besides the time it prints the mean slope (mean height
+ * difference between neighbours) and the height range, to compare what the
+ * generators produce.
+ * ---------------------------------------------------------------------------- */
+int run_generator_benchmark(void)
+{
+    const int sizes[] = {257, 1025, 4097};
+    int max_threads = get_thread_count();
+    
+    printf("\n%-16s %-8s %8s %12s %12s %12s %16s %10s\n", "generator", "size", "threads", "time (ms)",
+           "ns/sample", "mean slope", "range", "identical");
+    
+    for (int g = 0; g < GENERATOR_COUNT; g++)
+    {
+        for (int s = 0; s < (int)(sizeof(sizes) / sizeof(sizes[0])); s++)
         {
-            for (int y = (x + half) % length; y < ITERATIONS; y += length)
+            int size = sizes[s];
+            size_t count = (size_t)size * size;
+            float *map = calloc(count, sizeof(float));
+            float *reference = malloc(count * sizeof(float));
+            int ok = map != NULL && reference != NULL;
+            
+            for (int threads = 1; ok && threads <= max_threads; threads = threads < max_threads ? max_threads : threads + 1)
             {
-                float sum = 0.0f;
-                int count = 0;
+#ifdef _OPENMP
+                omp_set_num_threads(threads);
+#endif
+                double start = get_time_seconds();
+                ok = generator_generate(&GENERATORS[g], map, size, 12345u);
+                double elapsed = get_time_seconds() - start;
                 
-                /* Check the 4 neighbors */
-                if (x >= half)
-                {
-                    sum += terrain[x - half][y];
-                    count++;
-                }
-                if (x + half < ITERATIONS)
-                {
-                    sum += terrain[x + half][y];
-                    count++;
-                }
-                if (y >= half)
-                {
-                    sum += terrain[x][y - half];
-                    count++;
-                }
-                if (y + half < ITERATIONS)
+                if (threads == 1) memcpy(reference, map, count * sizeof(float));
+                int identical = memcmp(reference, map, count * sizeof(float)) == 0;
+                
+                double slope = 0.0;
+                #pragma omp parallel for schedule(static) reduction(+:slope)
+                for (int x = 0; x < size - 1; x++)
                 {
-                    sum += terrain[x][y + half];
-                    count++;
+                    for (int y = 0; y < size - 1; y++)
+                    {
+                        slope += fabsf(MAP_AT(map, size, x + 1, y) - MAP_AT(map, size, x, y))
+                               + fabsf(MAP_AT(map, size, x, y + 1) - MAP_AT(map, size, x, y));
+                    }
                 }
+                float low, high;
+                find_min_max(map, count, &low, &high);
                 
-                terrain[x][y] = (sum / count) + calculate_noise(amplitude);
+                printf("%-16s %-8d %8d %12.2f %12.2f %12.4f %7.1f..%-7.1f %10s\n", GENERATORS[g].name, size,
+                       threads, elapsed * 1000.0, elapsed * 1e9 / count, slope / (2.0 * (size - 1) * (size - 1)),
+                       low, high, identical ? "yes" : "NO");
+            }
+            
+            free(map);
+            free(reference);
+            
+            if (!ok)
+            {
+                fprintf(stderr, "Out of memory for %s %dx%d\n", GENERATORS[g].name, size, size);
+                return 1;
             }
         }
+    }
+    
+#ifdef _OPENMP
+    omp_set_num_threads(max_threads);
+#endif
+    
+    return 0;
+}
+
+/* ----------------------------------------------------------------------------
+ * Benchmark: a chain of every filter (smooth, terrace, smooth, redistribute,
+ * sea level) run fused by filter_chain_run, against the same stages run
+ * one at a time (one sweep over the map each), with 1 and all threads.
+ * ---------------------------------------------------------------------------- */
+int run_filter_benchmark(void)
+{
+    const int sizes[] = {1025, 4097};
+    const char *names[] = {"smooth", "terrace", "smooth", "redistribute", "sea-level"};
+    int stage_count = (int)(sizeof(names) / sizeof(names[0]));
+    int max_threads = get_thread_count();
+    FilterChain chain = {0};
+    
+    for (int s = 0; s < stage_count; s++) filter_chain_add(&chain, names[s], 0, NULL);
+    
+    printf("\n%-8s %8s %14s %14s %10s %10s\n", "size", "threads", "fused (ms)", "staged (ms)", "speedup", "identical");
+    
+    for (int s = 0; s < (int)(sizeof(sizes) / sizeof(sizes[0])); s++)
+    {
+        int size = sizes[s];
+        size_t bytes = (size_t)size * size * sizeof(float);
+        float *source = malloc(bytes);
+        float *fused = malloc(bytes);
+        float *staged = malloc(bytes);
+        float *reference = malloc(bytes);
+        int ok = source != NULL && fused != NULL && staged != NULL && reference != NULL;
         
-        length /= 2;
-        amplitude *= powf(2.0f, -ROUGHNESS);
+        if (ok) ok = generator_generate(&GENERATORS[GENERATOR_FBM], source, size, 12345u);
+        
+        for (int threads = 1; ok && threads <= max_threads; threads = threads < max_threads ? max_threads : threads + 1)
+        {
+#ifdef _OPENMP
+            omp_set_num_threads(threads);
+#endif
+            memcpy(fused, source, bytes);
+            double start = get_time_seconds();
+            ok = filter_chain_run(&chain, fused, size);
+            double fused_time = get_time_seconds() - start;
+            
+            memcpy(staged, source, bytes);
+            start = get_time_seconds();
+            for (int k = 0; ok && k < chain.count; k++)
+            {
+                FilterChain single = {{chain.stages[k]}, 1};
+                ok = filter_chain_run(&single, staged, size);
+            }
+            double staged_time = get_time_seconds() - start;
+            
+            if (threads == 1) memcpy(reference, fused, bytes);
+            int identical = memcmp(fused, staged, bytes) == 0 && memcmp(fused, reference, bytes) == 0;
+            
+            printf("%-8d %8d %14.2f %14.2f %9.2fx %10s\n", size, threads, fused_time * 1000.0,
+                   staged_time * 1000.0, staged_time / fused_time, identical ? "yes" : "NO");
+        }
+        
+        free(source);
+        free(fused);
+        free(staged);
+        free(reference);
+        
+        if (!ok)
+        {
+            fprintf(stderr, "Out of memory for the filters of %dx%d\n", size, size);
+            return 1;
+        }
     }
+    
+#ifdef _OPENMP
+    omp_set_num_threads(max_threads);
+#endif
+    
+    return 0;
 }
 
 /* ----------------------------------------------------------------------------
- * Calculate minimum and maximum heights
+ * Benchmark: Gaussian blurs of growing radius and the 3-pass box blur (cost
+ * independent of the radius) in place, with 1 and all threads
  * ---------------------------------------------------------------------------- */
-void calculate_min_max_height(void)
+int run_blur_benchmark(void)
 {
-    /* Calculate min and max heights */
-    min_height = terrain[0][0];
-    max_height = terrain[0][0];
+    const int sizes[] = {1025, 4097};
+    const BlurSettings blurs[] = {
+        {BLUR_GAUSSIAN, 1.0f, 0, 0},
+        {BLUR_GAUSSIAN, 4.0f, 0, 0},
+        {BLUR_BOX, 0.0f, 2, 3},
+        {BLUR_BOX, 0.0f, 16, 3}
+    };
+    int max_threads = get_thread_count();
+    
+    printf("\n%-20s %-8s %8s %12s %12s %10s\n", "blur", "size", "threads", "time (ms)", "ns/sample", "identical");
     
-    for (int x = 0; x < ITERATIONS; x++)
+    for (int s = 0; s < (int)(sizeof(sizes) / sizeof(sizes[0])); s++)
     {
-        for (int y = 0; y < ITERATIONS; y++)
+        int size = sizes[s];
+        size_t bytes = (size_t)size * size * sizeof(float);
+        float *source = calloc((size_t)size * size, sizeof(float));
+        float *map = malloc(bytes);
+        float *reference = malloc(bytes);
+        int ok = source != NULL && map != NULL && reference != NULL;
+        
+        if (ok) diamond_square_breadth_first(source, size, 12345u);
+        
+        for (int b = 0; ok && b < (int)(sizeof(blurs) / sizeof(blurs[0])); b++)
         {
-            if (terrain[x][y] < min_height) min_height = terrain[x][y];
-            if (terrain[x][y] > max_height) max_height = terrain[x][y];
+            const BlurSettings *blur = &blurs[b];
+            char name[32];
+            
+            if (blur->type == BLUR_GAUSSIAN) snprintf(name, sizeof(name), "gaussian %.0f", blur->sigma);
+            else snprintf(name, sizeof(name), "box %d x%d", blur->radius, blur->passes);
+            
+            for (int threads = 1; ok && threads <= max_threads; threads = threads < max_threads ? max_threads : threads + 1)
+            {
+#ifdef _OPENMP
+                omp_set_num_threads(threads);
+#endif
+                memcpy(map, source, bytes);
+                double start = get_time_seconds();
+                if (blur->type == BLUR_GAUSSIAN) ok = blur_gaussian(map, size, blur->sigma);
+                else ok = blur_box(map, size, blur->radius, blur->passes);
+                double elapsed = get_time_seconds() - start;
+                
+                if (threads == 1) memcpy(reference, map, bytes);
+                int identical = memcmp(reference, map, bytes) == 0;
+                
+                printf("%-20s %-8d %8d %12.2f %12.2f %10s\n", name, size, threads, elapsed * 1000.0,
+                       elapsed * 1e9 / ((double)size * size), identical ? "yes" : "NO");
+            }
+        }
+        
+        free(source);
+        free(map);
+        free(reference);
+        
+        if (!ok)
+        {
+            fprintf(stderr, "Out of memory for the blur of %dx%d\n", size, size);
+            return 1;
         }
     }
+    
+#ifdef _OPENMP
+    omp_set_num_threads(max_threads);
+#endif
+    
+    return 0;
 }
 
 /* ----------------------------------------------------------------------------
- * Calculate random noise
+ * Benchmark: every export format (written to a temporary file in the
+ * current directory, then removed) of a 4097x4097 terrain, 1025x1025 for
+ * the meshes, with 1 and all threads: time, output rate in samples/s and
+ * file size
+ * ---------------------------------------------------------------------------- */
+int run_export_benchmark(void)
+{
+    int max_threads = get_thread_count();
+    float *map = malloc((size_t)4097 * 4097 * sizeof(float));
+    
+    if (map == NULL)
+    {
+        fprintf(stderr, "Out of memory for 4097x4097\n");
+        return 1;
+    }
+    
+    printf("\n%-8s %-8s %8s %12s %14s %14s\n", "format", "size", "threads", "time (ms)", "Msamples/s", "bytes/sample");
+    
+    for (int format = 0; format < EXPORT_FORMAT_COUNT; format++)
+    {
+        int size = format < EXPORT_OBJ ? 4097 : 1025;
+        size_t count = (size_t)size * size;
+        float low, high;
+        char path[64];
+        
+        memset(map, 0, count * sizeof(float));
+        diamond_square_breadth_first(map, size, 12345u);
+        find_min_max(map, count, &low, &high);
+        snprintf(path, sizeof(path), "terragen_bench.%s", EXPORT_FORMATS[format]);
+        
+        for (int threads = 1; threads <= max_threads; threads = threads < max_threads ? max_threads : threads + 1)
+        {
+#ifdef _OPENMP
+            omp_set_num_threads(threads);
+#endif
+            double start = get_time_seconds();
+            int ok = export_heightmap(map, size, low, high, format, path);
+            double elapsed = get_time_seconds() - start;
+            
+            long bytes = -1;
+            FILE *file = fopen(path, "rb");
+            if (file != NULL && fseek(file, 0, SEEK_END) == 0) bytes = ftell(file);
+            if (file != NULL) fclose(file);
+            remove(path);
+            
+            if (!ok)
+            {
+                fprintf(stderr, "Cannot write %s\n", path);
+                free(map);
+                return 1;
+            }
+            
+            printf("%-8s %-8d %8d %12.2f %14.1f %14.3f\n", EXPORT_FORMATS[format], size, threads, elapsed * 1000.0,
+                   count / elapsed / 1e6, (double)bytes / count);
+        }
+    }
+    
+#ifdef _OPENMP
+    omp_set_num_threads(max_threads);
+#endif
+    
+    free(map);
+    return 0;
+}
+
+/* ----------------------------------------------------------------------------
+ * Benchmark: RTIN vertex errors of a terrain, then meshes for growing error
+ * thresholds: triangles (share of the full grid) and extraction time, which
+ * follows the triangle count and not the map size
  * ---------------------------------------------------------------------------- */
-float calculate_noise(float amplitude)
+int run_rtin_benchmark(void)
 {
-    return ((float)rand() / (float)RAND_MAX * 2.0f - 1.0f) * amplitude;
+    const int sizes[] = {1025, 4097};
+    const float thresholds[] = {0.05f, 0.25f, 1.0f, 4.0f};
+    
+    printf("\n%-8s %10s %12s %14s %10s %12s\n", "size", "error", "init (ms)", "triangles", "of grid", "extract (ms)");
+    
+    for (int s = 0; s < (int)(sizeof(sizes) / sizeof(sizes[0])); s++)
+    {
+        int size = sizes[s];
+        float *map = calloc((size_t)size * size, sizeof(float));
+        Rtin rtin = {0};
+        RtinMesh mesh = {0};
+        int ok = map != NULL;
+        
+        if (ok) diamond_square_breadth_first(map, size, 12345u);
+        
+        double start = get_time_seconds();
+        if (ok) ok = rtin_init(&rtin, map, size);
+        double init_time = get_time_seconds() - start;
+        
+        for (int t = 0; ok && t < (int)(sizeof(thresholds) / sizeof(thresholds[0])); t++)
+        {
+            start = get_time_seconds();
+            ok = rtin_extract(&rtin, thresholds[t], &mesh);
+            double elapsed = get_time_seconds() - start;
+            
+            printf("%-8d %10.2f %12.2f %14d %9.2f%% %12.2f\n", size, thresholds[t], init_time * 1000.0,
+                   mesh.triangle_count, 100.0 * mesh.triangle_count / (2.0 * (size - 1) * (size - 1)),
+                   elapsed * 1000.0);
+        }
+        
+        rtin_free(&rtin);
+        rtin_mesh_free(&mesh);
+        free(map);
+        
+        if (!ok)
+        {
+            fprintf(stderr, "Out of memory for the RTIN of %dx%d\n", size, size);
+            return 1;
+        }
+    }
+    
+    return 0;
 }
 
 /* ----------------------------------------------------------------------------
- * Reset the 4 corners of the terrain to 0
+ * Benchmark: software renderer, maps of growing size into a window-sized
+ * and a full HD image, with 1 and all threads
  * ---------------------------------------------------------------------------- */
-void reset_canvas_corners(void)
+int run_render_benchmark(void)
 {
-    terrain[0][0] = 0.0f;
-    terrain[0][ITERATIONS - 1] = 0.0f;
-    terrain[ITERATIONS - 1][0] = 0.0f;
-    terrain[ITERATIONS - 1][ITERATIONS - 1] = 0.0f;
+    const int sizes[] = {1025, 4097};
+    const int resolutions[][2] = {{SCREEN_WIDTH, SCREEN_HEIGHT}, {1920, 1080}};
+    int max_threads = get_thread_count();
+    
+    printf("\n%-8s %12s %8s %12s\n", "size", "image", "threads", "render (ms)");
+    
+    for (int s = 0; s < (int)(sizeof(sizes) / sizeof(sizes[0])); s++)
+    {
+        int size = sizes[s];
+        float *map = calloc((size_t)size * size, sizeof(float));
+        unsigned char *pixels = malloc((size_t)1920 * 1080 * 3);
+        int ok = map != NULL && pixels != NULL;
+        float low, high;
+        
+        if (ok)
+        {
+            diamond_square_breadth_first(map, size, 12345u);
+            find_min_max(map, (size_t)size * size, &low, &high);
+        }
+        
+        for (int r = 0; ok && r < (int)(sizeof(resolutions) / sizeof(resolutions[0])); r++)
+        {
+            int width = resolutions[r][0], height = resolutions[r][1];
+            
+            for (int threads = 1; ok && threads <= max_threads; threads = threads < max_threads ? max_threads : threads + 1)
+            {
+#ifdef _OPENMP
+                omp_set_num_threads(threads);
+#endif
+                double start = get_time_seconds();
+                ok = render_terrain(map, size, low, high, width, height, pixels);
+                double elapsed = get_time_seconds() - start;
+                
+                printf("%-8d %7dx%-4d %8d %12.2f\n", size, width, height, threads, elapsed * 1000.0);
+            }
+        }
+        
+#ifdef _OPENMP
+        omp_set_num_threads(max_threads);
+#endif
+        free(map);
+        free(pixels);
+        
+        if (!ok)
+        {
+            fprintf(stderr, "Out of memory for the rendering of %dx%d\n", size, size);
+            return 1;
+        }
+    }
+    
+    return 0;
 }